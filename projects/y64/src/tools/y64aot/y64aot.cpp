@@ -0,0 +1,784 @@
+// y64aot -- translate a y86-64 program to a standalone C++ program
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include "../../y64lib/instruction.hpp"
+#include "../../y64lib/register.hpp"
+#include "../../y64lib/y64cfg.hpp"
+#include "../../y64lib/y64exception.hpp"
+#include "../../y64lib/y64machine.hpp"
+#include "../../y64lib/y64parser.hpp"
+#include "../../y64lib/y64profile.hpp"
+
+using namespace y64;
+
+namespace {
+
+void usageHelp() {
+  std::cerr << "y64aot - y86-64 ahead-of-time translator\n"
+            << "y64aot [options] [-yo|-ys] filename.[yo|ys]\n"
+            << "Translate the program to C++ that runs it natively and "
+               "prints what\nyis --batch prints\n"
+            << "Options:\n"
+            << "  --memory N       guest memory size in bytes\n"
+            << "  -o FILE          write the C++ source to FILE (default: "
+               "filename.cpp)\n"
+            << "  --exe FILE       also compile it to FILE with $CXX "
+               "(default: c++)\n"
+            << "Example: y64aot --exe sum -ys sum.ys && ./sum\n";
+}
+
+// Runtime of the generated program, in three parts around the tables
+// generated for the image: the types, the guest state with its memory
+// accessors, and main() printing the final state like yis --batch
+const char kRuntimeTypes[] = R"RUNTIME(
+// Machine::Stat, then the reasons a translation stops without one
+enum Stat { AOK, HLT, ADR, INS, SMC, MISS };
+
+struct State {
+  std::uint64_t regs[16]; // 0xF is the register named none
+  bool zf, sf, of;
+  Stat stat;
+  std::uint64_t steps;
+  std::uint64_t faultValue;
+};
+
+struct Range {
+  std::uint64_t start;
+  std::uint64_t end;
+};
+
+struct Chunk {
+  std::uint64_t addr;
+  const std::uint8_t *bytes;
+  std::size_t len;
+};
+
+inline std::int64_t s64(std::uint64_t v) {
+  return static_cast<std::int64_t>(v);
+}
+)RUNTIME";
+
+const char kRuntimeState[] = R"RUNTIME(
+State s;
+std::uint8_t *mem;
+
+inline bool load(std::uint64_t addr, std::uint64_t &val) {
+  if (addr > kMemSize - 8) {
+    return false;
+  }
+  std::memcpy(&val, mem + addr, 8);
+  return true;
+}
+
+// Whether the quad at addr overlaps bytes decoded at translation time
+bool writesCode(std::uint64_t addr) {
+  const Range *iter = std::upper_bound(
+      std::begin(kCode), std::end(kCode), addr,
+      [](std::uint64_t a, const Range &r) { return a < r.end; });
+  return iter != std::end(kCode) && iter->start < addr + 8;
+}
+
+inline Stat store(std::uint64_t addr, std::uint64_t val) {
+  if (addr > kMemSize - 8) {
+    return ADR;
+  }
+  if (addr < kCodeHigh && addr + 8 > kCodeLow && writesCode(addr)) {
+    return SMC;
+  }
+  std::memcpy(mem + addr, &val, 8);
+  return AOK;
+}
+
+// A translated function keeps the guest state in locals, and moves it to
+// s around calls and when it returns
+#define Y64_SPILL                                                              \
+  (s.regs[0] = r0, s.regs[1] = r1, s.regs[2] = r2, s.regs[3] = r3,            \
+   s.regs[4] = r4, s.regs[5] = r5, s.regs[6] = r6, s.regs[7] = r7,            \
+   s.regs[8] = r8, s.regs[9] = r9, s.regs[10] = r10, s.regs[11] = r11,        \
+   s.regs[12] = r12, s.regs[13] = r13, s.regs[14] = r14, s.regs[15] = r15,    \
+   s.zf = zf, s.sf = sf, s.of = of, s.steps = steps)
+#define Y64_RELOAD                                                             \
+  (r0 = s.regs[0], r1 = s.regs[1], r2 = s.regs[2], r3 = s.regs[3],            \
+   r4 = s.regs[4], r5 = s.regs[5], r6 = s.regs[6], r7 = s.regs[7],            \
+   r8 = s.regs[8], r9 = s.regs[9], r10 = s.regs[10], r11 = s.regs[11],        \
+   r12 = s.regs[12], r13 = s.regs[13], r14 = s.regs[14], r15 = s.regs[15],    \
+   zf = s.zf, sf = s.sf, of = s.of, steps = s.steps)
+
+// Stop with STAT before the instruction at AT, UNDO instructions of its
+// block, counted on entry, did not run
+#define Y64_FAULT(AT, STAT, VALUE, UNDO)                                       \
+  do {                                                                         \
+    steps -= UNDO;                                                             \
+    Y64_SPILL;                                                                 \
+    s.stat = STAT;                                                             \
+    s.faultValue = VALUE;                                                      \
+    return AT;                                                                 \
+  } while (0)
+#define Y64_READ(AT, DST, UNDO)                                                \
+  do {                                                                         \
+    if (!load(addr, DST)) {                                                    \
+      Y64_FAULT(AT, ADR, addr + 8, UNDO);                                      \
+    }                                                                          \
+  } while (0)
+#define Y64_WRITE(AT, VAL, UNDO)                                               \
+  do {                                                                         \
+    Stat st = store(addr, VAL);                                                \
+    if (st != AOK) {                                                           \
+      Y64_FAULT(AT, st, addr + 8, UNDO);                                       \
+    }                                                                          \
+  } while (0)
+
+// Condition codes of opq from ca and cb, as Machine::getFlags()
+#define Y64_ADDQ_FLAGS(E)                                                      \
+  (zf = (E) == 0, sf = s64(E) < 0,                                             \
+   of = (s64(ca) < 0) == (s64(cb) < 0) && (s64(E) < 0) != (s64(ca) < 0))
+#define Y64_SUBQ_FLAGS(E)                                                      \
+  (zf = (E) == 0, sf = s64(E) < 0,                                             \
+   of = (s64(ca) > 0) == (s64(cb) < 0) && (s64(E) < 0) != (s64(cb) < 0))
+#define Y64_LOGIC_FLAGS(E) (zf = (E) == 0, sf = s64(E) < 0, of = false)
+)RUNTIME";
+
+const char kRuntimeMain[] = R"RUNTIME(
+namespace {
+
+const char *statName(Stat stat) {
+  switch (stat) {
+  case HLT:
+    return "HLT";
+  case ADR:
+    return "ADR";
+  case INS:
+    return "INS";
+  default:
+    return "AOK";
+  }
+}
+
+void printState(std::uint64_t pc) {
+  static const char *const kNames[] = {
+      "%rax", "%rcx", "%rdx", "%rbx", "%rsp", "%rbp", "%rsi", "%rdi",
+      "%r8",  "%r9",  "%r10", "%r11", "%r12", "%r13", "%r14"};
+  std::cout << "PC:" << pc << '\t' << "ZF:" << int{s.zf} << ' '
+            << "SF:" << int{s.sf} << ' ' << "OF:" << int{s.of} << '\t'
+            << "Stat:" << statName(s.stat) << "\n";
+  for (int i = 0; i < 15; ++i) {
+    std::cout << std::setw(4) << kNames[i] << ": " << std::left
+              << std::setw(15) << s.regs[i] << ((i + 1) % 4 == 0 ? "\n" : " ");
+  }
+  std::cout << "\n";
+}
+
+// Report how the program stopped, return the exit code for it
+int reportStop(std::uint64_t pc) {
+  switch (s.stat) {
+  case ADR:
+    std::cerr << "error: Invalid address: 0x" << std::hex
+              << std::setiosflags(std::ios::uppercase) << s.faultValue
+              << "\n";
+    return 3;
+  case INS:
+    std::cerr << "error: Invalid instruction opcode: " << std::hex
+              << std::setiosflags(std::ios::uppercase)
+              << static_cast<std::uint8_t>(s.faultValue) << "\n";
+    return 3;
+  case SMC:
+    std::cerr << "error: Store at pc 0x" << std::hex << pc
+              << " writes translated code, run the program with yis\n";
+    return 4;
+  case MISS:
+    std::cerr << "error: No translation for pc 0x" << std::hex << pc
+              << ", run the program with yis\n";
+    return 4;
+  default:
+    return 0;
+  }
+}
+
+} // namespace
+
+int main() {
+  mem = static_cast<std::uint8_t *>(std::calloc(kMemSize, 1));
+  if (mem == nullptr) {
+    std::cerr << "error: Allocate guest memory failed\n";
+    return 2;
+  }
+  for (const Chunk &c : kImage) {
+    std::memcpy(mem + c.addr, c.bytes, c.len);
+  }
+  s = kStart;
+
+  auto start = std::chrono::steady_clock::now();
+  std::uint64_t pc = run(kStartPC);
+  auto end = std::chrono::steady_clock::now();
+  int ret = reportStop(pc);
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  printState(pc);
+  std::cout << std::dec << "steps: " << s.steps << ", time: " << std::fixed
+            << std::setprecision(6) << seconds << " s, steps/sec: "
+            << std::setprecision(0)
+            << (seconds > 0 ? s.steps / seconds : 0.0) << "\n";
+  std::free(mem);
+  return ret;
+}
+)RUNTIME";
+
+std::string hex(std::uint64_t value) {
+  std::ostringstream str;
+  str << "0x" << std::hex << value << "u";
+  return str.str();
+}
+
+std::string label(std::uint64_t addr) {
+  std::ostringstream str;
+  str << "b_" << std::hex << addr;
+  return str.str();
+}
+
+std::string function(std::uint64_t entry) {
+  std::ostringstream str;
+  str << "f_" << std::hex << entry;
+  return str.str();
+}
+
+std::string reg(std::uint8_t id) { return "r" + std::to_string(id); }
+
+const char *const kConds[] = {"", "le", "l", "e", "ne", "ge", "g"};
+const char *const kOps[] = {"addq", "subq", "andq", "xorq"};
+const char *const kOpSigns[] = {"+", "-", "&", "^"};
+
+// Assembly of d for the comments of the generated code
+std::string describe(const Machine::DecodedInst &d) {
+  auto name = [](std::uint8_t id) {
+    return id == Register::none ? std::string{"none"}
+                                : Register::make(id).name();
+  };
+  std::ostringstream str;
+  str << std::hex;
+  switch (d.icode) {
+  case Instruction::icode_halt:
+    str << "halt";
+    break;
+  case Instruction::icode_nop:
+    str << "nop";
+    break;
+  case Instruction::icode_cmov:
+    str << (d.ifun == 0 ? "rrmovq" : "cmov") << kConds[d.ifun] << " "
+        << name(d.rA) << ", " << name(d.rB);
+    break;
+  case Instruction::icode_irmovq:
+    str << "irmovq $0x" << d.valC << ", " << name(d.rB);
+    break;
+  case Instruction::icode_rmmovq:
+    str << "rmmovq " << name(d.rA) << ", 0x" << d.valC << "(" << name(d.rB)
+        << ")";
+    break;
+  case Instruction::icode_mrmovq:
+    str << "mrmovq 0x" << d.valC << "(" << name(d.rB) << "), " << name(d.rA);
+    break;
+  case Instruction::icode_opq:
+    str << kOps[d.ifun] << " " << name(d.rA) << ", " << name(d.rB);
+    break;
+  case Instruction::icode_jmp:
+    str << (d.ifun == 0 ? "jmp" : "j") << kConds[d.ifun] << " 0x" << d.valC;
+    break;
+  case Instruction::icode_call:
+    str << "call 0x" << d.valC;
+    break;
+  case Instruction::icode_ret:
+    str << "ret";
+    break;
+  case Instruction::icode_pushq:
+    str << "pushq " << name(d.rA);
+    break;
+  case Instruction::icode_popq:
+    str << "popq " << name(d.rA);
+    break;
+  default:
+    break;
+  }
+  return str.str();
+}
+
+// Writes the translation of a Cfg: a C++ function per guest function with
+// a label per block, and run() entering them from any PC
+class Translator {
+public:
+  Translator(const Cfg &cfg, const Machine::Snapshot &image,
+             const Profiler::Symbols &symbols, std::ostream &out)
+      : cfg(cfg), image(image), symbols(symbols), out(out), inside() {}
+
+  void write(const std::string &source);
+
+private:
+  void writeTables();
+  void writeFunction(const Cfg::Function &f);
+  void writeBlock(const Cfg::Block &b);
+  void writeInst(const Machine::DecodedInst &d, std::uint64_t at,
+                 std::uint64_t undo, bool afterSubq);
+  void writeTransfer(std::uint64_t target, const std::string &indent);
+  void writeRun();
+  bool isEntry(std::uint64_t addr) const;
+  std::string condition(std::uint8_t ifun, bool afterSubq) const;
+
+private:
+  const Cfg &cfg;
+  const Machine::Snapshot &image;
+  const Profiler::Symbols &symbols;
+  std::ostream &out;
+  // Blocks of the function being written
+  std::vector<bool> inside;
+};
+
+void Translator::write(const std::string &source) {
+  out << "// Generated by y64aot from " << source << ", do not edit\n\n"
+      << "#include <algorithm>\n#include <chrono>\n#include <cstdint>\n"
+      << "#include <cstdlib>\n#include <cstring>\n#include <iomanip>\n"
+      << "#include <iostream>\n#include <iterator>\n\nnamespace {\n"
+      << kRuntimeTypes;
+  writeTables();
+  out << kRuntimeState << "\n";
+
+  for (const Cfg::Function &f : cfg.getFunctions()) {
+    out << "std::uint64_t " << function(f.entry) << "(std::uint64_t pc);\n";
+  }
+  for (const Cfg::Function &f : cfg.getFunctions()) {
+    writeFunction(f);
+  }
+  writeRun();
+  out << "} // namespace\n" << kRuntimeMain;
+}
+
+void Translator::writeTables() {
+  const Memory::Snapshot &memory = *image.memory;
+  out << "\nconst std::uint64_t kMemSize = " << hex(memory.size()) << ";\n";
+
+  // Bytes of every decoded instruction and of the longest instruction at
+  // each address that faults, as stores there change the program
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> code;
+  auto add = [&](std::uint64_t start, std::uint64_t end) {
+    end = std::min(end, memory.size());
+    if (start >= end) {
+      return;
+    }
+    if (!code.empty() && start <= code.back().second) {
+      code.back().second = std::max(code.back().second, end);
+    } else {
+      code.emplace_back(start, end);
+    }
+  };
+  // Blocks and faults are both in address order, merge them as they come
+  const std::vector<Cfg::Block> &blocks = cfg.getBlocks();
+  auto fault = cfg.getFaults().begin();
+  for (const Cfg::Block &b : blocks) {
+    for (; fault != cfg.getFaults().end() && fault->first < b.start;
+         ++fault) {
+      add(fault->first, fault->first + kMaxInstLen);
+    }
+    add(b.start, b.end);
+  }
+  for (; fault != cfg.getFaults().end(); ++fault) {
+    add(fault->first, fault->first + kMaxInstLen);
+  }
+  out << "const std::uint64_t kCodeLow = "
+      << hex(code.empty() ? 0 : code.front().first)
+      << ";\nconst std::uint64_t kCodeHigh = "
+      << hex(code.empty() ? 0 : code.back().second)
+      << ";\n// Guest bytes holding translated code\nconst Range kCode[] = {\n"
+      << "    {0x0u, 0x0u},\n";
+  for (const auto &range : code) {
+    out << "    {" << hex(range.first) << ", " << hex(range.second) << "},\n";
+  }
+  out << "};\n\n";
+
+  // The image, without its pages of zeros and trailing zeros
+  Memory mem(memory.size());
+  mem.restore(memory);
+  std::vector<std::uint64_t> pages;
+  std::vector<std::uint8_t> bytes(Memory::kPageSize);
+  for (std::uint64_t num : mem.residentPageNumbers()) {
+    std::uint64_t addr = num << Memory::kPageBits;
+    mem.read(addr, bytes.data(), bytes.size());
+    std::size_t len = bytes.size();
+    while (len > 0 && bytes[len - 1] == 0) {
+      --len;
+    }
+    if (len == 0) {
+      continue;
+    }
+
+    out << "const std::uint8_t kPage" << std::hex << num << std::dec
+        << "[] = {";
+    for (std::size_t i = 0; i < len; ++i) {
+      out << (i % 16 == 0 ? "\n    " : " ") << unsigned{bytes[i]} << ",";
+    }
+    out << "\n};\n";
+    pages.push_back(num);
+  }
+  out << "const Chunk kImage[] = {\n";
+  for (std::uint64_t num : pages) {
+    out << "    {" << hex(num << Memory::kPageBits) << ", kPage" << std::hex
+        << num << ", sizeof(kPage" << num << std::dec << ")},\n";
+  }
+  if (pages.empty()) {
+    out << "    {0x0u, nullptr, 0},\n";
+  }
+  out << "};\n\n";
+
+  out << "const std::uint64_t kStartPC = " << hex(image.pc)
+      << ";\nconst State kStart = {\n    {";
+  for (std::size_t i = 0; i < image.regs.size(); ++i) {
+    out << (i == 0 ? "" : i % 4 == 0 ? ",\n     " : ", ")
+        << hex(static_cast<std::uint64_t>(image.regs[i]));
+  }
+  out << "},\n    " << (image.zeroFlag ? "true" : "false") << ", "
+      << (image.signedFlag ? "true" : "false") << ", "
+      << (image.overflowFlag ? "true" : "false") << ", AOK, "
+      << image.steps << "u, 0x0u};\n";
+}
+
+void Translator::writeFunction(const Cfg::Function &f) {
+  const std::vector<Cfg::Block> &blocks = cfg.getBlocks();
+  inside.assign(blocks.size(), false);
+  for (std::size_t b : f.blocks) {
+    inside[b] = true;
+  }
+
+  out << "\n// " << Profiler::functionName(symbols, f.entry) << "\n"
+      << "std::uint64_t " << function(f.entry) << "(std::uint64_t pc) {\n";
+  for (int i = 0; i < 16; ++i) {
+    out << (i % 4 == 0 ? "  std::uint64_t " : " ") << reg(i) << " = s.regs["
+        << i << "]" << (i % 4 == 3 ? ";\n" : ",");
+  }
+  out << "  bool zf = s.zf, sf = s.sf, of = s.of;\n"
+      << "  std::uint64_t steps = s.steps;\n"
+      << "  // Operands of the last opq, and the address of an access\n"
+      << "  [[maybe_unused]] std::uint64_t ca = 0, cb = 0;\n"
+      << "  [[maybe_unused]] std::uint64_t addr = 0, val = 0;\n"
+      << "  if (pc == " << hex(f.entry) << ") {\n"
+      << "    goto " << label(f.entry) << ";\n  }\n";
+  // Calls go back to the switch when the callee returns elsewhere
+  bool calls = false;
+  for (std::size_t b : f.blocks) {
+    const Machine::DecodedInst *d = cfg.findInstruction(blocks[b].start);
+    for (std::uint64_t i = 1; i < blocks[b].instructions; ++i) {
+      d = cfg.findInstruction(d->valP);
+    }
+    calls = calls || (d->icode == Instruction::icode_call &&
+                      isEntry(static_cast<std::uint64_t>(d->valC)));
+  }
+  out << (calls ? "dispatch:\n" : "") << "  switch (pc) {\n";
+  for (std::size_t b : f.blocks) {
+    out << "  case " << hex(blocks[b].start) << ":\n"
+        << "    goto " << label(blocks[b].start) << ";\n";
+  }
+  out << "  default:\n    Y64_SPILL;\n    return pc;\n  }\n";
+
+  for (std::size_t b : f.blocks) {
+    writeBlock(blocks[b]);
+  }
+  out << "}\n";
+}
+
+void Translator::writeBlock(const Cfg::Block &b) {
+  out << label(b.start) << ":\n  steps += " << b.instructions << ";\n";
+
+  bool afterSubq = false;
+  std::uint64_t at = b.start;
+  const Machine::DecodedInst *d = nullptr;
+  for (std::uint64_t i = 0; i < b.instructions; ++i, at = d->valP) {
+    d = cfg.findInstruction(at);
+    out << "  // " << std::hex << "0x" << at << std::dec << ": "
+        << describe(*d) << "\n";
+    writeInst(*d, at, b.instructions - i, afterSubq);
+    if (d->icode == Instruction::icode_opq) {
+      afterSubq = d->ifun == Instruction::ifun_subq;
+    }
+  }
+
+  switch (d->icode) {
+  case Instruction::icode_halt:
+    Y64_FALLTHROUGH;
+  case Instruction::icode_jmp:
+    Y64_FALLTHROUGH;
+  case Instruction::icode_call:
+    Y64_FALLTHROUGH;
+  case Instruction::icode_ret:
+    break;
+  default:
+    writeTransfer(b.end, "  ");
+    break;
+  }
+}
+
+void Translator::writeInst(const Machine::DecodedInst &d, std::uint64_t at,
+                           std::uint64_t undo, bool afterSubq) {
+  std::string rA = reg(d.rA);
+  std::string rB = reg(d.rB);
+  std::string rsp = reg(Register::rsp);
+  std::ostringstream fault;
+  fault << hex(at) << ", ";
+  std::string where = fault.str();
+  std::string after = ", " + std::to_string(undo) + ");\n";
+
+  switch (d.icode) {
+  case Instruction::icode_halt:
+    out << "  Y64_SPILL;\n  s.stat = HLT;\n  return 0;\n";
+    break;
+  case Instruction::icode_nop:
+    break;
+  case Instruction::icode_cmov:
+    if (d.ifun == Instruction::ifun_rrmovq) {
+      out << "  " << rB << " = " << rA << ";\n";
+    } else {
+      out << "  if (" << condition(d.ifun, afterSubq) << ") {\n    " << rB
+          << " = " << rA << ";\n  }\n";
+    }
+    break;
+  case Instruction::icode_irmovq:
+    out << "  " << rB << " = " << hex(d.valC) << ";\n";
+    break;
+  case Instruction::icode_rmmovq:
+    out << "  addr = " << rB << " + " << hex(d.valC) << ";\n"
+        << "  Y64_WRITE(" << where << rA << after;
+    break;
+  case Instruction::icode_mrmovq:
+    out << "  addr = " << rB << " + " << hex(d.valC) << ";\n"
+        << "  Y64_READ(" << where << rA << after;
+    break;
+  case Instruction::icode_opq:
+    out << "  ca = " << rA << ";\n  cb = " << rB << ";\n  " << rB
+        << " = cb " << kOpSigns[d.ifun] << " ca;\n  "
+        << (d.ifun == Instruction::ifun_addq   ? "Y64_ADDQ_FLAGS("
+            : d.ifun == Instruction::ifun_subq ? "Y64_SUBQ_FLAGS("
+                                               : "Y64_LOGIC_FLAGS(")
+        << rB << ");\n";
+    break;
+  case Instruction::icode_jmp:
+    if (d.ifun == Instruction::ifun_jmp) {
+      writeTransfer(d.valC, "  ");
+    } else {
+      out << "  if (" << condition(d.ifun, afterSubq) << ") {\n";
+      writeTransfer(d.valC, "    ");
+      out << "  }\n";
+      writeTransfer(d.valP, "  ");
+    }
+    break;
+  case Instruction::icode_call: {
+    out << "  addr = " << rsp << " - 8;\n"
+        << "  Y64_WRITE(" << where << hex(d.valP) << after << "  " << rsp
+        << " = addr;\n";
+    if (!isEntry(static_cast<std::uint64_t>(d.valC))) {
+      writeTransfer(d.valC, "  ");
+      break;
+    }
+    out << "  Y64_SPILL;\n  pc = " << function(d.valC) << "("
+        << hex(d.valC) << ");\n"
+        << "  if (s.stat != AOK) {\n    return pc;\n  }\n"
+        << "  Y64_RELOAD;\n  if (pc == " << hex(d.valP) << ") {\n";
+    writeTransfer(d.valP, "    ");
+    out << "  }\n  goto dispatch;\n";
+    break;
+  }
+  case Instruction::icode_ret:
+    out << "  addr = " << rsp << ";\n"
+        << "  Y64_READ(" << where << "val" << after << "  " << rsp
+        << " = addr + 8;\n  Y64_SPILL;\n  return val;\n";
+    break;
+  case Instruction::icode_pushq:
+    out << "  addr = " << rsp << " - 8;\n"
+        << "  Y64_WRITE(" << where << rA << after << "  " << rsp
+        << " = addr;\n";
+    break;
+  case Instruction::icode_popq:
+    out << "  addr = " << rsp << ";\n"
+        << "  Y64_READ(" << where << "val" << after << "  " << rsp
+        << " = addr + 8;\n  " << rA << " = val;\n";
+    break;
+  default:
+    Y64_UNREACHABLE("Cfg kept an invalid instruction");
+  }
+}
+
+void Translator::writeTransfer(std::uint64_t target,
+                               const std::string &indent) {
+  std::size_t b = cfg.findBlock(target);
+  if (b != Cfg::kNone && inside[b]) {
+    out << indent << "goto " << label(target) << ";\n";
+    return;
+  }
+
+  auto fault = cfg.getFaults().find(target);
+  if (fault != cfg.getFaults().end()) {
+    out << indent << "Y64_FAULT(" << hex(target) << ", "
+        << (fault->second.stat == Machine::Stat::ADR ? "ADR" : "INS") << ", "
+        << hex(fault->second.value) << ", 0);\n";
+    return;
+  }
+
+  // Not reached for graphs Cfg builds, run() finds the block if any
+  out << indent << "Y64_SPILL;\n" << indent << "return " << hex(target)
+      << ";\n";
+}
+
+void Translator::writeRun() {
+  // Every block is entered through the function it begins, or else the
+  // first function holding it
+  const std::vector<Cfg::Block> &blocks = cfg.getBlocks();
+  const std::vector<Cfg::Function> &functions = cfg.getFunctions();
+  std::vector<std::size_t> owner(blocks.size(), Cfg::kNone);
+  for (std::size_t i = 0; i < functions.size(); ++i) {
+    owner[cfg.findBlock(functions[i].entry)] = i;
+  }
+  for (std::size_t i = 0; i < functions.size(); ++i) {
+    for (std::size_t b : functions[i].blocks) {
+      if (owner[b] == Cfg::kNone) {
+        owner[b] = i;
+      }
+    }
+  }
+
+  out << "\n// Continue at pc until the program stops, return the final PC\n"
+      << "std::uint64_t run(std::uint64_t pc) {\n"
+      << "  while (s.stat == AOK) {\n    switch (pc) {\n";
+  for (std::size_t b = 0; b < blocks.size(); ++b) {
+    if (owner[b] == Cfg::kNone) {
+      continue;
+    }
+    out << "    case " << hex(blocks[b].start) << ":\n      pc = "
+        << function(functions[owner[b]].entry) << "(pc);\n      break;\n";
+  }
+  for (const auto &fault : cfg.getFaults()) {
+    out << "    case " << hex(fault.first) << ":\n      s.stat = "
+        << (fault.second.stat == Machine::Stat::ADR ? "ADR" : "INS")
+        << ";\n      s.faultValue = " << hex(fault.second.value)
+        << ";\n      break;\n";
+  }
+  out << "    default:\n      s.stat = MISS;\n      break;\n"
+      << "    }\n  }\n  return pc;\n}\n";
+}
+
+bool Translator::isEntry(std::uint64_t addr) const {
+  const std::vector<Cfg::Function> &functions = cfg.getFunctions();
+  return std::any_of(
+      functions.begin(), functions.end(),
+      [addr](const Cfg::Function &f) { return f.entry == addr; });
+}
+
+std::string Translator::condition(std::uint8_t ifun, bool afterSubq) const {
+  // After subq, SF ^ OF is cb < ca as in Machine::testCondition()
+  static const char *const kAfterSubq[] = {
+      "true",          "s64(cb) <= s64(ca)", "s64(cb) < s64(ca)", "cb == ca",
+      "cb != ca",      "s64(cb) >= s64(ca)", "s64(cb) > s64(ca)"};
+  static const char *const kFromFlags[] = {
+      "true", "(sf ^ of) | zf", "sf ^ of",           "zf",
+      "!zf",  "!(sf ^ of)",     "!(sf ^ of) && !zf"};
+  return afterSubq ? kAfterSubq[ifun] : kFromFlags[ifun];
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::uint64_t memorySize = Machine::kDefaultMemorySize;
+  const char *outName = nullptr;
+  const char *exeName = nullptr;
+  std::string opt;
+  const char *filename = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "-h" || arg == "--help") {
+      usageHelp();
+      return 0;
+    }
+
+    if (arg == "--memory" && i + 1 < argc) {
+      memorySize = std::strtoull(argv[++i], nullptr, 0);
+    } else if (arg == "-o" && i + 1 < argc) {
+      outName = argv[++i];
+    } else if (arg == "--exe" && i + 1 < argc) {
+      exeName = argv[++i];
+    } else if ((arg == "-ys" || arg == "-yo") && i + 1 < argc &&
+               filename == nullptr) {
+      opt = arg;
+      filename = argv[++i];
+    } else {
+      usageHelp();
+      return 1;
+    }
+  }
+
+  if (filename == nullptr) {
+    usageHelp();
+    return 1;
+  }
+
+  fs::path sourcePath{filename};
+  if (!fs::exists(sourcePath)) {
+    std::cerr << "No such file: '" << filename << "'\n";
+    return 2;
+  }
+
+  Machine cpu{memorySize};
+  Profiler::Symbols symbols;
+  if (opt == "-ys") {
+    std::string source;
+    if (!readSource(filename, source)) {
+      std::cerr << "Read source file '" << filename << "' failed\n";
+      return 2;
+    }
+
+    AsmParser parser{source};
+    try {
+      parser.parseStatements();
+    } catch (ParsingException &e) {
+      std::cerr << e.what() << "\n";
+      return 2;
+    }
+    if (!cpu.load(parser.getOutputBuffer())) {
+      return 2;
+    }
+    symbols = parser.getSymbols();
+  } else if (!cpu.load(filename)) {
+    return 2;
+  }
+
+  Machine::Snapshot image = cpu.snapshot();
+  Cfg cfg{image};
+  fs::path outPath = outName != nullptr
+                         ? fs::path{outName}
+                         : fs::path{sourcePath}.replace_extension(".cpp");
+  {
+    std::ofstream out{outPath};
+    Translator{cfg, image, symbols, out}.write(
+        sourcePath.filename().string());
+    if (!out) {
+      std::cerr << "Write '" << outPath.string() << "' failed\n";
+      return 2;
+    }
+  }
+  std::cout << "y64aot: functions: " << cfg.getFunctions().size()
+            << ", blocks: " << cfg.getBlocks().size()
+            << ", instructions: " << cfg.getInstructions() << ", wrote "
+            << outPath.string() << "\n";
+
+  if (exeName != nullptr) {
+    const char *cxx = std::getenv("CXX");
+    std::string command = std::string{cxx != nullptr ? cxx : "c++"} +
+                          " -O2 -std=c++17 -o '" + exeName + "' '" +
+                          outPath.string() + "'";
+    if (std::system(command.c_str()) != 0) {
+      std::cerr << "Compile '" << outPath.string() << "' failed\n";
+      return 2;
+    }
+  }
+  return 0;
+}
@@ -11,20 +11,45 @@ using namespace std;
 
 namespace {
 
-void usageHelp() { std::cerr << "Usage ./yas filename.ys\n"; }
+void usageHelp() {
+  std::cerr << "Usage ./yas [-O] [--strip-unreachable] filename.ys\n"
+            << "  -O  drop nops, moves of a register to itself and jumps to "
+               "the next\n      instruction, shorten jump chains and turn "
+               "irmovq $0 into xorq,\n      unless a jump or call goes to a "
+               "number no instruction starts at\n"
+            << "  --strip-unreachable\n      drop code no path from address "
+               "0 or from a label used by such code\n      reaches, with a "
+               "warning for each run of it, kept where a jump or call\n"
+               "      goes to a number no instruction starts at\n";
+}
 
 } // namespace
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    usageHelp();
-    return 1;
-  }
+  bool peephole = false;
+  bool strip = false;
+  std::string arg;
+  for (int i = 1; i < argc; ++i) {
+    std::string opt = argv[i];
+    if (opt == "-h" || opt == "--help") {
+      usageHelp();
+      return 0;
+    }
 
-  std::string arg = argv[1];
-  if (arg == "-h" || arg == "--help") {
+    if (opt == "-O") {
+      peephole = true;
+    } else if (opt == "--strip-unreachable") {
+      strip = true;
+    } else if (arg.empty()) {
+      arg = opt;
+    } else {
+      usageHelp();
+      return 1;
+    }
+  }
+  if (arg.empty()) {
     usageHelp();
-    return 0;
+    return 1;
   }
 
   fs::path sourcePath{arg};
@@ -42,6 +67,8 @@ int main(int argc, char **argv) {
 
   fs::path outPath = sourcePath.replace_extension(".yo");
   AsmParser parser{source};
+  parser.setPeephole(peephole);
+  parser.setStripUnreachable(strip);
 
   try {
     parser.parseStatements();
@@ -50,6 +77,23 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (peephole) {
+    const AsmParser::PeepholeStats &stats = parser.getPeepholeStats();
+    std::cout << "peephole: nops: " << stats.nops
+              << ", moves: " << stats.moves << ", jumps: " << stats.jumps
+              << ", chains: " << stats.chains << ", zeros: " << stats.zeros
+              << "\n";
+  }
+  for (const AsmParser::DeadCode &dead : parser.getDeadCode()) {
+    std::cerr << dead.line << ": warning: unreachable code";
+    if (!dead.label.empty()) {
+      std::cerr << " at '" << dead.label << "'";
+    }
+    std::cerr << (dead.removed ? " removed" : " kept")
+              << ", instructions: " << dead.instructions
+              << ", bytes: " << dead.bytes << "\n";
+  }
+
   std::ofstream fout{outPath.c_str(), std::ios::binary};
   parser.emit(fout);
 
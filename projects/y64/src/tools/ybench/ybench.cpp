@@ -0,0 +1,255 @@
+// ybench -- measure y86-64 simulator throughput of each execution engine
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "../../y64lib/y64batch.hpp"
+#include "../../y64lib/y64exception.hpp"
+#include "../../y64lib/y64machine.hpp"
+#include "../../y64lib/y64parser.hpp"
+
+using namespace y64;
+
+namespace {
+
+void usageHelp() {
+  std::cerr << "ybench - y86-64 simulator benchmark\n"
+            << "ybench [--repeat N] [--lanes N] [-yo|-ys] filename.[yo|ys]\n"
+            << "Run the program to completion with every engine and report "
+               "the best of N runs\n"
+            << "With --lanes, also run N copies, copy i starting with i in "
+               "%rdi, on N\nthreaded machines and on one lockstep batch\n";
+}
+
+struct EngineInfo {
+  const char *name;
+  Machine::Engine engine;
+  bool stepLoop; // drive the machine with step() from here instead of run()
+};
+
+const EngineInfo kEngines[] = {
+    {"staged", Machine::Engine::Staged, false},
+    {"step", Machine::Engine::Staged, true},
+    {"threaded", Machine::Engine::Threaded, false},
+    {"jit", Machine::Engine::Jit, false},
+    {"block", Machine::Engine::Block, false},
+    {"pipe", Machine::Engine::Pipe, false},
+};
+
+struct Result {
+  std::uint64_t steps;
+  double seconds;
+  Machine::Stat stat;
+  std::vector<std::int64_t> regs;
+};
+
+void printHeader() {
+  std::cout << std::left << std::setw(10) << "engine" << std::right
+            << std::setw(14) << "steps" << std::setw(14) << "seconds"
+            << std::setw(16) << "steps/sec" << std::setw(10) << "speedup"
+            << "\n";
+}
+
+void printRow(const char *name, const Result &res, const Result &base) {
+  double rate = res.seconds > 0 ? res.steps / res.seconds : 0.0;
+  double speedup = res.seconds > 0 ? base.seconds / res.seconds : 0.0;
+  std::cout << std::left << std::setw(10) << name << std::right
+            << std::setw(14) << res.steps << std::setw(14) << std::fixed
+            << std::setprecision(6) << res.seconds << std::setw(16)
+            << std::setprecision(0) << rate << std::setw(9)
+            << std::setprecision(2) << speedup << "x\n";
+}
+
+// Run `lanes` copies of the image on scalar machines and on a Batch, the
+// results hold the summed steps and every lane's stat, PC and registers
+int compareLanes(const Machine::Snapshot &image, std::size_t lanes,
+                 int repeat) {
+  Result scalar{0, 0.0, Machine::Stat::AOK, {}};
+  Result batch{0, 0.0, Machine::Stat::AOK, {}};
+  Batch::Stats stats{0, 0, 0};
+  for (int r = 0; r < repeat; ++r) {
+    std::vector<std::int64_t> state;
+    std::uint64_t steps = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < lanes; ++i) {
+      Machine cpu{image.memory->size()};
+      cpu.restore(image);
+      cpu.setReg(Register::rdi, static_cast<std::int64_t>(i));
+      cpu.tryRun();
+      steps += cpu.getSteps() - image.steps;
+      state.push_back(cpu.getStat());
+      state.push_back(cpu.getPC());
+      for (std::size_t id = 0; id < Machine::kNumGeneralRegs; ++id) {
+        state.push_back(cpu.getReg(id));
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+    if (r == 0 || seconds < scalar.seconds) {
+      scalar.seconds = seconds;
+    }
+    scalar.steps = steps;
+    scalar.regs = state;
+
+    state.clear();
+    start = std::chrono::steady_clock::now();
+    Batch b{image, lanes};
+    for (std::size_t i = 0; i < lanes; ++i) {
+      b.setReg(i, Register::rdi, static_cast<std::int64_t>(i));
+    }
+    steps = b.run();
+    end = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < lanes; ++i) {
+      state.push_back(b.getStat(i));
+      state.push_back(b.getPC(i));
+      for (std::size_t id = 0; id < Machine::kNumGeneralRegs; ++id) {
+        state.push_back(b.getReg(i, id));
+      }
+    }
+    seconds = std::chrono::duration<double>(end - start).count();
+    if (r == 0 || seconds < batch.seconds) {
+      batch.seconds = seconds;
+    }
+    batch.steps = steps;
+    batch.regs = state;
+    stats = b.getStats();
+  }
+
+  std::cout << "\n" << lanes << " lanes\n";
+  printHeader();
+  printRow("scalar", scalar, scalar);
+  printRow("batch", batch, scalar);
+  std::cout << "batch issued " << stats.issued << " instructions for "
+            << stats.laneSteps << " lane steps, "
+            << stats.handedOff << " lanes handed off\n";
+
+  if (batch.steps != scalar.steps || batch.regs != scalar.regs) {
+    std::cerr << "error: batch disagrees with scalar machines\n";
+    return 3;
+  }
+  return 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int repeat = 5;
+  std::size_t lanes = 0;
+  std::string opt;
+  const char *filename = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "-h" || arg == "--help") {
+      usageHelp();
+      return 0;
+    }
+
+    if (arg == "--repeat" && i + 1 < argc) {
+      repeat = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--lanes" && i + 1 < argc) {
+      lanes = std::strtoull(argv[++i], nullptr, 0);
+    } else if ((arg == "-ys" || arg == "-yo") && i + 1 < argc &&
+               filename == nullptr) {
+      opt = arg;
+      filename = argv[++i];
+    } else {
+      usageHelp();
+      return 1;
+    }
+  }
+
+  if (filename == nullptr || !fs::exists(fs::path{filename})) {
+    usageHelp();
+    return 1;
+  }
+
+  std::vector<std::uint8_t> image;
+  if (opt == "-ys") {
+    std::string source;
+    if (!readSource(filename, source)) {
+      std::cerr << "Read source file '" << filename << "' failed\n";
+      return 2;
+    }
+
+    AsmParser parser{source};
+    try {
+      parser.parseStatements();
+    } catch (ParsingException &e) {
+      std::cerr << e.what() << "\n";
+      return 2;
+    }
+    image = parser.getOutputBuffer();
+  }
+
+  std::vector<Result> results;
+  for (const EngineInfo &info : kEngines) {
+    Result best{0, 0.0, Machine::Stat::AOK, {}};
+    for (int r = 0; r < repeat; ++r) {
+      Machine cpu;
+      bool loaded = opt == "-ys" ? cpu.load(image) : cpu.load(filename);
+      if (!loaded) {
+        return 2;
+      }
+      cpu.setEngine(info.engine);
+
+      auto start = std::chrono::steady_clock::now();
+      try {
+        if (info.stepLoop) {
+          while (cpu.isOk()) {
+            cpu.step();
+          }
+        } else {
+          cpu.run();
+        }
+      } catch (RunningException &) {
+        // the final state is still reported below
+      }
+      auto end = std::chrono::steady_clock::now();
+
+      double seconds = std::chrono::duration<double>(end - start).count();
+      if (r == 0 || seconds < best.seconds) {
+        best.seconds = seconds;
+      }
+      best.steps = cpu.getSteps();
+      best.stat = cpu.getStat();
+      best.regs.clear();
+      for (std::size_t id = 0; id < Machine::kNumGeneralRegs; ++id) {
+        best.regs.push_back(cpu.getReg(id));
+      }
+    }
+    results.push_back(best);
+  }
+
+  printHeader();
+
+  int ret = 0;
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    const Result &res = results[i];
+    printRow(kEngines[i].name, res, results[0]);
+
+    if (res.steps != results[0].steps || res.stat != results[0].stat ||
+        res.regs != results[0].regs) {
+      std::cerr << "error: engine '" << kEngines[i].name
+                << "' disagrees with '" << kEngines[0].name << "'\n";
+      ret = 3;
+    }
+  }
+
+  if (lanes > 0) {
+    Machine cpu;
+    bool loaded = opt == "-ys" ? cpu.load(image) : cpu.load(filename);
+    if (!loaded) {
+      return 2;
+    }
+    int lanesRet = compareLanes(cpu.snapshot(), lanes, repeat);
+    if (lanesRet != 0) {
+      ret = lanesRet;
+    }
+  }
+
+  return ret;
+}
@@ -1,45 +1,689 @@
 // Y64 instruction simulator executable entry
 
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <set>
+#include <sstream>
+#include <thread>
 
 #include "../../y64lib/buffer.hpp"
 #include "../../y64lib/instruction.hpp"
+#include "../../y64lib/y64branch.hpp"
+#include "../../y64lib/y64cache.hpp"
+#include "../../y64lib/y64cfg.hpp"
 #include "../../y64lib/y64exception.hpp"
+#include "../../y64lib/y64fleet.hpp"
+#include "../../y64lib/y64gdb.hpp"
+#include "../../y64lib/y64history.hpp"
 #include "../../y64lib/y64machine.hpp"
 #include "../../y64lib/y64parser.hpp"
+#include "../../y64lib/y64profile.hpp"
+#include "../../y64lib/y64trace.hpp"
 
 using namespace y64;
 
 void usageHelp() {
   std::cerr << "yis - y86-64 simulator\n"
-            << "yis [-yo|-ys] filename.[yo|ys]\n"
-            << "Example: yis -yo foo.yo or yis -ys foo.ys\n";
+            << "yis [options] [-yo|-ys] filename.[yo|ys]\n"
+            << "Options:\n"
+            << "  --batch          run until halt without stepping, print "
+               "final state\n"
+            << "  --max-steps N    stop batch execution after N instructions\n"
+            << "  --engine NAME    batch interpreter: staged, threaded "
+               "(default), jit, block\n"
+            << "                   or pipe, which also reports PIPE cycles "
+               "and stalls\n"
+            << "  --predictor NAME simulate always-taken, btfnt, 2bit or "
+               "gshare branch\n"
+            << "                   prediction and report each jXX, implies "
+               "--batch\n"
+            << "  --cache          simulate L1I/L1D/L2 caches, report hit "
+               "rates and estimated\n"
+            << "                   memory cycles, implies --batch\n"
+            << "  --l1i SPEC       configure one level and imply --cache, "
+               "SPEC is\n"
+            << "  --l1d SPEC       size,ways,line[,lru|plru[,cycles]], for "
+               "example\n"
+            << "  --l2 SPEC        32K,8,64,plru\n"
+            << "  --profile        count instructions per opcode, PC and "
+               "function, implies\n"
+            << "                   --batch\n"
+            << "  --folded FILE    also write the guest call stacks for "
+               "flamegraph.pl\n"
+            << "  --cfg            print the basic blocks, functions and "
+               "loops found without\n"
+            << "                   running the program\n"
+            << "  --trace FILE     record every instruction to FILE, implies "
+               "--batch\n"
+            << "  --replay FILE    rebuild the state after --max-steps "
+               "instructions of a\n"
+            << "                   recorded trace (default: all of them) "
+               "without running\n"
+            << "  --checkpoint N   when stepping, checkpoint every N "
+               "instructions so that\n"
+            << "                   back and last-write replay at most N "
+               "(default 4096)\n"
+            << "  --gdb-port ADDR  serve the GDB remote protocol on TCP port "
+               "ADDR of localhost,\n"
+            << "                   or on the Unix socket at path ADDR, "
+               "instead of stepping\n"
+            << "  --memory N       guest memory size in bytes, allocated in "
+               "4 KiB pages on\n"
+            << "                   first write (default 0x2000)\n"
+            << "  --jobs N         run --instances copies of the program on N "
+               "threads,\n"
+            << "                   0 for one per core; instance i starts "
+               "with i in %rdi\n"
+            << "  --instances M    number of copies for --jobs (default: the "
+               "thread count)\n"
+            << "Example: yis -yo foo.yo or yis --batch -ys foo.ys\n";
+}
+
+static int reportRunningError(const RunningException &e) {
+  std::uint8_t stat = e.getStat();
+  if (stat == Machine::Stat::ADR) {
+    std::cerr << "error: Invalid address: 0x" << std::hex
+              << std::setiosflags(std::ios::uppercase) << e.getValue() << "\n";
+    return 3;
+  }
+
+  if (stat == Machine::Stat::INS) {
+    std::cerr << "error: Invalid instruction opcode: " << std::hex
+              << std::setiosflags(std::ios::uppercase)
+              << static_cast<std::uint8_t>(e.getValue()) << "\n";
+    return 3;
+  }
+
+  return 0;
+}
+
+// Report how the machine stopped, return the exit code for it
+static int reportStop(const Machine &cpu) {
+  if (cpu.getStat() == Machine::Stat::HLT) {
+    std::cout << "mission completed!!!\n";
+    return 0;
+  }
+  return reportRunningError(RunningException{cpu.getStat(),
+                                             cpu.getFaultValue()});
+}
+
+// Report what stopped a machine with TRP
+static void reportTrap(const Machine &cpu) {
+  std::cout << std::hex;
+  switch (cpu.getTrapAccess()) {
+  case Machine::Watch::Read:
+    std::cout << "watchpoint: read of 0x" << cpu.getFaultValue();
+    break;
+  case Machine::Watch::Write:
+    std::cout << "watchpoint: write to 0x" << cpu.getFaultValue();
+    break;
+  default:
+    std::cout << "breakpoint: 0x" << cpu.getFaultValue();
+    break;
+  }
+  std::cout << " at pc 0x" << cpu.getPC() << std::dec << "\n";
+}
+
+static bool addWatchpoint(Machine &cpu, const std::string &addr,
+                          const std::string &len, Machine::Watch kind) {
+  std::uint64_t n = len.empty() ? sizeof(std::int64_t)
+                                : std::strtoull(len.c_str(), nullptr, 0);
+  return !addr.empty() &&
+         cpu.setWatchpoint(std::strtoull(addr.c_str(), nullptr, 0), n, kind);
+}
+
+static int runInteractive(Machine &cpu, std::uint64_t interval) {
+  History history{cpu, interval};
+  cpu.printAllRegs();
+
+  std::cout << "start execute!!!\n"
+            << "Press enter to execute one instruction, or type:\n"
+            << "  step N           execute N instructions\n"
+            << "  continue         execute until a breakpoint, watchpoint "
+               "or the end\n"
+            << "  back [N]         go back N instructions (default 1)\n"
+            << "  last-write ADDR  go back to right before the last write "
+               "to ADDR\n"
+            << "  break ADDR       stop before the instruction at ADDR\n"
+            << "  watch ADDR [LEN] stop before a write to [ADDR, ADDR + LEN) "
+               "(default 8),\n"
+            << "                   rwatch before a read, awatch before "
+               "either\n"
+            << "  delete [ADDR]    remove the breakpoint and watchpoints at "
+               "ADDR, or all\n"
+            << "  quit\n";
+
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    std::istringstream in{line};
+    std::string cmd;
+    std::string arg;
+    std::string arg2;
+    in >> cmd >> arg >> arg2;
+    std::uint64_t n = arg.empty() ? 1 : std::strtoull(arg.c_str(), nullptr, 0);
+    bool stopped = !cpu.isOk() && cpu.getStat() != Machine::Stat::TRP;
+
+    if (cmd.empty() || cmd == "step" || cmd == "s" || cmd == "continue" ||
+        cmd == "c") {
+      if (stopped) {
+        std::cout << "the machine has stopped, go back or quit\n";
+        continue;
+      }
+      history.forward(cmd[0] == 'c' ? Machine::kNoStepLimit : n);
+    } else if (cmd == "back" || cmd == "b") {
+      if (history.back(n) < n) {
+        std::cout << "reached the first instruction\n";
+      }
+    } else if ((cmd == "last-write" || cmd == "lw") && !arg.empty()) {
+      if (!history.backToWrite(n)) {
+        std::cout << "no write to 0x" << std::hex << n << std::dec
+                  << " since the start\n";
+        continue;
+      }
+    } else if (cmd == "break" && !arg.empty()) {
+      cpu.setBreakpoint(n);
+      continue;
+    } else if (cmd == "watch" || cmd == "rwatch" || cmd == "awatch") {
+      Machine::Watch kind = cmd == "watch"    ? Machine::Watch::Write
+                            : cmd == "rwatch" ? Machine::Watch::Read
+                                              : Machine::Watch::Access;
+      if (!addWatchpoint(cpu, arg, arg2, kind)) {
+        std::cout << "can not watch '" << arg << ' ' << arg2 << "'\n";
+      }
+      continue;
+    } else if (cmd == "delete") {
+      if (arg.empty()) {
+        std::set<std::uint64_t> all = cpu.getBreakpoints();
+        for (const Machine::Watchpoint &w : cpu.getWatchpoints()) {
+          all.insert(w.addr);
+        }
+        for (std::uint64_t addr : all) {
+          cpu.clearBreakpoint(addr);
+          cpu.clearWatchpoint(addr);
+        }
+      } else if (!cpu.clearBreakpoint(n) && !cpu.clearWatchpoint(n)) {
+        std::cout << "nothing set at 0x" << std::hex << n << std::dec
+                  << "\n";
+      }
+      continue;
+    } else if (cmd == "quit" || cmd == "q") {
+      break;
+    } else {
+      std::cout << "unknown command '" << line << "'\n";
+      continue;
+    }
+
+    cpu.printAllRegs();
+    if (cpu.getStat() == Machine::Stat::TRP) {
+      reportTrap(cpu);
+    } else if (!cpu.isOk()) {
+      reportStop(cpu);
+    }
+  }
+
+  return cpu.isOk() ? 0 : reportStop(cpu);
+}
+
+static int runGdb(Machine &cpu, const char *address) {
+  GdbStub stub{cpu};
+  if (!stub.listen(address)) {
+    std::cerr << "error: Listen on '" << address << "' failed\n";
+    return 2;
+  }
+  std::cout << "waiting for gdb on " << address << "\n" << std::flush;
+  if (!stub.serve()) {
+    std::cerr << "error: Accept on '" << address << "' failed\n";
+    return 2;
+  }
+  return 0;
+}
+
+static double percentOf(std::uint64_t part, std::uint64_t whole) {
+  return whole > 0 ? 100.0 * part / whole : 0.0;
+}
+
+static void printBranches(const BranchPredictor &predictor) {
+  std::cout << "branch predictor: "
+            << BranchPredictor::schemeName(predictor.getScheme())
+            << ", branches: " << predictor.getExecuted()
+            << ", mispredicts: " << predictor.getMispredicts() << " ("
+            << std::fixed << std::setprecision(2)
+            << percentOf(predictor.getMispredicts(), predictor.getExecuted())
+            << "%)\n";
+  std::cout << std::right << std::setw(10) << "pc" << std::setw(10)
+            << "target" << std::setw(14) << "taken" << std::setw(14)
+            << "not taken" << std::setw(14) << "mispredicts" << std::setw(9)
+            << "rate" << "\n";
+  for (const BranchPredictor::Branch &b : predictor.getBranches()) {
+    std::cout << std::hex << std::setw(10) << b.pc << std::setw(10)
+              << b.target << std::dec << std::setw(14) << b.taken
+              << std::setw(14) << b.notTaken << std::setw(14)
+              << b.mispredicts << std::setw(8)
+              << percentOf(b.mispredicts, b.taken + b.notTaken) << "%\n";
+  }
+}
+
+static std::string sizeName(std::uint64_t size) {
+  if (size >= 1024 && size % 1024 == 0) {
+    return std::to_string(size >> 10) + "K";
+  }
+  return std::to_string(size);
+}
+
+static void printCache(const char *name, const Cache &cache) {
+  const Cache::Config &config = cache.getConfig();
+  const Cache::Stats &stats = cache.getStats();
+  std::cout << std::left << std::setw(5) << name << std::right
+            << std::setw(9) << sizeName(config.size) << std::setw(6)
+            << config.ways << std::setw(6) << config.lineSize << std::setw(6)
+            << (config.policy == Cache::Policy::Lru ? "lru" : "plru")
+            << std::setw(14) << stats.accesses << std::setw(14) << stats.hits
+            << std::setw(14) << stats.misses << std::setw(8)
+            << percentOf(stats.misses, stats.accesses) << "%" << std::setw(12)
+            << stats.writebacks << "\n";
+}
+
+static void printCaches(const CacheHierarchy &caches) {
+  std::cout << std::left << std::setw(5) << "cache" << std::right
+            << std::setw(9) << "size" << std::setw(6) << "ways"
+            << std::setw(6) << "line" << std::setw(6) << "repl"
+            << std::setw(14) << "accesses" << std::setw(14) << "hits"
+            << std::setw(14) << "misses" << std::setw(9) << "miss"
+            << std::setw(12) << "writebacks" << "\n"
+            << std::fixed << std::setprecision(2);
+  printCache("L1I", caches.getL1I());
+  printCache("L1D", caches.getL1D());
+  printCache("L2", caches.getL2());
+  std::cout << "memory accesses: " << caches.getMemoryAccesses()
+            << ", estimated memory cycles: " << caches.getCycles() << "\n";
+}
+
+static void printProfile(const Profiler &profiler,
+                         const Profiler::Symbols &symbols) {
+  const std::size_t kTopSites = 10;
+  std::uint64_t executed = profiler.getExecuted();
+  std::cout << "profile: instructions: " << executed << "\n"
+            << std::left << std::setw(10) << "opcode" << std::right
+            << std::setw(14) << "count" << std::setw(9) << "share" << "\n"
+            << std::fixed << std::setprecision(2);
+  for (unsigned opcode = 0; opcode < 256; ++opcode) {
+    std::uint64_t count = profiler.getOpcodeCount(opcode);
+    if (count > 0) {
+      std::cout << std::left << std::setw(10)
+                << Profiler::opcodeName(opcode) << std::right
+                << std::setw(14) << count << std::setw(8)
+                << percentOf(count, executed) << "%\n";
+    }
+  }
+
+  std::vector<Profiler::Site> sites = profiler.getSites();
+  std::cout << std::setw(10) << "pc" << std::setw(14) << "count"
+            << std::setw(9) << "share" << "\n";
+  for (std::size_t i = 0; i < sites.size() && i < kTopSites; ++i) {
+    std::cout << std::hex << std::setw(10) << sites[i].pc << std::dec
+              << std::setw(14) << sites[i].count << std::setw(8)
+              << percentOf(sites[i].count, executed) << "%\n";
+  }
+
+  std::cout << std::left << std::setw(20) << "function" << std::right
+            << std::setw(10) << "calls" << std::setw(14) << "self"
+            << std::setw(14) << "inclusive" << std::setw(9) << "share"
+            << "\n";
+  for (const Profiler::Function &f : profiler.getFunctions()) {
+    std::cout << std::left << std::setw(20)
+              << Profiler::functionName(symbols, f.entry) << std::right
+              << std::setw(10) << f.calls << std::setw(14) << f.self
+              << std::setw(14) << f.inclusive << std::setw(8)
+              << percentOf(f.inclusive, executed) << "%\n";
+  }
+}
+
+static void printLoops(const Cfg &cfg, std::size_t parent,
+                       const Profiler::Symbols &symbols) {
+  const std::vector<Cfg::Loop> &loops = cfg.getLoops();
+  for (const Cfg::Loop &loop : loops) {
+    if (loop.parent != parent) {
+      continue;
+    }
+    std::uint64_t header = cfg.getBlocks()[loop.header].start;
+    std::string name = std::string(2 * (loop.depth - 1), ' ') +
+                       Profiler::functionName(symbols, header);
+    std::cout << std::left << std::setw(20) << name << std::right
+              << std::setw(10) << std::hex << header << std::dec
+              << std::setw(8) << loop.depth << std::setw(8)
+              << loop.blocks.size() << std::setw(14) << loop.instructions
+              << "\n";
+    printLoops(cfg, &loop - loops.data(), symbols);
+  }
+}
+
+static void printCfg(const Cfg &cfg, const Profiler::Symbols &symbols) {
+  const std::vector<Cfg::Block> &blocks = cfg.getBlocks();
+  std::cout << "cfg: blocks: " << blocks.size()
+            << ", instructions: " << cfg.getInstructions()
+            << ", functions: " << cfg.getFunctions().size()
+            << ", loops: " << cfg.getLoops().size() << "\n";
+
+  std::cout << std::setw(10) << "block" << std::setw(10) << "end"
+            << std::setw(8) << "insts" << std::setw(10) << "idom"
+            << std::setw(8) << "loop" << "  succs\n";
+  for (const Cfg::Block &b : blocks) {
+    std::cout << std::hex << std::setw(10) << b.start << std::setw(10)
+              << b.end << std::dec << std::setw(8) << b.instructions
+              << std::hex << std::setw(10);
+    if (b.idom == Cfg::kNone) {
+      std::cout << "-";
+    } else {
+      std::cout << blocks[b.idom].start;
+    }
+    std::cout << std::setw(8);
+    if (b.loop == Cfg::kNone) {
+      std::cout << "-";
+    } else {
+      std::cout << blocks[cfg.getLoops()[b.loop].header].start;
+    }
+    std::cout << " ";
+    for (std::size_t succ : b.succs) {
+      std::cout << " " << blocks[succ].start;
+    }
+    std::cout << std::dec << (b.faults ? "  faults" : "") << "\n";
+  }
+
+  std::cout << std::left << std::setw(20) << "function" << std::right
+            << std::setw(10) << "entry" << std::setw(8) << "blocks"
+            << std::setw(14) << "instructions" << "\n";
+  for (const Cfg::Function &f : cfg.getFunctions()) {
+    std::cout << std::left << std::setw(20)
+              << Profiler::functionName(symbols, f.entry) << std::right
+              << std::hex << std::setw(10) << f.entry << std::dec
+              << std::setw(8) << f.blocks.size() << std::setw(14)
+              << f.instructions << "\n";
+  }
+
+  std::cout << std::left << std::setw(20) << "loop" << std::right
+            << std::setw(10) << "header" << std::setw(8) << "depth"
+            << std::setw(8) << "blocks" << std::setw(14) << "instructions"
+            << "\n";
+  printLoops(cfg, Cfg::kNone, symbols);
+}
+
+static int runBatch(Machine &cpu, std::uint64_t maxSteps,
+                    const Profiler::Symbols &symbols) {
+  int ret = 0;
+  auto start = std::chrono::steady_clock::now();
+  try {
+    cpu.run(maxSteps);
+  } catch (RunningException &e) {
+    ret = reportRunningError(e);
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  std::uint64_t steps = cpu.getSteps();
+
+  cpu.printAllRegs();
+  if (cpu.isOk()) {
+    std::cout << "step limit reached\n";
+  }
+  std::cout << std::dec << "steps: " << steps << ", time: " << std::fixed
+            << std::setprecision(6) << seconds << " s, steps/sec: "
+            << std::setprecision(0)
+            << (seconds > 0 ? steps / seconds : 0.0) << "\n";
+
+  Machine::CodeStats code = cpu.getCodeStats();
+  if (code.codeWrites > 0) {
+    std::cout << "self-modifying code: stores: " << code.codeWrites
+              << ", decodes invalidated: " << code.invalidated << "\n";
+  }
+  if (cpu.getEngine() == Machine::Engine::Threaded) {
+    // Only the pairs that ran, in the order of fusions.def
+    Machine::FusionStats fused = cpu.getFusionStats();
+    const char *sep = "fused pairs: ";
+#define FUSION(NAME, FIRST, SECOND)                                            \
+  if (fused.NAME > 0) {                                                        \
+    std::cout << sep << #NAME << ": " << fused.NAME;                           \
+    sep = ", ";                                                                \
+  }
+#include "../../y64lib/fusions.def"
+    if (*sep == ',') {
+      std::cout << "\n";
+    }
+  }
+  if (cpu.getEngine() == Machine::Engine::Jit) {
+    Machine::JitStats stats = cpu.getJitStats();
+    std::cout << "jit: translated blocks: " << stats.translated
+              << ", interpreted: " << stats.interpreted << "\n";
+  }
+  if (cpu.getEngine() == Machine::Engine::Block) {
+    Machine::BlockStats stats = cpu.getBlockStats();
+    std::cout << "block cache: hits: " << stats.hits
+              << ", misses: " << stats.misses
+              << ", chained: " << stats.chained
+              << ", invalidated: " << stats.invalidated << "\n";
+  }
+  if (cpu.getEngine() == Machine::Engine::Pipe) {
+    Machine::PipeStats stats = cpu.getPipeStats();
+    std::cout << "pipeline: cycles: " << stats.cycles << ", CPI: "
+              << std::setprecision(3)
+              << (stats.instructions > 0
+                      ? static_cast<double>(stats.cycles) / stats.instructions
+                      : 0.0)
+              << ", load/use stalls: " << stats.loadUseStalls
+              << ", mispredicts: " << stats.mispredicts
+              << ", mispredict bubbles: " << stats.mispredictBubbles
+              << ", return bubbles: " << stats.returnBubbles << "\n";
+  }
+  if (const BranchPredictor *predictor = cpu.getBranchPredictor()) {
+    printBranches(*predictor);
+  }
+  if (const CacheHierarchy *caches = cpu.getCacheHierarchy()) {
+    printCaches(*caches);
+  }
+  if (const Profiler *profiler = cpu.getProfiler()) {
+    printProfile(*profiler, symbols);
+  }
+  return ret;
+}
+
+static int runReplay(const char *path, std::uint64_t maxSteps) {
+  TraceReplayer replayer;
+  if (!replayer.open(path)) {
+    std::cerr << "Read trace file '" << path << "' failed\n";
+    return 2;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  replayer.seek(maxSteps);
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+
+  replayer.getMachine().printAllRegs();
+  std::cout << std::dec << "replayed: " << replayer.getStep();
+  if (replayer.getLength() != UINT64_MAX) {
+    std::cout << " of " << replayer.getLength();
+  }
+  if (replayer.getStep() > 0) {
+    const char *name = Profiler::opcodeName(replayer.getOpcode());
+    std::cout << ", last: " << (name ? name : "?") << " at 0x" << std::hex
+              << replayer.getInstPC() << std::dec;
+  }
+  std::cout << ", time: " << std::fixed << std::setprecision(6) << seconds
+            << " s\n";
+  return 0;
+}
+
+static int runFleet(Machine &cpu, unsigned jobs, std::size_t instances,
+                    std::uint64_t maxSteps) {
+  if (jobs == 0) {
+    jobs = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (instances == 0) {
+    instances = jobs;
+  }
+
+  std::vector<Fleet::Seed> seeds(instances);
+  for (std::size_t i = 0; i < instances; ++i) {
+    seeds[i].regs.emplace_back(Register::rdi, static_cast<std::int64_t>(i));
+  }
+
+  Fleet fleet{cpu.snapshot()};
+  Fleet::Options opts{jobs, cpu.getEngine(), maxSteps,
+                      Memory::Backing::Mmap};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<Fleet::Result> results = fleet.run(seeds, opts);
+  auto end = std::chrono::steady_clock::now();
+
+  int ret = 0;
+  std::uint64_t steps = 0;
+  std::cout << std::left << std::setw(10) << "instance" << std::setw(6)
+            << "stat" << std::right << std::setw(14) << "steps"
+            << std::setw(22) << "%rax" << "\n";
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    const Fleet::Result &res = results[i];
+    std::cout << std::left << std::setw(10) << i << std::setw(6)
+              << Machine::statName(res.stat) << std::right << std::setw(14)
+              << res.steps << std::setw(22) << res.regs[Register::rax]
+              << "\n";
+    steps += res.steps;
+    if (res.stat == Machine::Stat::ADR || res.stat == Machine::Stat::INS) {
+      ret = 3;
+    }
+  }
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  std::cout << "instances: " << instances << ", jobs: " << jobs
+            << ", steps: " << steps << ", time: " << std::fixed
+            << std::setprecision(6) << seconds << " s, steps/sec: "
+            << std::setprecision(0)
+            << (seconds > 0 ? steps / seconds : 0.0) << "\n";
+  return ret;
 }
 
 int main(int argc, char **argv) {
-  if (argc == 2) {
-    std::string arg1 = argv[1];
-    if (arg1 == "-h" || arg1 == "--help") {
+  bool batch = false;
+  Machine::Engine engine = Machine::Engine::Threaded;
+  std::uint64_t maxSteps = Machine::kNoStepLimit;
+  std::uint64_t memorySize = Machine::kDefaultMemorySize;
+  bool fleet = false;
+  unsigned jobs = 0;
+  std::size_t instances = 0;
+  bool predict = false;
+  BranchPredictor::Scheme scheme = BranchPredictor::Scheme::AlwaysTaken;
+  bool cache = false;
+  CacheHierarchy::Config cacheConfig = CacheHierarchy::defaultConfig();
+  bool profile = false;
+  const char *folded = nullptr;
+  Profiler::Symbols symbols;
+  const char *tracePath = nullptr;
+  const char *replayPath = nullptr;
+  std::uint64_t interval = History::kDefaultInterval;
+  const char *gdbAddress = nullptr;
+  bool showCfg = false;
+  std::string opt;
+  const char *filename = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "-h" || arg == "--help") {
       usageHelp();
       return 0;
     }
-    usageHelp();
-    return 1;
+
+    if (arg == "--batch") {
+      batch = true;
+    } else if (arg == "--max-steps" && i + 1 < argc) {
+      maxSteps = std::strtoull(argv[++i], nullptr, 0);
+    } else if (arg == "--memory" && i + 1 < argc) {
+      memorySize = std::strtoull(argv[++i], nullptr, 0);
+    } else if (arg == "--jobs" && i + 1 < argc) {
+      fleet = true;
+      jobs = std::strtoul(argv[++i], nullptr, 0);
+    } else if (arg == "--instances" && i + 1 < argc) {
+      instances = std::strtoull(argv[++i], nullptr, 0);
+    } else if (arg == "--predictor" && i + 1 < argc) {
+      predict = true;
+      if (!BranchPredictor::parseScheme(argv[++i], scheme)) {
+        usageHelp();
+        return 1;
+      }
+    } else if (arg == "--profile") {
+      profile = true;
+    } else if (arg == "--folded" && i + 1 < argc) {
+      profile = true;
+      folded = argv[++i];
+    } else if (arg == "--checkpoint" && i + 1 < argc) {
+      interval = std::strtoull(argv[++i], nullptr, 0);
+    } else if (arg == "--gdb-port" && i + 1 < argc) {
+      gdbAddress = argv[++i];
+    } else if (arg == "--cfg") {
+      showCfg = true;
+    } else if (arg == "--trace" && i + 1 < argc) {
+      tracePath = argv[++i];
+    } else if (arg == "--replay" && i + 1 < argc) {
+      replayPath = argv[++i];
+    } else if (arg == "--cache") {
+      cache = true;
+    } else if ((arg == "--l1i" || arg == "--l1d" || arg == "--l2") &&
+               i + 1 < argc) {
+      cache = true;
+      Cache::Config &level = arg == "--l1i"   ? cacheConfig.l1i
+                             : arg == "--l1d" ? cacheConfig.l1d
+                                              : cacheConfig.l2;
+      if (!CacheHierarchy::parseLevel(argv[++i], level)) {
+        usageHelp();
+        return 1;
+      }
+    } else if (arg == "--engine" && i + 1 < argc) {
+      std::string name = argv[++i];
+      if (name == "staged") {
+        engine = Machine::Engine::Staged;
+      } else if (name == "threaded") {
+        engine = Machine::Engine::Threaded;
+      } else if (name == "jit") {
+        engine = Machine::Engine::Jit;
+      } else if (name == "block") {
+        engine = Machine::Engine::Block;
+      } else if (name == "pipe") {
+        engine = Machine::Engine::Pipe;
+      } else {
+        usageHelp();
+        return 1;
+      }
+    } else if ((arg == "-ys" || arg == "-yo") && i + 1 < argc &&
+               filename == nullptr) {
+      opt = arg;
+      filename = argv[++i];
+    } else {
+      usageHelp();
+      return 1;
+    }
   }
 
-  if (argc != 3) {
-    usageHelp();
+  // Options that only a single batch run honors imply it, and are an
+  // error with the other modes
+  bool batchOnly = predict || cache || profile || tracePath != nullptr;
+  if (batchOnly && (fleet || showCfg || gdbAddress != nullptr ||
+                    replayPath != nullptr)) {
+    std::cerr << "--predictor, --cache, --l1i, --l1d, --l2, --profile, "
+                 "--folded and --trace\n"
+              << "can not be combined with --jobs, --cfg, --gdb-port or "
+                 "--replay\n";
     return 1;
   }
+  batch = batch || batchOnly;
 
-  std::string opt = argv[1];
-  if (opt != "-ys" && opt != "-yo") {
+  if (replayPath != nullptr) {
+    return runReplay(replayPath, maxSteps);
+  }
+
+  if (filename == nullptr) {
     usageHelp();
     return 1;
   }
 
-  const char *filename = argv[2];
   fs::path sourcePath{filename};
 
   if (!fs::exists(sourcePath)) {
@@ -47,7 +691,7 @@ int main(int argc, char **argv) {
     return 2;
   }
 
-  Machine cpu;
+  Machine cpu{memorySize};
   if (opt == "-ys") {
     std::string source;
     if (!readSource(filename, source)) {
@@ -62,49 +706,72 @@ int main(int argc, char **argv) {
       std::cerr << e.what() << "\n";
       return 2;
     }
-    cpu.load(parser.getOutputBuffer());
+    if (!cpu.load(parser.getOutputBuffer())) {
+      return 2;
+    }
+    symbols = parser.getSymbols();
   } else if (opt == "-yo") {
-    cpu.load(filename);
+    if (!cpu.load(filename)) {
+      return 2;
+    }
   }
 
-  cpu.printAllRegs();
+  if (showCfg) {
+    printCfg(Cfg{cpu.snapshot()}, symbols);
+    return 0;
+  }
 
-  std::cout << "start execute!!!\n"
-            << "An instruction will be executed, press any key to continue "
-               "execution\n";
+  if (fleet) {
+    cpu.setEngine(engine);
+    return runFleet(cpu, jobs, instances, maxSteps);
+  }
 
-  char anykey = '\0';
-  try {
-    // cpu executes instructions until halt
-    while (cpu.isOk()) {
-      std::cin.get(anykey);
-      cpu.fetch();
-      cpu.decode();
-      cpu.execute();
-      cpu.accessMemory();
-      cpu.writeBack();
-      cpu.updatePC();
-      cpu.printAllRegs();
+  if (batch) {
+    cpu.setEngine(engine);
+    if (predict) {
+      cpu.setBranchPredictor(std::make_unique<BranchPredictor>(scheme));
     }
-
-    std::cout << "mission completed!!!\n";
-    return 0;
-  } catch (RunningException &e) {
-    std::uint8_t stat = e.getStat();
-    if (stat == Machine::Stat::ADR) {
-      std::cerr << "error: Invalid address: 0x" << std::hex
-                << std::setiosflags(std::ios::uppercase) << e.getValue()
-                << "\n";
-      return 3;
+    if (cache) {
+      cpu.setCacheHierarchy(std::make_unique<CacheHierarchy>(cacheConfig));
     }
-
-    if (stat == Machine::Stat::INS) {
-      std::cerr << "error: Invalid instruction opcode: " << std::hex
-                << std::setiosflags(std::ios::uppercase)
-                << static_cast<std::uint8_t>(e.getValue()) << "\n";
-      return 3;
+    if (profile) {
+      cpu.setProfiler(std::make_unique<Profiler>());
+    }
+    TraceRecorder *recorder = nullptr;
+    if (tracePath != nullptr) {
+      auto r = std::make_unique<TraceRecorder>();
+      if (!r->open(tracePath, cpu)) {
+        std::cerr << "Create trace file '" << tracePath << "' failed\n";
+        return 2;
+      }
+      recorder = r.get();
+      cpu.setTraceRecorder(std::move(r));
+    }
+    int ret = runBatch(cpu, maxSteps, symbols);
+    if (recorder != nullptr) {
+      std::uint64_t records = recorder->getRecords();
+      if (!recorder->close(cpu)) {
+        std::cerr << "Write trace file '" << tracePath << "' failed\n";
+        return 2;
+      }
+      std::cout << "trace: records: " << records
+                << ", bytes: " << recorder->getBytes() << "\n";
+    }
+    if (folded != nullptr) {
+      std::ofstream out{folded};
+      cpu.getProfiler()->writeFolded(out, symbols);
+      if (!out) {
+        std::cerr << "Write folded stacks to '" << folded << "' failed\n";
+        return 2;
+      }
     }
+    return ret;
   }
 
-  return 0;
-}
\ No newline at end of file
+  if (gdbAddress != nullptr) {
+    cpu.setEngine(engine);
+    return runGdb(cpu, gdbAddress);
+  }
+
+  return runInteractive(cpu, interval);
+}
@@ -31,6 +31,74 @@ extern const char *magicNumber;
 
 bool readSource(const std::string &filename, std::string &source);
 
+// LEB128 encoding, see utility/leb128. Encoders write at most 10 bytes and
+// return how many, decoders set `count` to the number of bytes read.
+constexpr std::uint32_t encodeULEB128(std::uint64_t value, std::uint8_t *buf) {
+  std::uint8_t *org = buf;
+  do {
+    std::uint8_t byte = value & 0x7F;
+    value >>= 7;
+    if (value != 0) {
+      byte |= 0x80;
+    }
+    *buf++ = byte;
+  } while (value != 0);
+  return static_cast<std::uint32_t>(buf - org);
+}
+
+constexpr std::uint32_t encodeSLEB128(std::int64_t value, std::uint8_t *buf) {
+  std::uint8_t *org = buf;
+  bool more = true;
+  while (more) {
+    std::uint8_t byte = value & 0x7F;
+    value >>= 7; // arithmetic shift
+    more = !((value == 0 && (byte & 0x40) == 0) ||
+             (value == -1 && (byte & 0x40) != 0));
+    if (more) {
+      byte |= 0x80;
+    }
+    *buf++ = byte;
+  }
+  return static_cast<std::uint32_t>(buf - org);
+}
+
+constexpr std::uint64_t decodeULEB128(const std::uint8_t *buf,
+                                      std::uint32_t &count) {
+  const std::uint8_t *org = buf;
+  std::uint64_t value = 0;
+  std::uint32_t shift = 0;
+  std::uint8_t byte = 0;
+  do {
+    byte = *buf++;
+    if (shift < 64) {
+      value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+    }
+    shift += 7;
+  } while (byte & 0x80);
+  count = static_cast<std::uint32_t>(buf - org);
+  return value;
+}
+
+constexpr std::int64_t decodeSLEB128(const std::uint8_t *buf,
+                                     std::uint32_t &count) {
+  const std::uint8_t *org = buf;
+  std::uint64_t value = 0;
+  std::uint32_t shift = 0;
+  std::uint8_t byte = 0;
+  do {
+    byte = *buf++;
+    if (shift < 64) {
+      value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+    }
+    shift += 7;
+  } while (byte & 0x80);
+  if (shift < 64 && (byte & 0x40)) {
+    value |= ~std::uint64_t{0} << shift;
+  }
+  count = static_cast<std::uint32_t>(buf - org);
+  return static_cast<std::int64_t>(value);
+}
+
 namespace details {
 [[noreturn]] void y64_unreachable_internal(const char *msg,
                                            const char *filename,
@@ -0,0 +1,244 @@
+// Optional passes of AsmParser, run on the instructions after
+// calcPendingAddress() resolved their labels and before genAllCode()
+
+#include "y64parser.hpp"
+
+#include <unordered_map>
+#include <unordered_set>
+
+#include "util.hpp"
+
+namespace y64 {
+
+namespace {
+
+// Index of the first instruction at or after i that is kept, or the count
+std::size_t nextKept(const std::vector<bool> &removed, std::size_t i) {
+  while (i < removed.size() && removed[i]) {
+    ++i;
+  }
+  return i;
+}
+
+bool isCode(const std::vector<Instruction> &insts, std::size_t i) {
+  return i < insts.size() && !insts[i].isPseduo;
+}
+
+} // namespace
+
+bool AsmParser::resolveTargets(const std::vector<Instruction> &insts) {
+  std::unordered_map<std::uint64_t, std::size_t> byAddr;
+  for (std::size_t i = 0; i < insts.size(); ++i) {
+    if (isCode(insts, i)) {
+      byAddr.emplace(insts[i].addr, i);
+    }
+  }
+
+  // Numbers relocate() can not move are left alone: a jump into the middle
+  // of an instruction, into data or past the end
+  bool resolved = true;
+  for (std::size_t i = 0; i < insts.size(); ++i) {
+    const Instruction &inst = insts[i];
+    if (labelTargets[i] != kNoEntry || inst.isPseduo ||
+        (inst.icode != Instruction::icode_jmp &&
+         inst.icode != Instruction::icode_call)) {
+      continue;
+    }
+
+    auto iter = byAddr.find(static_cast<std::uint64_t>(inst.value));
+    if (iter == byAddr.end()) {
+      resolved = false;
+      continue;
+    }
+    labelTargets[i] = iter->second;
+  }
+  return resolved;
+}
+
+void AsmParser::runPeephole(std::vector<Instruction> &insts) {
+  // Numeric targets move along with the code they point at, a program with
+  // one that can not is left as it is
+  if (!resolveTargets(insts)) {
+    return;
+  }
+
+  std::vector<bool> removed(insts.size());
+
+  // Each change can expose another, such as a jump left before the next
+  // instruction once the nops between them are gone
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (std::size_t i = 0; i < insts.size(); ++i) {
+      Instruction &inst = insts[i];
+      if (removed[i] || inst.isPseduo) {
+        continue;
+      }
+      std::size_t next = nextKept(removed, i + 1);
+
+      // Control falling off or sent to a removed instruction has to reach
+      // the next one, which a .pos or .quad in between would move
+      if (inst.getOpCode() == Instruction::nop && isCode(insts, next)) {
+        removed[i] = true;
+        ++peepholeStats.nops;
+        changed = true;
+        continue;
+      }
+      if (inst.getOpCode() == Instruction::rrmovq &&
+          inst.regA.id() == inst.regB.id() && isCode(insts, next)) {
+        removed[i] = true;
+        ++peepholeStats.moves;
+        changed = true;
+        continue;
+      }
+
+      if (inst.icode == Instruction::icode_jmp &&
+          labelTargets[i] != kNoEntry) {
+        // Follow jmp to jmp, leaving a cycle of them as it is
+        std::size_t target = nextKept(removed, labelTargets[i]);
+        std::unordered_set<std::size_t> seen{target};
+        while (isCode(insts, target) &&
+               insts[target].getOpCode() == Instruction::jmp &&
+               labelTargets[target] != kNoEntry) {
+          std::size_t hop = nextKept(removed, labelTargets[target]);
+          if (!seen.insert(hop).second) {
+            target = nextKept(removed, labelTargets[i]);
+            break;
+          }
+          target = hop;
+        }
+        if (target != nextKept(removed, labelTargets[i])) {
+          labelTargets[i] = target;
+          ++peepholeStats.chains;
+          changed = true;
+        }
+
+        if (target == next && isCode(insts, next)) {
+          removed[i] = true;
+          ++peepholeStats.jumps;
+          changed = true;
+        }
+        continue;
+      }
+
+      // xorq also sets the condition codes, so only where an opq sets them
+      // again before anything reads them, including the final state
+      if (inst.getOpCode() == Instruction::irmovq && inst.value == 0 &&
+          labelTargets[i] == kNoEntry && flagsDead(insts, removed, i)) {
+        inst.setOpCode(Instruction::xorq);
+        inst.regA = inst.regB;
+        ++peepholeStats.zeros;
+        changed = true;
+      }
+    }
+  }
+
+  relocate(insts, removed);
+}
+
+bool AsmParser::flagsDead(const std::vector<Instruction> &insts,
+                          const std::vector<bool> &removed,
+                          std::size_t i) const {
+  // Only through instructions that can not fault or branch
+  for (i = nextKept(removed, i + 1); isCode(insts, i);
+       i = nextKept(removed, i + 1)) {
+    const Instruction &inst = insts[i];
+    if (inst.icode == Instruction::icode_opq) {
+      return true;
+    }
+    if (inst.getOpCode() != Instruction::irmovq &&
+        inst.getOpCode() != Instruction::rrmovq &&
+        inst.getOpCode() != Instruction::nop) {
+      return false;
+    }
+  }
+  return false;
+}
+
+void AsmParser::removeUnreachable(std::vector<Instruction> &insts) {
+  // Numeric targets move along with the code they point at. When one can
+  // not, the layout is kept and the dead code only reported.
+  bool movable = resolveTargets(insts);
+
+  // Code by address, for fall-through
+  std::unordered_map<std::uint64_t, std::size_t> byAddr;
+  for (std::size_t i = 0; i < insts.size(); ++i) {
+    if (isCode(insts, i)) {
+      byAddr.emplace(insts[i].addr, i);
+    }
+  }
+
+  std::vector<bool> live(insts.size());
+  std::vector<std::size_t> work;
+  auto reach = [&](std::size_t i) {
+    if (isCode(insts, i) && !live[i]) {
+      live[i] = true;
+      work.push_back(i);
+    }
+  };
+  auto reachAddr = [&](std::uint64_t addr) {
+    auto iter = byAddr.find(addr);
+    if (iter != byAddr.end()) {
+      reach(iter->second);
+    }
+  };
+
+  // Machine::load() leaves the PC at 0. A label operand, of irmovq too, is
+  // taken as a way in, as the address can be pushed and returned to.
+  reachAddr(0);
+  while (!work.empty()) {
+    std::size_t i = work.back();
+    work.pop_back();
+    const Instruction &inst = insts[i];
+    if (labelTargets[i] != kNoEntry) {
+      reach(labelTargets[i]);
+    }
+
+    switch (inst.icode) {
+    case Instruction::icode_halt:
+      Y64_FALLTHROUGH;
+    case Instruction::icode_ret:
+      break;
+    case Instruction::icode_jmp:
+      if (inst.ifun != Instruction::ifun_jmp) {
+        reachAddr(inst.addr + inst.length());
+      }
+      break;
+    default:
+      reachAddr(inst.addr + inst.length());
+      break;
+    }
+  }
+
+  // The alphabetically first label of each entry, to name what goes
+  std::unordered_map<std::size_t, std::string> names;
+  for (const auto &entry : labelEntries) {
+    std::string &name = names[entry.second];
+    if (name.empty() || entry.first < name) {
+      name = entry.first;
+    }
+  }
+
+  std::vector<bool> removed(insts.size());
+  for (std::size_t i = 0; i < insts.size(); ++i) {
+    if (!isCode(insts, i) || live[i]) {
+      continue;
+    }
+
+    removed[i] = true;
+    if (i == 0 || !removed[i - 1]) {
+      auto iter = names.find(i);
+      deadCode.push_back(DeadCode{insts[i].line,
+                                  iter != names.end() ? iter->second : "", 0,
+                                  0, movable});
+    }
+    ++deadCode.back().instructions;
+    deadCode.back().bytes += insts[i].length();
+  }
+
+  if (movable) {
+    relocate(insts, removed);
+  }
+}
+
+} // namespace y64
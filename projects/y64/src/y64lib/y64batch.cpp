@@ -0,0 +1,517 @@
+#include "y64batch.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "util.hpp"
+
+namespace y64 {
+
+namespace {
+
+std::int64_t signBit(std::int64_t v) {
+  return static_cast<std::int64_t>(static_cast<std::uint64_t>(v) >> 63);
+}
+
+// Lane masks are all ones or all zeros, so that selecting by them needs no
+// branch and the loops using them vectorize
+std::int64_t maskOf(bool b) { return -static_cast<std::int64_t>(b); }
+
+std::int64_t packFlags(std::int64_t zf, std::int64_t sf, std::int64_t of) {
+  return zf | sf << 1 | of << 2;
+}
+
+std::int64_t select(std::int64_t mask, std::int64_t a, std::int64_t b) {
+  return b ^ ((a ^ b) & mask);
+}
+
+} // namespace
+
+Batch::Batch(const Machine::Snapshot &image, std::size_t lanes)
+    : numLanes(lanes), image(image), imageMem(image.memory->size()),
+      regs((Machine::kNumGeneralRegs + 1) * lanes), pc(lanes, image.pc),
+      flags(lanes, packFlags(image.zeroFlag, image.signedFlag,
+                             image.overflowFlag)),
+      stat(lanes, image.stat), steps(lanes, image.steps),
+      faultValue(lanes, image.faultValue), mems(), scalar(lanes),
+      limit(lanes), running(lanes), active(lanes), cnd(lanes), codePages(),
+      decodedNum(UINT64_MAX), decoded(nullptr), codeLow(UINT64_MAX),
+      codeHigh(0), stats{0, 0, 0} {
+  imageMem.restore(*image.memory);
+  for (std::size_t id = 0; id <= Machine::kNumGeneralRegs; ++id) {
+    std::fill_n(reg(id), numLanes, image.regs[id]);
+  }
+  for (std::size_t lane = 0; lane < numLanes; ++lane) {
+    mems.push_back(std::make_unique<Memory>(image.memory->size()));
+    mems.back()->restore(*image.memory);
+  }
+}
+
+Batch::~Batch() = default;
+
+void Batch::setReg(std::size_t lane, std::size_t id, std::int64_t value) {
+  if (scalar[lane]) {
+    scalar[lane]->setReg(id, value);
+  }
+  regs[id * numLanes + lane] = value;
+}
+
+bool Batch::setMemQuad(std::size_t lane, std::uint64_t addr,
+                       std::int64_t value) {
+  if (scalar[lane]) {
+    return scalar[lane]->setMemQuad(addr, value);
+  }
+
+  Memory &mem = *mems[lane];
+  if (!mem.contains(addr, sizeof(value))) {
+    return false;
+  }
+  mem.writeQuad(addr, value);
+  if (touchesCode(addr, sizeof(value))) {
+    handOff(lane);
+  }
+  return true;
+}
+
+std::uint64_t Batch::run(std::uint64_t maxSteps) {
+  std::uint64_t before = 0;
+  for (std::size_t l = 0; l < numLanes; ++l) {
+    before += steps[l];
+    limit[l] = maxSteps > Machine::kNoStepLimit - steps[l]
+                   ? Machine::kNoStepLimit
+                   : steps[l] + maxSteps;
+  }
+
+  for (std::size_t l = 0; l < numLanes; ++l) {
+    if (scalar[l]) {
+      runScalar(l);
+    }
+    running[l] = maskOf(!scalar[l] && stat[l] == Machine::Stat::AOK &&
+                        steps[l] < limit[l]);
+  }
+
+  const std::size_t n = numLanes;
+  const std::uint64_t *lanePC = pc.data();
+  std::int64_t *run = running.data();
+  std::int64_t *act = active.data();
+  // While `together`, every running lane is active and at `target`, which
+  // saves looking for the next group. `budget` is how many more issues no
+  // lane can reach its step limit in.
+  bool together = false;
+  std::uint64_t target = 0;
+  std::uint64_t budget = 0;
+  while (true) {
+    if (budget == 0) {
+      budget = UINT64_MAX;
+      for (std::size_t l = 0; l < n; ++l) {
+        if (run[l] && steps[l] >= limit[l]) {
+          run[l] = 0;
+          act[l] = 0;
+        } else if (run[l]) {
+          budget = std::min(budget, limit[l] - steps[l]);
+        }
+      }
+      together = false;
+    }
+
+    if (!together) {
+      // Issue to the lanes furthest behind, lanes split by a branch then
+      // wait for each other where their paths join again
+      std::int64_t any = 0;
+      target = UINT64_MAX;
+      for (std::size_t l = 0; l < n; ++l) {
+        any |= run[l];
+        target =
+            std::min(target, lanePC[l] | ~static_cast<std::uint64_t>(run[l]));
+      }
+      if (!any) {
+        break;
+      }
+
+      std::int64_t left = 0;
+      for (std::size_t l = 0; l < n; ++l) {
+        act[l] = run[l] & maskOf(lanePC[l] == target);
+        left |= run[l] & ~act[l];
+      }
+      together = !left;
+    }
+
+    const Machine::DecodedInst *d = lookupDecoded(target);
+    if (d) {
+      together = issue(*d, target) && together;
+    } else {
+      // The image can not be decoded here, the lanes may differ from it
+      for (std::size_t l = 0; l < n; ++l) {
+        if (!act[l]) {
+          continue;
+        }
+        Machine::DecodedInst own;
+        std::uint64_t value = 0;
+        Machine::Stat s = Machine::decodeInst(*mems[l], target, own, value);
+        if (s != Machine::Stat::AOK) {
+          faultLane(l, s, value);
+        } else {
+          handOff(l);
+          runScalar(l);
+        }
+      }
+      together = false;
+    }
+    ++stats.issued;
+    --budget;
+  }
+
+  std::uint64_t after = 0;
+  for (std::size_t l = 0; l < numLanes; ++l) {
+    after += steps[l];
+  }
+  stats.laneSteps += after - before;
+  return after - before;
+}
+
+bool Batch::issue(const Machine::DecodedInst &d, std::uint64_t &next) {
+  const std::size_t n = numLanes;
+  const std::int64_t *act = active.data();
+  std::int64_t *ra = reg(d.rA);
+  std::int64_t *rb = reg(d.rB);
+  // Signed views of pc and steps for the masked loops
+  std::int64_t *lanePC = reinterpret_cast<std::int64_t *>(pc.data());
+  std::int64_t *laneSteps = reinterpret_cast<std::int64_t *>(steps.data());
+
+  switch (d.icode) {
+  case Instruction::icode_halt:
+    for (std::size_t l = 0; l < n; ++l) {
+      if (act[l]) {
+        stat[l] = Machine::Stat::HLT;
+        running[l] = 0;
+        pc[l] = 0;
+        ++steps[l];
+      }
+    }
+    return false;
+  case Instruction::icode_nop:
+    break;
+  case Instruction::icode_cmov:
+    if (d.ifun > Instruction::ifun_g) {
+      faultActive(Machine::Stat::INS, d.getOpCode());
+      return false;
+    }
+    evalCondition(d.ifun);
+    for (std::size_t l = 0; l < n; ++l) {
+      rb[l] = select(act[l] & cnd[l], ra[l], rb[l]);
+    }
+    break;
+  case Instruction::icode_irmovq:
+    for (std::size_t l = 0; l < n; ++l) {
+      rb[l] = select(act[l], d.valC, rb[l]);
+    }
+    break;
+  case Instruction::icode_opq: {
+    std::int64_t *cc = flags.data();
+    // Same flags as Machine::getFlags(), computed without branches
+    switch (d.ifun) {
+    case Instruction::ifun_addq:
+      for (std::size_t l = 0; l < n; ++l) {
+        std::int64_t a = ra[l];
+        std::int64_t b = rb[l];
+        std::int64_t e = static_cast<std::int64_t>(
+            static_cast<std::uint64_t>(b) + static_cast<std::uint64_t>(a));
+        std::int64_t of = signBit((a ^ e) & (b ^ e));
+        std::int64_t on = act[l];
+        cc[l] = select(on, packFlags(e == 0, signBit(e), of), cc[l]);
+        rb[l] = select(on, e, b);
+      }
+      break;
+    case Instruction::ifun_subq:
+      for (std::size_t l = 0; l < n; ++l) {
+        std::int64_t a = ra[l];
+        std::int64_t b = rb[l];
+        std::int64_t e = static_cast<std::int64_t>(
+            static_cast<std::uint64_t>(b) - static_cast<std::uint64_t>(a));
+        std::int64_t of = signBit((b ^ a) & (b ^ e));
+        std::int64_t on = act[l];
+        cc[l] = select(on, packFlags(e == 0, signBit(e), of), cc[l]);
+        rb[l] = select(on, e, b);
+      }
+      break;
+    case Instruction::ifun_andq:
+      for (std::size_t l = 0; l < n; ++l) {
+        std::int64_t b = rb[l];
+        std::int64_t e = b & ra[l];
+        std::int64_t on = act[l];
+        cc[l] = select(on, packFlags(e == 0, signBit(e), 0), cc[l]);
+        rb[l] = select(on, e, b);
+      }
+      break;
+    case Instruction::ifun_xorq:
+      for (std::size_t l = 0; l < n; ++l) {
+        std::int64_t b = rb[l];
+        std::int64_t e = b ^ ra[l];
+        std::int64_t on = act[l];
+        cc[l] = select(on, packFlags(e == 0, signBit(e), 0), cc[l]);
+        rb[l] = select(on, e, b);
+      }
+      break;
+    default:
+      faultActive(Machine::Stat::INS, d.getOpCode());
+      return false;
+    }
+    break;
+  }
+  case Instruction::icode_jmp:
+    if (d.ifun > Instruction::ifun_g) {
+      faultActive(Machine::Stat::INS, d.getOpCode());
+      return false;
+    }
+  {
+    evalCondition(d.ifun);
+    const std::int64_t *c = cnd.data();
+    std::int64_t taken = 0;
+    std::int64_t fallen = 0;
+    for (std::size_t l = 0; l < n; ++l) {
+      std::int64_t on = act[l];
+      lanePC[l] = select(on, select(c[l], d.valC, d.valP), lanePC[l]);
+      laneSteps[l] -= on;
+      taken |= on & c[l];
+      fallen |= on & ~c[l];
+    }
+    next = taken ? d.valC : d.valP;
+    return !(taken && fallen);
+  }
+  default:
+    return issueMemory(d, next);
+  }
+
+  for (std::size_t l = 0; l < n; ++l) {
+    lanePC[l] = select(act[l], d.valP, lanePC[l]);
+    laneSteps[l] -= act[l];
+  }
+  next = d.valP;
+  return true;
+}
+
+bool Batch::issueMemory(const Machine::DecodedInst &d,
+                        std::uint64_t &next) {
+  // Every lane has a memory of its own, so these go one lane at a time
+  std::int64_t *ra = reg(d.rA);
+  std::int64_t *rb = reg(d.rB);
+  std::int64_t *rsp = reg(Register::rsp);
+  for (std::size_t l = 0; l < numLanes; ++l) {
+    if (!active[l]) {
+      continue;
+    }
+
+    Memory &mem = *mems[l];
+    bool stored = false;
+    std::uint64_t addr = 0;
+    std::uint64_t dest = d.valP;
+    switch (d.icode) {
+    case Instruction::icode_rmmovq:
+    case Instruction::icode_mrmovq:
+      addr = rb[l] + d.valC;
+      break;
+    case Instruction::icode_call:
+    case Instruction::icode_pushq:
+      addr = rsp[l] - 8;
+      break;
+    default:
+      addr = rsp[l];
+      break;
+    }
+    if (!mem.contains(addr, 8)) {
+      faultLane(l, Machine::Stat::ADR, addr + 8);
+      continue;
+    }
+
+    switch (d.icode) {
+    case Instruction::icode_rmmovq:
+      mem.writeQuad(addr, ra[l]);
+      stored = true;
+      break;
+    case Instruction::icode_mrmovq:
+      ra[l] = mem.readQuad(addr);
+      break;
+    case Instruction::icode_call:
+      mem.writeQuad(addr, d.valP);
+      rsp[l] = addr;
+      dest = d.valC;
+      stored = true;
+      break;
+    case Instruction::icode_pushq:
+      mem.writeQuad(addr, ra[l]);
+      rsp[l] = addr;
+      stored = true;
+      break;
+    case Instruction::icode_ret:
+      dest = mem.readQuad(addr);
+      rsp[l] = addr + 8;
+      break;
+    case Instruction::icode_popq: {
+      std::int64_t val = mem.readQuad(addr);
+      rsp[l] = addr + 8;
+      ra[l] = val;
+      break;
+    }
+    default:
+      Y64_UNREACHABLE("Unknown instruction");
+    }
+
+    pc[l] = dest;
+    ++steps[l];
+    if (stored && touchesCode(addr, 8)) {
+      handOff(l);
+      runScalar(l);
+    }
+  }
+
+  // Return addresses are per lane, everything else moves lanes alike
+  next = d.icode == Instruction::icode_call ? d.valC : d.valP;
+  return d.icode != Instruction::icode_ret;
+}
+
+void Batch::evalCondition(std::uint8_t ifun) {
+  const std::int64_t *cc = flags.data();
+  std::int64_t *c = cnd.data();
+  const std::size_t n = numLanes;
+  switch (ifun) {
+  case Instruction::ifun_le:
+    for (std::size_t l = 0; l < n; ++l)
+      c[l] = maskOf(((cc[l] >> 1 ^ cc[l] >> 2) | cc[l]) & 1);
+    break;
+  case Instruction::ifun_l:
+    for (std::size_t l = 0; l < n; ++l)
+      c[l] = maskOf((cc[l] >> 1 ^ cc[l] >> 2) & 1);
+    break;
+  case Instruction::ifun_e:
+    for (std::size_t l = 0; l < n; ++l)
+      c[l] = maskOf(cc[l] & kZF);
+    break;
+  case Instruction::ifun_ne:
+    for (std::size_t l = 0; l < n; ++l)
+      c[l] = maskOf(!(cc[l] & kZF));
+    break;
+  case Instruction::ifun_ge:
+    for (std::size_t l = 0; l < n; ++l)
+      c[l] = maskOf(!((cc[l] >> 1 ^ cc[l] >> 2) & 1));
+    break;
+  case Instruction::ifun_g:
+    for (std::size_t l = 0; l < n; ++l)
+      c[l] = maskOf(!(((cc[l] >> 1 ^ cc[l] >> 2) | cc[l]) & 1));
+    break;
+  default:
+    std::fill_n(c, n, -1);
+    break;
+  }
+}
+
+void Batch::faultActive(Machine::Stat s, std::uint64_t value) {
+  for (std::size_t l = 0; l < numLanes; ++l) {
+    if (active[l]) {
+      faultLane(l, s, value);
+    }
+  }
+}
+
+const Machine::DecodedInst *Batch::decodeSlow(std::uint64_t addr) {
+  Machine::DecodedInst d;
+  std::uint64_t value = 0;
+  if (Machine::decodeInst(imageMem, addr, d, value) != Machine::Stat::AOK) {
+    return nullptr;
+  }
+
+  // Lanes holding other bytes here can not share the decoded instruction
+  const std::uint64_t len = d.valP - addr;
+  std::uint8_t bytes[kMaxInstLen];
+  std::uint8_t own[kMaxInstLen];
+  imageMem.read(addr, bytes, len);
+  for (std::size_t l = 0; l < numLanes; ++l) {
+    if (scalar[l]) {
+      continue;
+    }
+    mems[l]->read(addr, own, len);
+    if (std::memcmp(bytes, own, len) != 0) {
+      handOff(l);
+      runScalar(l);
+    }
+  }
+
+  for (std::uint64_t a = addr; a < d.valP; ++a) {
+    codePage(a >> Memory::kPageBits, true)->covered[a & Memory::kPageMask] = 1;
+  }
+  codeLow = std::min(codeLow, addr);
+  codeHigh = std::max(codeHigh, d.valP);
+
+  decodedNum = addr >> Memory::kPageBits;
+  decoded = codePage(decodedNum, true);
+  decoded->insts[addr & Memory::kPageMask] = d;
+  return &decoded->insts[addr & Memory::kPageMask];
+}
+
+Batch::CodePage *Batch::codePage(std::uint64_t num, bool create) {
+  auto iter = codePages.find(num);
+  if (iter != codePages.end()) {
+    return iter->second.get();
+  }
+  if (!create) {
+    return nullptr;
+  }
+
+  std::unique_ptr<CodePage> &page = codePages[num];
+  page.reset(new CodePage());
+  return page.get();
+}
+
+bool Batch::touchesCode(std::uint64_t addr, std::uint64_t len) {
+  if (addr >= codeHigh || addr + len <= codeLow) {
+    return false;
+  }
+
+  std::uint64_t end = std::min(addr + len, codeHigh);
+  for (std::uint64_t a = std::max(addr, codeLow); a < end; ++a) {
+    CodePage *page = codePage(a >> Memory::kPageBits, false);
+    if (page && page->covered[a & Memory::kPageMask]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Batch::handOff(std::size_t lane) {
+  Machine::Snapshot snap;
+  snap.memory = mems[lane]->snapshot();
+  for (std::size_t id = 0; id <= Machine::kNumGeneralRegs; ++id) {
+    snap.regs[id] = regs[id * numLanes + lane];
+  }
+  snap.pc = pc[lane];
+  snap.zeroFlag = (flags[lane] & kZF) != 0;
+  snap.signedFlag = (flags[lane] & kSF) != 0;
+  snap.overflowFlag = (flags[lane] & kOF) != 0;
+  snap.stat = static_cast<Machine::Stat>(stat[lane]);
+  snap.steps = steps[lane];
+  snap.faultValue = faultValue[lane];
+
+  scalar[lane] = std::make_unique<Machine>(mems[lane]->size());
+  scalar[lane]->restore(snap);
+  mems[lane].reset();
+  running[lane] = 0;
+  active[lane] = 0;
+  ++stats.handedOff;
+}
+
+void Batch::runScalar(std::size_t lane) {
+  Machine &m = *scalar[lane];
+  m.tryRun(limit[lane] > steps[lane] ? limit[lane] - steps[lane] : 0);
+
+  for (std::size_t id = 0; id <= Machine::kNumGeneralRegs; ++id) {
+    regs[id * numLanes + lane] = m.getReg(id);
+  }
+  std::uint8_t zf, sf, of;
+  m.getFlags(zf, sf, of);
+  flags[lane] = packFlags(zf, sf, of);
+  pc[lane] = m.getPC();
+  stat[lane] = m.getStat();
+  steps[lane] = m.getSteps();
+  faultValue[lane] = m.getFaultValue();
+}
+
+} // namespace y64
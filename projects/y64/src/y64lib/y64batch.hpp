@@ -0,0 +1,143 @@
+#ifndef Y64_LIB_Y64_BATCH_HPP
+#define Y64_LIB_Y64_BATCH_HPP
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "y64machine.hpp"
+
+namespace y64 {
+
+// N machines started from one image and stepped in lockstep. Registers, PC
+// and flags are kept as one array per field indexed by lane, so that an
+// instruction executed by many lanes at once is a loop over the lanes the
+// compiler turns into SIMD code. Each step issues the instruction at the
+// lowest PC of the running lanes to every lane at that PC. Lanes split by
+// a branch run as separate groups and merge again where their PCs meet.
+//
+// Instructions are decoded once from the image. A lane that changes the
+// bytes of decoded code leaves the batch and finishes on a Machine.
+class Batch {
+public:
+  struct Stats {
+    std::uint64_t issued;    // instructions issued to a group of lanes
+    std::uint64_t laneSteps; // instructions executed summed over lanes
+    std::uint64_t handedOff; // lanes moved to a Machine
+  };
+
+  // `image` is typically taken right after Machine::load()
+  Batch(const Machine::Snapshot &image, std::size_t lanes);
+  Batch(const Batch &) = delete;
+  Batch &operator=(const Batch &) = delete;
+  ~Batch();
+
+  std::size_t size() const { return numLanes; }
+
+  // Seed a lane before run(), see Machine::setReg() and setMemQuad()
+  void setReg(std::size_t lane, std::size_t id, std::int64_t value);
+  bool setMemQuad(std::size_t lane, std::uint64_t addr, std::int64_t value);
+
+  // Run every lane until it leaves the AOK state or has executed
+  // `maxSteps` instructions in this call, return the instructions executed
+  // summed over all lanes
+  std::uint64_t run(std::uint64_t maxSteps = Machine::kNoStepLimit);
+
+  Machine::Stat getStat(std::size_t lane) const {
+    return static_cast<Machine::Stat>(stat[lane]);
+  }
+  std::uint64_t getPC(std::size_t lane) const { return pc[lane]; }
+  std::uint64_t getSteps(std::size_t lane) const { return steps[lane]; }
+  std::uint64_t getFaultValue(std::size_t lane) const {
+    return faultValue[lane];
+  }
+  std::int64_t getReg(std::size_t lane, std::size_t id) const {
+    return regs[id * numLanes + lane];
+  }
+
+  const Stats &getStats() const { return stats; }
+
+private:
+  using Lanes = std::vector<std::int64_t>;
+
+  static const std::int64_t kZF = 1;
+  static const std::int64_t kSF = 2;
+  static const std::int64_t kOF = 4;
+
+  std::int64_t *reg(std::size_t id) { return &regs[id * numLanes]; }
+
+  const Machine::DecodedInst *lookupDecoded(std::uint64_t addr) {
+    if ((addr >> Memory::kPageBits) == decodedNum &&
+        decoded->insts[addr & Memory::kPageMask].valid)
+      return &decoded->insts[addr & Memory::kPageMask];
+    return decodeSlow(addr);
+  }
+  const Machine::DecodedInst *decodeSlow(std::uint64_t addr);
+  bool touchesCode(std::uint64_t addr, std::uint64_t len);
+
+  // Execute d for the lanes in `active`, which all are at its address.
+  // Returns whether the lanes still running from the group are again all
+  // at one PC, and sets `next` to it.
+  bool issue(const Machine::DecodedInst &d, std::uint64_t &next);
+  bool issueMemory(const Machine::DecodedInst &d, std::uint64_t &next);
+  void evalCondition(std::uint8_t ifun);
+  void faultActive(Machine::Stat s, std::uint64_t value);
+  void faultLane(std::size_t lane, Machine::Stat s, std::uint64_t value) {
+    stat[lane] = s;
+    faultValue[lane] = value;
+    running[lane] = 0;
+    active[lane] = 0;
+  }
+
+  void handOff(std::size_t lane);
+  void runScalar(std::size_t lane);
+
+private:
+  // Decoded instructions of one page of the image, and which of its bytes
+  // they cover
+  struct CodePage {
+    Machine::DecodedInst insts[Memory::kPageSize];
+    std::uint8_t covered[Memory::kPageSize];
+  };
+
+  CodePage *codePage(std::uint64_t num, bool create);
+
+  std::size_t numLanes;
+  Machine::Snapshot image;
+  Memory imageMem;
+
+  // Per-lane state, registers are kNumGeneralRegs + 1 rows of numLanes
+  // like Machine::valueRegs
+  Lanes regs;
+  std::vector<std::uint64_t> pc;
+  // Condition codes packed as kZF | kSF | kOF, one word per lane keeps the
+  // opq loops to few enough streams to vectorize
+  Lanes flags;
+  std::vector<std::uint8_t> stat;
+  std::vector<std::uint64_t> steps;
+  std::vector<std::uint64_t> faultValue;
+  std::vector<std::unique_ptr<Memory>> mems;
+  // Lanes that changed decoded code, null for the others
+  std::vector<std::unique_ptr<Machine>> scalar;
+
+  // Scratch of run(): step limit, whether the lane may still run, whether
+  // it is in the group being issued, and the condition of cmov and jXX.
+  // The last three are masks of all ones or all zeros.
+  std::vector<std::uint64_t> limit;
+  Lanes running;
+  Lanes active;
+  Lanes cnd;
+
+  std::unordered_map<std::uint64_t, std::unique_ptr<CodePage>> codePages;
+  std::uint64_t decodedNum;
+  CodePage *decoded;
+  std::uint64_t codeLow;
+  std::uint64_t codeHigh;
+
+  Stats stats;
+};
+
+} // namespace y64
+
+#endif // !Y64_LIB_Y64_BATCH_HPP
@@ -0,0 +1,376 @@
+#include "y64blockcache.hpp"
+
+#include <algorithm>
+
+#include "util.hpp"
+
+namespace y64 {
+
+namespace {
+
+using MicroOp = BlockCache::MicroOp;
+
+MicroOp::Kind classify(const Machine::DecodedInst &d) {
+  switch (d.icode) {
+  case Instruction::icode_halt:
+    return MicroOp::Halt;
+  case Instruction::icode_nop:
+    return d.ifun == 0 ? MicroOp::Nop : MicroOp::Fallback;
+  case Instruction::icode_cmov:
+    if (d.ifun == 0)
+      return MicroOp::Rrmov;
+    return d.ifun <= Instruction::ifun_g ? MicroOp::Cmov : MicroOp::Fallback;
+  case Instruction::icode_irmovq:
+    return d.ifun == 0 ? MicroOp::Irmov : MicroOp::Fallback;
+  case Instruction::icode_rmmovq:
+    return d.ifun == 0 ? MicroOp::Rmmov : MicroOp::Fallback;
+  case Instruction::icode_mrmovq:
+    return d.ifun == 0 ? MicroOp::Mrmov : MicroOp::Fallback;
+  case Instruction::icode_opq:
+    switch (d.ifun) {
+    case Instruction::ifun_addq:
+      return MicroOp::Add;
+    case Instruction::ifun_subq:
+      return MicroOp::Sub;
+    case Instruction::ifun_andq:
+      return MicroOp::And;
+    case Instruction::ifun_xorq:
+      return MicroOp::Xor;
+    default:
+      return MicroOp::Fallback;
+    }
+  case Instruction::icode_jmp:
+    if (d.ifun == 0)
+      return MicroOp::Jmp;
+    return d.ifun <= Instruction::ifun_g ? MicroOp::Jcc : MicroOp::Fallback;
+  case Instruction::icode_call:
+    return d.ifun == 0 ? MicroOp::Call : MicroOp::Fallback;
+  case Instruction::icode_ret:
+    return d.ifun == 0 ? MicroOp::Ret : MicroOp::Fallback;
+  case Instruction::icode_pushq:
+    return d.ifun == 0 ? MicroOp::Push : MicroOp::Fallback;
+  case Instruction::icode_popq:
+    return d.ifun == 0 ? MicroOp::Pop : MicroOp::Fallback;
+  default:
+    return MicroOp::Fallback;
+  }
+}
+
+bool isTerminator(MicroOp::Kind kind) { return kind >= MicroOp::Jmp; }
+
+} // namespace
+
+BlockCache::Block *BlockCache::lookup(Machine &m, std::uint64_t pc) {
+  auto iter = blocks.find(pc);
+  if (iter != blocks.end() && iter->second->valid) {
+    ++stats.hits;
+    return iter->second;
+  }
+
+  Block *b = nullptr;
+  if (iter != blocks.end()) {
+    b = iter->second;
+  } else {
+    storage.push_back(std::make_unique<Block>());
+    b = storage.back().get();
+    b->start = pc;
+    blocks[pc] = b;
+  }
+
+  ++stats.misses;
+  build(m, b);
+  return b;
+}
+
+void BlockCache::build(Machine &m, Block *b) {
+  b->ops.clear();
+  b->succ[0] = nullptr;
+  b->succ[1] = nullptr;
+
+  // An undecodable instruction becomes a Fallback op so that the staged
+  // functions raise the fault when, and only if, it is executed
+  Machine::Stat stat = m.stat;
+  std::uint64_t faultValue = m.faultValue;
+  std::uint64_t addr = b->start;
+  std::uint64_t end = addr + 1;
+  while (true) {
+    if (b->ops.size() == kMaxBlockOps - 1) {
+      b->ops.push_back({MicroOp::Next, 0, 0, 0, 0, addr, addr});
+      break;
+    }
+
+    const Machine::DecodedInst *d = m.decodeAhead(addr);
+    if (!d) {
+      m.fault(stat, faultValue);
+      if (b->ops.empty()) {
+        b->ops.push_back({MicroOp::Fallback, 0, 0, 0, 0, addr + 1, addr});
+      } else {
+        b->ops.push_back({MicroOp::Next, 0, 0, 0, 0, addr, addr});
+      }
+      break;
+    }
+
+    MicroOp::Kind kind = classify(*d);
+    if (kind == MicroOp::Fallback && !b->ops.empty()) {
+      b->ops.push_back({MicroOp::Next, 0, 0, 0, 0, addr, addr});
+      break;
+    }
+
+    b->ops.push_back({kind, d->ifun, d->rA, d->rB, d->valC, d->valP, addr});
+    end = std::max(end, d->valP);
+    if (isTerminator(kind))
+      break;
+    addr = d->valP;
+  }
+
+  b->end = end;
+  b->valid = true;
+  b->ahead = true;
+  ranges[b->start] = b;
+}
+
+void BlockCache::invalidate(std::uint64_t addr, std::uint64_t len) {
+  if (ranges.empty()) {
+    return;
+  }
+
+  // Only blocks starting less than maxBlockBytes before addr reach it
+  const std::uint64_t maxBlockBytes = kMaxBlockOps * kMaxInstLen;
+  std::uint64_t end = addr + len;
+  std::uint64_t from = addr > maxBlockBytes ? addr - maxBlockBytes : 0;
+  for (auto iter = ranges.lower_bound(from);
+       iter != ranges.end() && iter->first < end;) {
+    Block *b = iter->second;
+    if (b->end <= addr) {
+      ++iter;
+      continue;
+    }
+
+    b->valid = false;
+    iter = ranges.erase(iter);
+    ++stats.invalidated;
+  }
+}
+
+Machine::BlockStats Machine::getBlockStats() const {
+  if (!blockCache) {
+    return BlockStats{0, 0, 0, 0};
+  }
+  return blockCache->getStats();
+}
+
+std::uint64_t Machine::runBlocks(std::uint64_t maxSteps) {
+  if (!isOk()) {
+    return 0;
+  }
+
+  if (!blockCache) {
+    blockCache = std::make_unique<BlockCache>();
+  }
+
+  BlockCache &cache = *blockCache;
+  const std::uint64_t start = steps;
+  const std::uint64_t limit =
+      maxSteps > kNoStepLimit - steps ? kNoStepLimit : steps + maxSteps;
+  std::int64_t *regs = valueRegs.data();
+
+  // `block` ended after running `count` of its instructions. Fallback and
+  // Next stand for an instruction the block itself does not run.
+  auto settle = [&](BlockCache::Block *block, std::uint64_t count) {
+    if (block->ahead || !aheadHits.empty()) {
+      std::uint64_t total = block->ops.size();
+      if (block->ops.back().kind >= MicroOp::Fallback) {
+        --total;
+      }
+      block->ahead = settleAhead(block->start, count, total);
+    }
+  };
+
+  // A faulting op leaves pc at its own address and counts only the ops
+  // before it
+#define CHECK_FAULT(expr)                                                      \
+  do {                                                                         \
+    if (!(expr)) {                                                             \
+      pc = op->pc;                                                             \
+      steps += op - first;                                                     \
+      settle(b, op - first);                                                   \
+      return steps - start;                                                    \
+    }                                                                          \
+  } while (0)
+
+  BlockCache::Block *b = nullptr;
+  while (isOk() && steps < limit) {
+    if (!b) {
+      b = cache.lookup(*this, pc);
+    }
+
+    const std::size_t n = b->ops.size();
+    if (limit - steps < n) {
+      b = nullptr;
+      std::uint64_t at = pc;
+      runThreaded(1);
+      if (!decodedAhead.empty()) {
+        settleAhead(at, 1, 1);
+      }
+      continue;
+    }
+
+    const MicroOp *first = b->ops.data();
+    const MicroOp *last = first + n - 1;
+    const MicroOp *op = first;
+    bool fallback = false;
+    for (; op != last; ++op) {
+      switch (op->kind) {
+      case MicroOp::Nop:
+        break;
+      case MicroOp::Rrmov:
+        regs[op->rB] = regs[op->rA];
+        break;
+      case MicroOp::Cmov:
+        if (testCondition(op->cond))
+          regs[op->rB] = regs[op->rA];
+        break;
+      case MicroOp::Irmov:
+        regs[op->rB] = op->valC;
+        break;
+      case MicroOp::Rmmov:
+        CHECK_FAULT(writeMemQuad(regs[op->rB] + op->valC, regs[op->rA]));
+        break;
+      case MicroOp::Mrmov:
+        CHECK_FAULT(readMemQuad(regs[op->rB] + op->valC, regs[op->rA]));
+        break;
+      case MicroOp::Add: {
+        std::int64_t a = regs[op->rA];
+        std::int64_t b = regs[op->rB];
+        std::int64_t e = static_cast<std::int64_t>(
+            static_cast<std::uint64_t>(b) + static_cast<std::uint64_t>(a));
+        setFlags(Instruction::ifun_addq, a, b, e);
+        regs[op->rB] = e;
+        break;
+      }
+      case MicroOp::Sub: {
+        std::int64_t a = regs[op->rA];
+        std::int64_t b = regs[op->rB];
+        std::int64_t e = static_cast<std::int64_t>(
+            static_cast<std::uint64_t>(b) - static_cast<std::uint64_t>(a));
+        setFlags(Instruction::ifun_subq, a, b, e);
+        regs[op->rB] = e;
+        break;
+      }
+      case MicroOp::And: {
+        std::int64_t e = regs[op->rB] & regs[op->rA];
+        ccOp = Instruction::ifun_andq;
+        ccE = e;
+        regs[op->rB] = e;
+        break;
+      }
+      case MicroOp::Xor: {
+        std::int64_t e = regs[op->rB] ^ regs[op->rA];
+        ccOp = Instruction::ifun_xorq;
+        ccE = e;
+        regs[op->rB] = e;
+        break;
+      }
+      case MicroOp::Push: {
+        std::int64_t sp = regs[Register::rsp] - 8;
+        CHECK_FAULT(writeMemQuad(sp, regs[op->rA]));
+        regs[Register::rsp] = sp;
+        break;
+      }
+      case MicroOp::Pop: {
+        std::int64_t sp = regs[Register::rsp];
+        std::int64_t val;
+        CHECK_FAULT(readMemQuad(sp, val));
+        regs[Register::rsp] = sp + 8;
+        regs[op->rA] = val;
+        break;
+      }
+      default:
+        Y64_UNREACHABLE("Terminator in the middle of a block");
+      }
+
+      // A store overwrote this block, continue in a rebuilt one
+      if (!b->valid) {
+        break;
+      }
+    }
+
+    if (op != last) {
+      pc = op->valP;
+      steps += op - first + 1;
+      settle(b, op - first + 1);
+      b = nullptr;
+      continue;
+    }
+
+    BlockCache::Block *ran = b;
+    switch (last->kind) {
+    case MicroOp::Jmp:
+      pc = last->valC;
+      steps += n;
+      b = cache.follow(*this, b, 1, pc);
+      break;
+    case MicroOp::Jcc: {
+      int taken = testCondition(last->cond) ? 1 : 0;
+      pc = taken ? last->valC : last->valP;
+      steps += n;
+      b = cache.follow(*this, b, taken, pc);
+      break;
+    }
+    case MicroOp::Call: {
+      std::int64_t sp = regs[Register::rsp] - 8;
+      CHECK_FAULT(writeMemQuad(sp, last->valP));
+      regs[Register::rsp] = sp;
+      pc = last->valC;
+      steps += n;
+      b = b->valid ? cache.follow(*this, b, 1, pc) : nullptr;
+      break;
+    }
+    case MicroOp::Ret: {
+      std::int64_t sp = regs[Register::rsp];
+      std::int64_t target;
+      CHECK_FAULT(readMemQuad(sp, target));
+      regs[Register::rsp] = sp + 8;
+      pc = target;
+      steps += n;
+      b = nullptr;
+      break;
+    }
+    case MicroOp::Halt:
+      stat = Stat::HLT;
+      pc = 0;
+      steps += n;
+      b = nullptr;
+      break;
+    case MicroOp::Next:
+      // Only marks where the block stops, the instruction there has not run
+      pc = last->valP;
+      steps += n - 1;
+      b = cache.follow(*this, b, 0, pc);
+      break;
+    case MicroOp::Fallback:
+      pc = last->pc;
+      steps += n - 1;
+      b = nullptr;
+      fallback = true;
+      break;
+    default:
+      Y64_UNREACHABLE("Block without terminator");
+    }
+    settle(ran, last->kind >= MicroOp::Fallback ? n - 1 : n);
+
+    if (fallback) {
+      std::uint64_t at = pc;
+      tryStep();
+      if (!decodedAhead.empty()) {
+        settleAhead(at, 1, 1);
+      }
+    }
+  }
+
+#undef CHECK_FAULT
+
+  return steps - start;
+}
+
+} // namespace y64
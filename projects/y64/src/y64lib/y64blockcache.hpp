@@ -0,0 +1,104 @@
+#ifndef Y64_LIB_Y64_BLOCK_CACHE_HPP
+#define Y64_LIB_Y64_BLOCK_CACHE_HPP
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "y64machine.hpp"
+
+namespace y64 {
+
+// Basic blocks of pre-resolved micro-ops keyed by start PC. A block ends at
+// jXX, call, ret, halt or before an encoding without a dedicated micro-op.
+// Direct exits are linked to their successor block on first use, so the
+// lookup table is only consulted for ret and unlinked exits.
+class BlockCache {
+public:
+  struct MicroOp {
+    enum Kind : std::uint8_t {
+      Nop,
+      Rrmov,
+      Cmov,
+      Irmov,
+      Rmmov,
+      Mrmov,
+      Add,
+      Sub,
+      And,
+      Xor,
+      Push,
+      Pop,
+      // terminators
+      Jmp,
+      Jcc,
+      Call,
+      Ret,
+      Halt,
+      Fallback, // run the instruction through the staged functions
+      Next,     // block reached its size limit, continue at valP
+    };
+
+    Kind kind;
+    std::uint8_t cond;
+    std::uint8_t rA;
+    std::uint8_t rB;
+    std::int64_t valC;
+    std::uint64_t valP;
+    std::uint64_t pc;
+  };
+
+  struct Block {
+    std::uint64_t start;
+    std::uint64_t end; // one past the last byte of guest code
+    bool valid;
+    // Some instructions were decoded for the block and did not run yet
+    bool ahead;
+    std::vector<MicroOp> ops;
+    // Successors of the terminator: [0] falls through, [1] is taken
+    Block *succ[2];
+  };
+
+  static const std::size_t kMaxBlockOps = 64;
+
+  BlockCache() : blocks(), ranges(), storage(), stats() {}
+  BlockCache(const BlockCache &) = delete;
+  BlockCache &operator=(const BlockCache &) = delete;
+
+  Block *lookup(Machine &m, std::uint64_t pc);
+
+  // Follow the successor link `which` of b, linking it on first use
+  Block *follow(Machine &m, Block *b, int which, std::uint64_t pc) {
+    Block *next = b->succ[which];
+    if (next && next->valid && next->start == pc) {
+      ++stats.chained;
+      return next;
+    }
+    next = lookup(m, pc);
+    b->succ[which] = next;
+    return next;
+  }
+
+  // Discard blocks covering guest bytes [addr, addr + len). The Block
+  // objects are kept and rebuilt in place the next time their PC is looked
+  // up, so links from other blocks never dangle.
+  void invalidate(std::uint64_t addr, std::uint64_t len);
+
+  const Machine::BlockStats &getStats() const { return stats; }
+
+private:
+  void build(Machine &m, Block *b);
+
+private:
+  std::unordered_map<std::uint64_t, Block *> blocks;
+  // Valid blocks ordered by start address, for invalidation
+  std::map<std::uint64_t, Block *> ranges;
+  std::vector<std::unique_ptr<Block>> storage;
+  Machine::BlockStats stats;
+};
+
+} // namespace y64
+
+#endif // !Y64_LIB_Y64_BLOCK_CACHE_HPP
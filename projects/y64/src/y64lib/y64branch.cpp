@@ -0,0 +1,122 @@
+#include "y64branch.hpp"
+
+#include <algorithm>
+
+#include "util.hpp"
+
+namespace y64 {
+
+namespace {
+
+// Counters start weakly taken, the first prediction matches AlwaysTaken
+const std::uint8_t kWeaklyTaken = 2;
+
+} // namespace
+
+BranchPredictor::BranchPredictor(Scheme scheme, unsigned tableBits)
+    : scheme(scheme), tableMask((std::uint64_t{1} << tableBits) - 1),
+      counters(), history(0), branches(), executed(0), mispredicts(0) {
+  if (scheme == Scheme::TwoBit || scheme == Scheme::Gshare) {
+    counters.assign(tableMask + 1, kWeaklyTaken);
+  }
+}
+
+bool BranchPredictor::parseScheme(const std::string &name, Scheme &scheme) {
+  if (name == "always-taken") {
+    scheme = Scheme::AlwaysTaken;
+  } else if (name == "btfnt") {
+    scheme = Scheme::Btfnt;
+  } else if (name == "2bit") {
+    scheme = Scheme::TwoBit;
+  } else if (name == "gshare") {
+    scheme = Scheme::Gshare;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *BranchPredictor::schemeName(Scheme scheme) {
+  switch (scheme) {
+  case Scheme::AlwaysTaken:
+    return "always-taken";
+  case Scheme::Btfnt:
+    return "btfnt";
+  case Scheme::TwoBit:
+    return "2bit";
+  case Scheme::Gshare:
+    return "gshare";
+  default:
+    Y64_UNREACHABLE("Unknown predictor scheme");
+  }
+}
+
+void BranchPredictor::record(std::uint64_t pc, std::uint64_t target,
+                             bool taken) {
+  bool predicted = predict(pc, target);
+  Branch &b = branches[pc];
+  b.pc = pc;
+  b.target = target;
+  if (taken) {
+    ++b.taken;
+  } else {
+    ++b.notTaken;
+  }
+  if (predicted != taken) {
+    ++b.mispredicts;
+    ++mispredicts;
+  }
+  ++executed;
+  update(pc, taken);
+}
+
+std::vector<BranchPredictor::Branch> BranchPredictor::getBranches() const {
+  std::vector<Branch> result;
+  result.reserve(branches.size());
+  for (const auto &entry : branches) {
+    result.push_back(entry.second);
+  }
+  std::sort(result.begin(), result.end(),
+            [](const Branch &a, const Branch &b) { return a.pc < b.pc; });
+  return result;
+}
+
+std::size_t BranchPredictor::index(std::uint64_t pc) const {
+  if (scheme == Scheme::Gshare) {
+    return (pc ^ history) & tableMask;
+  }
+  return pc & tableMask;
+}
+
+bool BranchPredictor::predict(std::uint64_t pc, std::uint64_t target) const {
+  switch (scheme) {
+  case Scheme::AlwaysTaken:
+    return true;
+  case Scheme::Btfnt:
+    return target <= pc;
+  case Scheme::TwoBit:
+    Y64_FALLTHROUGH;
+  case Scheme::Gshare:
+    return counters[index(pc)] >= kWeaklyTaken;
+  default:
+    Y64_UNREACHABLE("Unknown predictor scheme");
+  }
+}
+
+void BranchPredictor::update(std::uint64_t pc, bool taken) {
+  if (counters.empty()) {
+    return;
+  }
+
+  std::uint8_t &c = counters[index(pc)];
+  if (taken && c < 3) {
+    ++c;
+  } else if (!taken && c > 0) {
+    --c;
+  }
+  if (scheme == Scheme::Gshare) {
+    history = ((history << 1) | (taken ? 1 : 0)) & tableMask;
+  }
+}
+
+} // namespace y64
@@ -0,0 +1,70 @@
+#ifndef Y64_LIB_Y64_BRANCH_HPP
+#define Y64_LIB_Y64_BRANCH_HPP
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace y64 {
+
+// Predicts the conditional jumps a Machine executes and keeps per-branch
+// outcome and misprediction counts. Attached with
+// Machine::setBranchPredictor(), it sees every jXX that updatePC() retires.
+class BranchPredictor {
+public:
+  enum class Scheme : std::uint8_t {
+    AlwaysTaken, // what PIPE fetches
+    Btfnt,       // backward taken, forward not taken
+    TwoBit,      // 2-bit saturating counters indexed by PC
+    Gshare,      // 2-bit counters indexed by PC xor global history
+  };
+
+  struct Branch {
+    std::uint64_t pc;
+    std::uint64_t target;
+    std::uint64_t taken;
+    std::uint64_t notTaken;
+    std::uint64_t mispredicts;
+  };
+
+  static const unsigned kDefaultTableBits = 12;
+
+  // 2^tableBits counters, and as many bits of history for Gshare
+  explicit BranchPredictor(Scheme scheme,
+                           unsigned tableBits = kDefaultTableBits);
+
+  // Scheme named "always-taken", "btfnt", "2bit" or "gshare", false if the
+  // name is unknown
+  static bool parseScheme(const std::string &name, Scheme &scheme);
+  static const char *schemeName(Scheme scheme);
+
+  Scheme getScheme() const { return scheme; }
+
+  // Predict the jXX at pc to target, then learn whether it was taken
+  void record(std::uint64_t pc, std::uint64_t target, bool taken);
+
+  std::uint64_t getExecuted() const { return executed; }
+  std::uint64_t getMispredicts() const { return mispredicts; }
+
+  // Every branch seen, ordered by PC
+  std::vector<Branch> getBranches() const;
+
+private:
+  bool predict(std::uint64_t pc, std::uint64_t target) const;
+  void update(std::uint64_t pc, bool taken);
+  std::size_t index(std::uint64_t pc) const;
+
+private:
+  Scheme scheme;
+  std::uint64_t tableMask;
+  std::vector<std::uint8_t> counters;
+  std::uint64_t history;
+  std::unordered_map<std::uint64_t, Branch> branches;
+  std::uint64_t executed;
+  std::uint64_t mispredicts;
+};
+
+} // namespace y64
+
+#endif // !Y64_LIB_Y64_BRANCH_HPP
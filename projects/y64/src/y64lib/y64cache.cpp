@@ -0,0 +1,220 @@
+#include "y64cache.hpp"
+
+#include <cstdlib>
+
+namespace y64 {
+
+namespace {
+
+const std::uint64_t kInvalid = UINT64_MAX;
+
+bool isPowerOfTwo(std::uint64_t n) { return n != 0 && (n & (n - 1)) == 0; }
+
+unsigned log2Of(std::uint64_t n) {
+  unsigned bits = 0;
+  while (n > 1) {
+    n >>= 1;
+    ++bits;
+  }
+  return bits;
+}
+
+// Number with an optional K or M suffix, false if anything else follows
+bool parseSize(const std::string &text, std::uint64_t &value) {
+  if (text.empty()) {
+    return false;
+  }
+  char *end = nullptr;
+  value = std::strtoull(text.c_str(), &end, 0);
+  if (*end == 'K' || *end == 'k') {
+    value <<= 10;
+    ++end;
+  } else if (*end == 'M' || *end == 'm') {
+    value <<= 20;
+    ++end;
+  }
+  return *end == '\0';
+}
+
+} // namespace
+
+bool Cache::Config::isValid() const {
+  return isPowerOfTwo(size) && isPowerOfTwo(ways) && ways <= 64 &&
+         isPowerOfTwo(lineSize) &&
+         size >= static_cast<std::uint64_t>(ways) * lineSize;
+}
+
+Cache::Cache(const Config &config)
+    : config(config), lineBits(log2Of(config.lineSize)),
+      setMask(config.size / config.ways / config.lineSize - 1), tags(),
+      dirty(), ages(), clock(0), stats() {
+  std::uint64_t slots = (setMask + 1) * config.ways;
+  tags.assign(slots, kInvalid);
+  dirty.assign(slots, 0);
+  ages.assign(config.policy == Policy::Lru ? slots : setMask + 1, 0);
+}
+
+bool Cache::access(std::uint64_t addr, bool write, std::uint64_t &evicted) {
+  std::uint64_t line = addr >> lineBits;
+  std::uint64_t set = line & setMask;
+  std::uint64_t base = set * config.ways;
+  evicted = kInvalid;
+  ++stats.accesses;
+
+  for (std::uint32_t way = 0; way < config.ways; ++way) {
+    if (tags[base + way] == line) {
+      ++stats.hits;
+      dirty[base + way] |= write ? 1 : 0;
+      touch(set, way);
+      return true;
+    }
+  }
+
+  ++stats.misses;
+  std::uint32_t way = victim(set);
+  if (tags[base + way] != kInvalid && dirty[base + way]) {
+    evicted = tags[base + way] << lineBits;
+    ++stats.writebacks;
+  }
+  tags[base + way] = line;
+  dirty[base + way] = write ? 1 : 0;
+  touch(set, way);
+  return false;
+}
+
+std::uint32_t Cache::victim(std::uint64_t set) const {
+  std::uint64_t base = set * config.ways;
+  for (std::uint32_t way = 0; way < config.ways; ++way) {
+    if (tags[base + way] == kInvalid) {
+      return way;
+    }
+  }
+
+  if (config.policy == Policy::Lru) {
+    std::uint32_t oldest = 0;
+    for (std::uint32_t way = 1; way < config.ways; ++way) {
+      if (ages[base + way] < ages[base + oldest]) {
+        oldest = way;
+      }
+    }
+    return oldest;
+  }
+
+  // Follow the tree bits from the root, node n has children 2n and 2n + 1
+  // and the leaves past the last inner node are the ways
+  std::uint64_t bits = ages[set];
+  std::uint32_t node = 1;
+  while (node < config.ways) {
+    node = node * 2 + ((bits >> node) & 1);
+  }
+  return node - config.ways;
+}
+
+void Cache::touch(std::uint64_t set, std::uint32_t way) {
+  if (config.policy == Policy::Lru) {
+    ages[set * config.ways + way] = ++clock;
+    return;
+  }
+
+  // Point every node on the path to the way at the other half
+  std::uint64_t &bits = ages[set];
+  std::uint32_t node = way + config.ways;
+  while (node > 1) {
+    std::uint32_t parent = node / 2;
+    std::uint64_t away = (node & 1) ^ 1;
+    bits = (bits & ~(std::uint64_t{1} << parent)) | (away << parent);
+    node = parent;
+  }
+}
+
+CacheHierarchy::Config CacheHierarchy::defaultConfig() {
+  Config config;
+  config.l1i = {32 << 10, 8, 64, Cache::Policy::Lru, 4};
+  config.l1d = {32 << 10, 8, 64, Cache::Policy::Lru, 4};
+  config.l2 = {256 << 10, 8, 64, Cache::Policy::Lru, 12};
+  config.memoryCycles = 100;
+  return config;
+}
+
+bool CacheHierarchy::parseLevel(const std::string &spec,
+                                Cache::Config &config) {
+  Cache::Config parsed = config;
+  std::size_t field = 0;
+  std::size_t begin = 0;
+  while (begin <= spec.size()) {
+    std::size_t end = spec.find(',', begin);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+    std::string text = spec.substr(begin, end - begin);
+    begin = end + 1;
+
+    std::uint64_t value = 0;
+    if (field == 3) {
+      if (text == "lru") {
+        parsed.policy = Cache::Policy::Lru;
+      } else if (text == "plru") {
+        parsed.policy = Cache::Policy::Plru;
+      } else {
+        return false;
+      }
+    } else if (field > 4 || !parseSize(text, value) || value > UINT32_MAX) {
+      return false;
+    } else if (field == 0) {
+      parsed.size = value;
+    } else if (field == 1) {
+      parsed.ways = static_cast<std::uint32_t>(value);
+    } else if (field == 2) {
+      parsed.lineSize = static_cast<std::uint32_t>(value);
+    } else {
+      parsed.hitCycles = static_cast<std::uint32_t>(value);
+    }
+    ++field;
+  }
+
+  if (!parsed.isValid()) {
+    return false;
+  }
+  config = parsed;
+  return true;
+}
+
+CacheHierarchy::CacheHierarchy(const Config &config)
+    : l1i(config.l1i), l1d(config.l1d), l2(config.l2),
+      memoryCycles(config.memoryCycles), memoryAccesses(0), cycles(0) {}
+
+void CacheHierarchy::accessLines(Cache &l1, std::uint64_t addr,
+                                 std::uint64_t len, bool write) {
+  std::uint64_t lineSize = l1.getConfig().lineSize;
+  std::uint64_t first = addr & ~(lineSize - 1);
+  std::uint64_t last = (addr + len - 1) & ~(lineSize - 1);
+  for (std::uint64_t line = first; line <= last; line += lineSize) {
+    accessLine(l1, line, write);
+  }
+}
+
+void CacheHierarchy::accessLine(Cache &l1, std::uint64_t addr, bool write) {
+  std::uint64_t evicted = 0;
+  std::uint64_t spilled = 0;
+  cycles += l1.getConfig().hitCycles;
+  bool hit = l1.access(addr, write, evicted);
+  if (!hit) {
+    // Write allocate: the line is read from L2 either way
+    cycles += l2.getConfig().hitCycles;
+    if (!l2.access(addr, false, spilled)) {
+      cycles += memoryCycles;
+      ++memoryAccesses;
+    }
+    if (spilled != UINT64_MAX) {
+      ++memoryAccesses;
+    }
+  }
+  if (evicted != UINT64_MAX) {
+    l2.access(evicted, true, spilled);
+    if (spilled != UINT64_MAX) {
+      ++memoryAccesses;
+    }
+  }
+}
+
+} // namespace y64
@@ -0,0 +1,120 @@
+#ifndef Y64_LIB_Y64_CACHE_HPP
+#define Y64_LIB_Y64_CACHE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace y64 {
+
+// One set-associative, write-back, write-allocate cache level. It only
+// tracks tags, the data stays in Memory.
+class Cache {
+public:
+  enum class Policy : std::uint8_t {
+    Lru,  // evict the least recently used way
+    Plru, // tree pseudo-LRU, one bit per inner node
+  };
+
+  struct Config {
+    std::uint64_t size;     // bytes
+    std::uint32_t ways;     // 1 to 64
+    std::uint32_t lineSize; // bytes
+    Policy policy;
+    std::uint32_t hitCycles; // latency of a hit in this level
+
+    // Powers of two, and at least one set
+    bool isValid() const;
+  };
+
+  struct Stats {
+    std::uint64_t accesses;
+    std::uint64_t hits;
+    std::uint64_t misses;
+    std::uint64_t writebacks; // dirty lines evicted
+  };
+
+  explicit Cache(const Config &config);
+
+  // Look up the line holding addr and bring it in on a miss. Returns
+  // whether it hit, and sets `evicted` to the address of a dirty line
+  // pushed out to make room, or UINT64_MAX.
+  bool access(std::uint64_t addr, bool write, std::uint64_t &evicted);
+
+  const Config &getConfig() const { return config; }
+  const Stats &getStats() const { return stats; }
+
+private:
+  std::uint32_t victim(std::uint64_t set) const;
+  void touch(std::uint64_t set, std::uint32_t way);
+
+private:
+  Config config;
+  std::uint32_t lineBits;
+  std::uint64_t setMask;
+  // Per way of every set: tag (line number) or kInvalid, and dirty bit
+  std::vector<std::uint64_t> tags;
+  std::vector<std::uint8_t> dirty;
+  // LRU: last use stamp per way, PLRU: tree bits per set
+  std::vector<std::uint64_t> ages;
+  std::uint64_t clock;
+  Stats stats;
+};
+
+// Split L1 instruction and data caches in front of a unified L2, fed by
+// the fetch() and accessMemory() stages once attached with
+// Machine::setCacheHierarchy(). The cycle estimate charges every access
+// the hit latency of each level it reaches, and memoryCycles when it
+// misses L2. Writebacks are assumed to be buffered and cost nothing.
+class CacheHierarchy {
+public:
+  struct Config {
+    Cache::Config l1i;
+    Cache::Config l1d;
+    Cache::Config l2;
+    std::uint32_t memoryCycles;
+  };
+
+  // 32 KiB 8-way L1s, 256 KiB 8-way L2, 64 byte lines, LRU
+  static Config defaultConfig();
+
+  // Parse "size,ways,line[,lru|plru[,cycles]]" with sizes like 32K into
+  // `config`, keeping the fields not given. False if malformed or invalid.
+  static bool parseLevel(const std::string &spec, Cache::Config &config);
+
+  explicit CacheHierarchy(const Config &config);
+
+  // Accesses of len bytes, split at line boundaries
+  void fetch(std::uint64_t addr, std::uint64_t len) {
+    accessLines(l1i, addr, len, false);
+  }
+  void read(std::uint64_t addr, std::uint64_t len) {
+    accessLines(l1d, addr, len, false);
+  }
+  void write(std::uint64_t addr, std::uint64_t len) {
+    accessLines(l1d, addr, len, true);
+  }
+
+  const Cache &getL1I() const { return l1i; }
+  const Cache &getL1D() const { return l1d; }
+  const Cache &getL2() const { return l2; }
+  std::uint64_t getMemoryAccesses() const { return memoryAccesses; }
+  std::uint64_t getCycles() const { return cycles; }
+
+private:
+  void accessLines(Cache &l1, std::uint64_t addr, std::uint64_t len,
+                   bool write);
+  void accessLine(Cache &l1, std::uint64_t addr, bool write);
+
+private:
+  Cache l1i;
+  Cache l1d;
+  Cache l2;
+  std::uint32_t memoryCycles;
+  std::uint64_t memoryAccesses; // L2 misses and L2 writebacks
+  std::uint64_t cycles;
+};
+
+} // namespace y64
+
+#endif // !Y64_LIB_Y64_CACHE_HPP
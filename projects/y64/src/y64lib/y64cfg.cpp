@@ -0,0 +1,372 @@
+#include "y64cfg.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+#include "util.hpp"
+
+namespace y64 {
+
+namespace {
+
+// Encodings the stages reject with INS, see Machine::getCondition() and
+// Machine::executeOpInst()
+bool raisesIns(const Machine::DecodedInst &d) {
+  switch (d.icode) {
+  case Instruction::icode_cmov:
+    Y64_FALLTHROUGH;
+  case Instruction::icode_jmp:
+    return d.ifun > Instruction::ifun_g;
+  case Instruction::icode_opq:
+    return d.ifun > Instruction::ifun_xorq;
+  default:
+    return false;
+  }
+}
+
+bool endsBlock(const Machine::DecodedInst &d) {
+  switch (d.icode) {
+  case Instruction::icode_halt:
+    Y64_FALLTHROUGH;
+  case Instruction::icode_jmp:
+    Y64_FALLTHROUGH;
+  case Instruction::icode_call:
+    Y64_FALLTHROUGH;
+  case Instruction::icode_ret:
+    return true;
+  default:
+    return false;
+  }
+}
+
+} // namespace
+
+const std::size_t Cfg::kNone;
+
+Cfg::Cfg(const Machine::Snapshot &image)
+    : insts(), faults(), leaders(), entries(), blocks(), functions(), loops(),
+      instructions(0) {
+  Memory mem(image.memory->size());
+  mem.restore(*image.memory);
+
+  discover(mem, image.pc);
+  buildBlocks();
+  buildFunctions();
+  computeDominators();
+  findLoops();
+
+  leaders.clear();
+}
+
+void Cfg::discover(const Memory &mem, std::uint64_t entry) {
+  std::vector<std::uint64_t> work;
+  auto addLeader = [&](std::uint64_t addr) {
+    if (leaders.insert(addr).second) {
+      work.push_back(addr);
+    }
+  };
+
+  entries.push_back(entry);
+  addLeader(entry);
+  while (!work.empty()) {
+    std::uint64_t addr = work.back();
+    work.pop_back();
+
+    // Decode up to the end of the block, or to code decoded before
+    while (insts.count(addr) == 0) {
+      Machine::DecodedInst d;
+      std::uint64_t value = 0;
+      Machine::Stat stat = Machine::decodeInst(mem, addr, d, value);
+      if (stat == Machine::Stat::AOK && raisesIns(d)) {
+        stat = Machine::Stat::INS;
+        value = d.getOpCode();
+      }
+      if (stat != Machine::Stat::AOK) {
+        faults[addr] = Fault{stat, value};
+        break;
+      }
+      insts[addr] = d;
+
+      if (d.icode == Instruction::icode_jmp) {
+        addLeader(d.valC);
+        if (d.ifun != Instruction::ifun_jmp) {
+          addLeader(d.valP);
+        }
+      } else if (d.icode == Instruction::icode_call) {
+        if (std::find(entries.begin(), entries.end(), d.valC) ==
+            entries.end()) {
+          entries.push_back(d.valC);
+        }
+        addLeader(d.valC);
+        addLeader(d.valP);
+      }
+      if (endsBlock(d)) {
+        break;
+      }
+      addr = d.valP;
+    }
+  }
+}
+
+void Cfg::buildBlocks() {
+  // Instructions before each block's exit, to find its successors after
+  // every block exists
+  std::vector<const Machine::DecodedInst *> last;
+  for (std::uint64_t start : leaders) {
+    if (insts.count(start) == 0) {
+      // A target that does not decode, the blocks going there fault
+      continue;
+    }
+
+    Block b{start, start, 0, {}, {}, kNone, kNone, false};
+    const Machine::DecodedInst *d = nullptr;
+    do {
+      d = &insts[b.end];
+      ++b.instructions;
+      b.end = d->valP;
+    } while (!endsBlock(*d) && leaders.count(b.end) == 0 &&
+             insts.count(b.end) != 0);
+    instructions += b.instructions;
+    blocks.push_back(b);
+    last.push_back(d);
+  }
+
+  for (std::size_t i = 0; i < blocks.size(); ++i) {
+    const Machine::DecodedInst &d = *last[i];
+    std::vector<std::uint64_t> targets;
+    switch (d.icode) {
+    case Instruction::icode_halt:
+      Y64_FALLTHROUGH;
+    case Instruction::icode_ret:
+      break;
+    case Instruction::icode_jmp:
+      targets.push_back(d.valC);
+      if (d.ifun != Instruction::ifun_jmp) {
+        targets.push_back(d.valP);
+      }
+      break;
+    case Instruction::icode_call:
+      // The callee faulting is charged to the call as well
+      if (findBlock(d.valC) == kNone) {
+        blocks[i].faults = true;
+      }
+      targets.push_back(d.valP);
+      break;
+    default:
+      targets.push_back(d.valP);
+      break;
+    }
+
+    for (std::uint64_t addr : targets) {
+      std::size_t succ = findBlock(addr);
+      if (succ == kNone) {
+        blocks[i].faults = true;
+        continue;
+      }
+      std::vector<std::size_t> &succs = blocks[i].succs;
+      if (std::find(succs.begin(), succs.end(), succ) == succs.end()) {
+        succs.push_back(succ);
+        blocks[succ].preds.push_back(i);
+      }
+    }
+    std::sort(blocks[i].succs.begin(), blocks[i].succs.end());
+  }
+}
+
+void Cfg::buildFunctions() {
+  std::vector<bool> seen(blocks.size());
+  for (std::uint64_t entry : entries) {
+    std::size_t first = findBlock(entry);
+    if (first == kNone) {
+      continue;
+    }
+
+    Function f{entry, {}, 0};
+    std::fill(seen.begin(), seen.end(), false);
+    std::vector<std::size_t> work{first};
+    seen[first] = true;
+    while (!work.empty()) {
+      std::size_t b = work.back();
+      work.pop_back();
+      f.blocks.push_back(b);
+      f.instructions += blocks[b].instructions;
+      for (std::size_t succ : blocks[b].succs) {
+        if (!seen[succ]) {
+          seen[succ] = true;
+          work.push_back(succ);
+        }
+      }
+    }
+    std::sort(f.blocks.begin(), f.blocks.end());
+    functions.push_back(std::move(f));
+  }
+}
+
+void Cfg::computeDominators() {
+  // Cooper, Harvey and Kennedy's iteration over reverse postorder, below
+  // a virtual root whose successors are the function entries
+  const std::size_t root = blocks.size();
+  std::vector<std::size_t> order; // postorder, root last
+  std::vector<std::size_t> rank(blocks.size() + 1, kNone);
+  {
+    std::vector<bool> seen(blocks.size() + 1);
+    // Block and the next of its successors to visit
+    std::vector<std::pair<std::size_t, std::size_t>> stack{{root, 0}};
+    seen[root] = true;
+    while (!stack.empty()) {
+      std::size_t b = stack.back().first;
+      std::size_t i = stack.back().second++;
+      std::size_t count =
+          b == root ? functions.size() : blocks[b].succs.size();
+      if (i == count) {
+        rank[b] = order.size();
+        order.push_back(b);
+        stack.pop_back();
+        continue;
+      }
+
+      std::size_t next =
+          b == root ? findBlock(functions[i].entry) : blocks[b].succs[i];
+      if (!seen[next]) {
+        seen[next] = true;
+        stack.push_back({next, 0});
+      }
+    }
+  }
+
+  std::vector<std::size_t> idom(blocks.size() + 1, kNone);
+  idom[root] = root;
+  auto intersect = [&](std::size_t a, std::size_t b) {
+    while (a != b) {
+      while (rank[a] < rank[b]) {
+        a = idom[a];
+      }
+      while (rank[b] < rank[a]) {
+        b = idom[b];
+      }
+    }
+    return a;
+  };
+  std::vector<bool> isEntry(blocks.size());
+  for (const Function &f : functions) {
+    isEntry[findBlock(f.entry)] = true;
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto iter = std::next(order.rbegin()); iter != order.rend(); ++iter) {
+      std::size_t b = *iter;
+      std::size_t dom = isEntry[b] ? root : kNone;
+      for (std::size_t p : blocks[b].preds) {
+        if (idom[p] != kNone) {
+          dom = dom == kNone ? p : intersect(p, dom);
+        }
+      }
+      if (dom != idom[b]) {
+        idom[b] = dom;
+        changed = true;
+      }
+    }
+  }
+
+  for (std::size_t b = 0; b < blocks.size(); ++b) {
+    blocks[b].idom = idom[b] == root ? kNone : idom[b];
+  }
+}
+
+void Cfg::findLoops() {
+  // A back edge goes to a block dominating its source, the loop of its
+  // header is every block reaching the source without passing the header
+  std::map<std::size_t, std::set<std::size_t>> bodies;
+  for (std::size_t b = 0; b < blocks.size(); ++b) {
+    for (std::size_t h : blocks[b].succs) {
+      if (!dominates(h, b)) {
+        continue;
+      }
+
+      std::set<std::size_t> &body = bodies[h];
+      body.insert(h);
+      std::vector<std::size_t> work;
+      if (body.insert(b).second) {
+        work.push_back(b);
+      }
+      while (!work.empty()) {
+        std::size_t x = work.back();
+        work.pop_back();
+        for (std::size_t p : blocks[x].preds) {
+          if (body.insert(p).second) {
+            work.push_back(p);
+          }
+        }
+      }
+    }
+  }
+
+  for (const auto &entry : bodies) {
+    Loop loop{entry.first, kNone, 1,
+              std::vector<std::size_t>(entry.second.begin(),
+                                       entry.second.end()),
+              0};
+    for (std::size_t b : loop.blocks) {
+      loop.instructions += blocks[b].instructions;
+    }
+    loops.push_back(std::move(loop));
+  }
+
+  // Natural loops with different headers are disjoint or nested, so the
+  // smallest other loop holding a header encloses its loop
+  auto contains = [](const Loop &outer, std::size_t b) {
+    return std::binary_search(outer.blocks.begin(), outer.blocks.end(), b);
+  };
+  for (std::size_t i = 0; i < loops.size(); ++i) {
+    for (std::size_t j = 0; j < loops.size(); ++j) {
+      if (i != j && contains(loops[j], loops[i].header) &&
+          (loops[i].parent == kNone ||
+           loops[j].blocks.size() < loops[loops[i].parent].blocks.size())) {
+        loops[i].parent = j;
+      }
+    }
+  }
+  for (Loop &loop : loops) {
+    for (std::size_t p = loop.parent; p != kNone; p = loops[p].parent) {
+      ++loop.depth;
+    }
+  }
+  for (std::size_t i = 0; i < loops.size(); ++i) {
+    for (std::size_t b : loops[i].blocks) {
+      std::size_t inner = blocks[b].loop;
+      if (inner == kNone ||
+          loops[i].blocks.size() < loops[inner].blocks.size()) {
+        blocks[b].loop = i;
+      }
+    }
+  }
+}
+
+std::size_t Cfg::findBlock(std::uint64_t addr) const {
+  auto iter = std::lower_bound(
+      blocks.begin(), blocks.end(), addr,
+      [](const Block &b, std::uint64_t a) { return b.start < a; });
+  if (iter == blocks.end() || iter->start != addr) {
+    return kNone;
+  }
+  return iter - blocks.begin();
+}
+
+const Machine::DecodedInst *Cfg::findInstruction(std::uint64_t addr) const {
+  auto iter = insts.find(addr);
+  return iter != insts.end() ? &iter->second : nullptr;
+}
+
+bool Cfg::dominates(std::size_t a, std::size_t b) const {
+  for (std::size_t x = b; x != kNone; x = blocks[x].idom) {
+    if (x == a) {
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace y64
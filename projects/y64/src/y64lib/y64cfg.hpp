@@ -0,0 +1,100 @@
+#ifndef Y64_LIB_Y64_CFG_HPP
+#define Y64_LIB_Y64_CFG_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "y64machine.hpp"
+
+namespace y64 {
+
+// Static control-flow graph of a program image. The instructions reachable
+// from the entry are decoded by following fall-through, jumps and calls
+// without running anything, and split into basic blocks ending at jXX,
+// call, ret or halt, or where another block starts. Edges stay inside a
+// function: a call continues at its return address and its target starts
+// another function, ret and halt have no successors. Dominators and the
+// natural loops are computed over the blocks of all functions at once;
+// loops without a dominating header (irreducible ones) are not reported.
+class Cfg {
+public:
+  static const std::size_t kNone = SIZE_MAX;
+
+  struct Block {
+    std::uint64_t start;
+    std::uint64_t end; // address after the last instruction
+    std::uint64_t instructions;
+    std::vector<std::size_t> succs; // ascending block indices
+    std::vector<std::size_t> preds;
+    std::size_t idom; // immediate dominator, kNone for function entries
+    std::size_t loop; // innermost loop containing the block, or kNone
+    bool faults;      // can reach bytes that raise ADR or INS
+  };
+
+  struct Function {
+    std::uint64_t entry;
+    std::vector<std::size_t> blocks; // reachable from the entry, ascending
+    std::uint64_t instructions;
+  };
+
+  // How fetching from an address control reaches fails
+  struct Fault {
+    Machine::Stat stat;  // ADR or INS
+    std::uint64_t value; // as Machine::getFaultValue() reports it
+  };
+
+  struct Loop {
+    std::size_t header;
+    std::size_t parent; // innermost enclosing loop, or kNone
+    std::size_t depth;  // 1 for loops no other loop contains
+    std::vector<std::size_t> blocks; // ascending, header included
+    std::uint64_t instructions;
+  };
+
+  // Graph of the image starting at its PC, which Machine::load() leaves at
+  // 0, typically taken with Machine::snapshot() right after loading
+  explicit Cfg(const Machine::Snapshot &image);
+
+  // Blocks in address order
+  const std::vector<Block> &getBlocks() const { return blocks; }
+  // The entry first, then call targets in the order they were found
+  const std::vector<Function> &getFunctions() const { return functions; }
+  // Ordered by the address of the header
+  const std::vector<Loop> &getLoops() const { return loops; }
+
+  // Block starting at addr, or kNone
+  std::size_t findBlock(std::uint64_t addr) const;
+  // Instruction decoded at addr, or nullptr
+  const Machine::DecodedInst *findInstruction(std::uint64_t addr) const;
+  // Addresses control can reach that do not hold a valid instruction
+  const std::map<std::uint64_t, Fault> &getFaults() const { return faults; }
+  // Whether block a dominates block b, every block dominates itself
+  bool dominates(std::size_t a, std::size_t b) const;
+  std::uint64_t getInstructions() const { return instructions; }
+
+private:
+  void discover(const Memory &mem, std::uint64_t entry);
+  void buildBlocks();
+  void buildFunctions();
+  void computeDominators();
+  void findLoops();
+
+private:
+  std::map<std::uint64_t, Machine::DecodedInst> insts;
+  std::map<std::uint64_t, Fault> faults;
+  // Addresses blocks start at, only needed while building
+  std::set<std::uint64_t> leaders;
+  std::vector<std::uint64_t> entries;
+
+  std::vector<Block> blocks;
+  std::vector<Function> functions;
+  std::vector<Loop> loops;
+  std::uint64_t instructions;
+};
+
+} // namespace y64
+
+#endif // !Y64_LIB_Y64_CFG_HPP
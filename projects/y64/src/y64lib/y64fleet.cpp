@@ -0,0 +1,130 @@
+#include "y64fleet.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace y64 {
+
+namespace {
+
+// Instance indices of one worker. The owner takes from the front and
+// thieves from the back, so they only meet on the last items.
+class WorkQueue {
+public:
+  WorkQueue() : lock(), items() {}
+
+  void push(std::size_t i) {
+    std::lock_guard<std::mutex> guard{lock};
+    items.push_back(i);
+  }
+
+  bool pop(std::size_t &i) {
+    std::lock_guard<std::mutex> guard{lock};
+    if (items.empty()) {
+      return false;
+    }
+    i = items.front();
+    items.pop_front();
+    return true;
+  }
+
+  bool steal(std::size_t &i) {
+    std::lock_guard<std::mutex> guard{lock};
+    if (items.empty()) {
+      return false;
+    }
+    i = items.back();
+    items.pop_back();
+    return true;
+  }
+
+private:
+  std::mutex lock;
+  std::deque<std::size_t> items;
+};
+
+// No instance is ever added once the workers start, so a worker that
+// finds every queue empty is done
+bool stealWork(std::vector<WorkQueue> &queues, std::size_t self,
+               std::size_t &i) {
+  for (std::size_t k = 1; k < queues.size(); ++k) {
+    if (queues[(self + k) % queues.size()].steal(i)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace
+
+std::vector<Fleet::Result> Fleet::run(const std::vector<Seed> &seeds,
+                                      const Options &opts) const {
+  std::vector<Result> results(seeds.size());
+  if (seeds.empty()) {
+    return results;
+  }
+
+  std::size_t jobs = opts.jobs;
+  if (jobs == 0) {
+    jobs = std::max(1u, std::thread::hardware_concurrency());
+  }
+  jobs = std::min(jobs, seeds.size());
+
+  // Contiguous chunks, so that a worker mostly runs neighbouring seeds
+  std::vector<WorkQueue> queues(jobs);
+  for (std::size_t i = 0; i < seeds.size(); ++i) {
+    queues[i * jobs / seeds.size()].push(i);
+  }
+
+  // One machine per worker. Restoring the image into it again only reverts
+  // the pages the previous instance wrote, and keeps its decoded code.
+  auto work = [&](std::size_t self) {
+    Machine m{image.memory->size(), opts.backing};
+    m.setEngine(opts.engine);
+    std::size_t i = 0;
+    while (queues[self].pop(i) || stealWork(queues, self, i)) {
+      results[i] = runOne(m, seeds[i], opts.maxSteps);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (std::size_t w = 1; w < jobs; ++w) {
+    threads.emplace_back(work, w);
+  }
+  work(0);
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  return results;
+}
+
+Fleet::Result Fleet::runOne(Machine &m, const Seed &seed,
+                            std::uint64_t maxSteps) const {
+  Result res{};
+  m.restore(image);
+  for (const auto &reg : seed.regs) {
+    m.setReg(reg.first, reg.second);
+  }
+  for (const auto &quad : seed.quads) {
+    if (!m.setMemQuad(quad.first, quad.second)) {
+      res.stat = Machine::Stat::ADR;
+      res.pc = m.getPC();
+      res.faultValue = quad.first;
+      return res;
+    }
+  }
+
+  m.tryRun(maxSteps);
+  res.stat = m.getStat();
+  res.pc = m.getPC();
+  res.steps = m.getSteps() - image.steps;
+  res.faultValue = m.getFaultValue();
+  for (std::size_t id = 0; id < Machine::kNumGeneralRegs; ++id) {
+    res.regs[id] = m.getReg(id);
+  }
+  return res;
+}
+
+} // namespace y64
@@ -0,0 +1,60 @@
+#ifndef Y64_LIB_Y64_FLEET_HPP
+#define Y64_LIB_Y64_FLEET_HPP
+
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "y64machine.hpp"
+
+namespace y64 {
+
+// Many independent machines started from one loaded image and run on a
+// pool of threads. Every instance restores the image snapshot, so all of
+// them share the code and untouched data pages and only copy the pages
+// they write. Workers take instances from their own queue and steal from
+// the others when it runs dry.
+class Fleet {
+public:
+  // What one instance changes in the image before it runs
+  struct Seed {
+    // (register id, value), ids below Machine::kNumGeneralRegs
+    std::vector<std::pair<std::uint8_t, std::int64_t>> regs;
+    // (address, value) quads stored to memory
+    std::vector<std::pair<std::uint64_t, std::int64_t>> quads;
+  };
+
+  struct Result {
+    Machine::Stat stat;
+    std::uint64_t pc;
+    std::uint64_t steps; // executed by the instance, not counting the image
+    std::uint64_t faultValue;
+    std::array<std::int64_t, Machine::kNumGeneralRegs> regs;
+  };
+
+  struct Options {
+    unsigned jobs; // worker threads, 0 for one per hardware thread
+    Machine::Engine engine;
+    std::uint64_t maxSteps; // per instance
+    Memory::Backing backing;
+  };
+
+  // `image` is typically taken right after Machine::load()
+  explicit Fleet(const Machine::Snapshot &image) : image(image) {}
+
+  // Run one instance per seed, results are in the order of `seeds`. A seed
+  // storing outside memory gives an ADR result without running.
+  std::vector<Result> run(const std::vector<Seed> &seeds,
+                          const Options &opts) const;
+
+private:
+  Result runOne(Machine &m, const Seed &seed, std::uint64_t maxSteps) const;
+
+private:
+  Machine::Snapshot image;
+};
+
+} // namespace y64
+
+#endif // !Y64_LIB_Y64_FLEET_HPP
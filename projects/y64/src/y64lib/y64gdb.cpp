@@ -0,0 +1,680 @@
+#include "y64gdb.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "register.hpp"
+#include "util.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define Y64_HAS_SOCKETS 1
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#else
+#define Y64_HAS_SOCKETS 0
+#endif
+
+namespace y64 {
+
+namespace {
+
+const char kHexDigits[] = "0123456789abcdef";
+
+// amd64 register numbers of gdb
+const std::size_t kGdbGeneralRegs = 16;
+const std::size_t kGdbRip = 16;
+const std::size_t kGdbEflags = 17;
+const std::size_t kGdbSegmentRegs = 6; // cs, ss, ds, es, fs, gs
+const std::size_t kGdbRegs = kGdbEflags + 1 + kGdbSegmentRegs;
+
+// Y86-64 register at each of gdb's rax, rbx, rcx, rdx, rsi, rdi, rbp, rsp,
+// r8 to r15, Register::none for %r15
+const std::uint8_t kGdbGeneralToY64[kGdbGeneralRegs] = {
+    Register::rax, Register::rbx, Register::rcx, Register::rdx,
+    Register::rsi, Register::rdi, Register::rbp, Register::rsp,
+    Register::r8,  Register::r9,  Register::r10, Register::r11,
+    Register::r12, Register::r13, Register::r14, Register::none,
+};
+
+// eflags bits
+const std::uint64_t kZeroBit = 6;
+const std::uint64_t kSignBit = 7;
+const std::uint64_t kOverflowBit = 11;
+
+// Largest `m` reply, twice as many hex digits
+const std::uint64_t kMaxReadBytes = 0x10000;
+
+// Signals in stop replies
+const int kSigInt = 2;
+const int kSigIll = 4;
+const int kSigTrap = 5;
+const int kSigSegv = 11;
+
+// Register values are 8 bytes, eflags and the segment registers 4
+std::size_t gdbRegSize(std::size_t n) { return n < kGdbEflags ? 8 : 4; }
+
+int hexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+void appendHexByte(std::string &out, std::uint8_t byte) {
+  out += kHexDigits[byte >> 4];
+  out += kHexDigits[byte & 0xF];
+}
+
+// Big-endian digits of value without leading zeros
+void appendHexNumber(std::string &out, std::uint64_t value) {
+  int shift = 60;
+  while (shift > 0 && (value >> shift) == 0) {
+    shift -= 4;
+  }
+  for (; shift >= 0; shift -= 4) {
+    out += kHexDigits[(value >> shift) & 0xF];
+  }
+}
+
+// `size` bytes of value in target (little-endian) order
+void appendHexValue(std::string &out, std::uint64_t value, std::size_t size) {
+  for (std::size_t i = 0; i < size; ++i) {
+    appendHexByte(out, static_cast<std::uint8_t>(value >> (8 * i)));
+  }
+}
+
+// Bytes of the hex string `hex`, false if it is malformed
+bool parseHexBytes(const std::string &hex, std::vector<std::uint8_t> &bytes) {
+  if (hex.size() % 2 != 0) {
+    return false;
+  }
+  bytes.resize(hex.size() / 2);
+  for (std::size_t i = 0; i < bytes.size(); ++i) {
+    int hi = hexValue(hex[2 * i]);
+    int lo = hexValue(hex[2 * i + 1]);
+    if (hi < 0 || lo < 0) {
+      return false;
+    }
+    bytes[i] = static_cast<std::uint8_t>(hi << 4 | lo);
+  }
+  return true;
+}
+
+std::uint64_t littleEndianValue(const std::uint8_t *bytes, std::size_t size) {
+  std::uint64_t value = 0;
+  for (std::size_t i = 0; i < size; ++i) {
+    value |= static_cast<std::uint64_t>(bytes[i]) << (8 * i);
+  }
+  return value;
+}
+
+// Parse the hex number at `pos` of `s` up to the next character that is not
+// a hex digit, which `pos` is left at. False if there is no digit.
+bool parseHexNumber(const std::string &s, std::size_t &pos,
+                    std::uint64_t &value) {
+  std::size_t start = pos;
+  value = 0;
+  for (; pos < s.size() && hexValue(s[pos]) >= 0; ++pos) {
+    value = value << 4 | static_cast<std::uint64_t>(hexValue(s[pos]));
+  }
+  return pos > start;
+}
+
+// "addr,len" followed by `end` or the end of `s`
+bool parseAddrLen(const std::string &s, std::size_t &pos, std::uint64_t &addr,
+                  std::uint64_t &len, char end) {
+  if (!parseHexNumber(s, pos, addr) || pos >= s.size() || s[pos] != ',') {
+    return false;
+  }
+  ++pos;
+  if (!parseHexNumber(s, pos, len)) {
+    return false;
+  }
+  return pos == s.size() ? end == '\0' : s[pos] == end;
+}
+
+std::string signalReply(int signal) {
+  std::string reply = "S";
+  appendHexByte(reply, static_cast<std::uint8_t>(signal));
+  return reply;
+}
+
+bool startsWith(const std::string &s, const char *prefix) {
+  return s.compare(0, std::strlen(prefix), prefix) == 0;
+}
+
+} // namespace
+
+GdbStub::GdbStub(Machine &m)
+    : machine(m), listenFd(-1), connFd(-1), unixPath(), noAck(false),
+      interruptPending(false), input(), lastPacket() {}
+
+GdbStub::~GdbStub() {
+#if Y64_HAS_SOCKETS
+  if (connFd >= 0) {
+    close(connFd);
+  }
+  if (listenFd >= 0) {
+    close(listenFd);
+  }
+  if (!unixPath.empty()) {
+    unlink(unixPath.c_str());
+  }
+#endif
+}
+
+bool GdbStub::listen(const std::string &address) {
+#if Y64_HAS_SOCKETS
+  bool tcp = !address.empty() &&
+             std::all_of(address.begin(), address.end(),
+                         [](char c) { return c >= '0' && c <= '9'; });
+  if (tcp) {
+    unsigned long port = std::strtoul(address.c_str(), nullptr, 10);
+    if (port > 0xFFFF) {
+      return false;
+    }
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+      return false;
+    }
+    int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<std::uint16_t>(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) <
+        0) {
+      return false;
+    }
+  } else {
+    sockaddr_un addr{};
+    if (address.empty() || address.size() >= sizeof(addr.sun_path)) {
+      return false;
+    }
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+      return false;
+    }
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, address.c_str(), address.size() + 1);
+    if (bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) <
+        0) {
+      return false;
+    }
+    unixPath = address;
+  }
+  return ::listen(listenFd, 1) == 0;
+#else
+  (void)address;
+  return false;
+#endif
+}
+
+bool GdbStub::serve() {
+#if Y64_HAS_SOCKETS
+  connFd = accept(listenFd, nullptr, nullptr);
+  if (connFd < 0) {
+    return false;
+  }
+  if (unixPath.empty()) {
+    int one = 1;
+    setsockopt(connFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+
+  noAck = false;
+  interruptPending = false;
+  input.clear();
+  bool done = false;
+  std::string packet;
+  while (!done && readPacket(packet)) {
+    std::string reply = handle(packet, done);
+    // A killed session ends without a reply
+    if (!(done && packet == "k") && !sendPacket(reply)) {
+      break;
+    }
+  }
+
+  close(connFd);
+  connFd = -1;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool GdbStub::receive(bool block) {
+#if Y64_HAS_SOCKETS
+  char buf[4096];
+  ssize_t n = recv(connFd, buf, sizeof(buf), block ? 0 : MSG_DONTWAIT);
+  if (n > 0) {
+    input.append(buf, static_cast<std::size_t>(n));
+    return true;
+  }
+  // Nothing to read yet is not a hang-up
+  return n < 0 && !block && (errno == EAGAIN || errno == EWOULDBLOCK);
+#else
+  (void)block;
+  return false;
+#endif
+}
+
+bool GdbStub::readPacket(std::string &packet) {
+  while (true) {
+    std::size_t start = input.find('$');
+    // Acks, and a Ctrl-C while stopped, are noise outside a packet. A '-'
+    // asks for the last packet again.
+    std::size_t skipped = start == std::string::npos ? input.size() : start;
+    if (input.find('-') < skipped && !sendRaw(lastPacket)) {
+      return false;
+    }
+    input.erase(0, skipped);
+
+    std::size_t hash = input.find('#');
+    if (hash != std::string::npos && hash + 2 < input.size()) {
+      std::string body = input.substr(1, hash - 1);
+      int hi = hexValue(input[hash + 1]);
+      int lo = hexValue(input[hash + 2]);
+      input.erase(0, hash + 3);
+
+      std::uint8_t sum = 0;
+      for (char c : body) {
+        sum = static_cast<std::uint8_t>(sum + static_cast<std::uint8_t>(c));
+      }
+      if (!noAck && (hi < 0 || lo < 0 || sum != (hi << 4 | lo))) {
+        if (!sendRaw("-")) {
+          return false;
+        }
+        continue;
+      }
+      if (!noAck && !sendRaw("+")) {
+        return false;
+      }
+      packet = std::move(body);
+      return true;
+    }
+
+    if (!receive(true)) {
+      return false;
+    }
+  }
+}
+
+bool GdbStub::sendPacket(const std::string &data) {
+  std::uint8_t sum = 0;
+  for (char c : data) {
+    sum = static_cast<std::uint8_t>(sum + static_cast<std::uint8_t>(c));
+  }
+  lastPacket = "$" + data + "#";
+  appendHexByte(lastPacket, sum);
+  return sendRaw(lastPacket);
+}
+
+bool GdbStub::sendRaw(const std::string &bytes) {
+#if Y64_HAS_SOCKETS
+#ifdef MSG_NOSIGNAL
+  const int flags = MSG_NOSIGNAL;
+#else
+  const int flags = 0;
+#endif
+  std::size_t sent = 0;
+  while (sent < bytes.size()) {
+    ssize_t n = send(connFd, bytes.data() + sent, bytes.size() - sent, flags);
+    if (n <= 0) {
+      return false;
+    }
+    sent += static_cast<std::size_t>(n);
+  }
+  return true;
+#else
+  (void)bytes;
+  return false;
+#endif
+}
+
+bool GdbStub::interrupted() {
+  if (!interruptPending) {
+    // A hang-up stops the run too, readPacket() notices it afterwards
+    if (!receive(false)) {
+      return true;
+    }
+    std::size_t at = input.find('\x03');
+    if (at != std::string::npos) {
+      input.erase(at, 1);
+      interruptPending = true;
+    }
+  }
+  return interruptPending;
+}
+
+std::string GdbStub::handle(const std::string &packet, bool &done) {
+  if (packet.empty()) {
+    return "";
+  }
+
+  std::string args = packet.substr(1);
+  switch (packet[0]) {
+  case '?':
+    return stopReply();
+  case 'g':
+    return readRegisters();
+  case 'G':
+    return writeRegisters(args);
+  case 'p':
+    return readRegister(args);
+  case 'P':
+    return writeRegister(args);
+  case 'm':
+    return readMemory(args);
+  case 'M':
+    return writeMemory(args);
+  case 'c':
+    return resume(args, false);
+  case 's':
+    return resume(args, true);
+  case 'Z':
+    return changePoint(args, true);
+  case 'z':
+    return changePoint(args, false);
+  case 'H':
+    Y64_FALLTHROUGH;
+  case 'T':
+    // One thread, always alive and selected
+    return "OK";
+  case 'D':
+    done = true;
+    return "OK";
+  case 'k':
+    done = true;
+    return "";
+  default:
+    break;
+  }
+
+  if (startsWith(packet, "qSupported")) {
+    return "PacketSize=4000;QStartNoAckMode+";
+  }
+  if (packet == "QStartNoAckMode") {
+    // The OK is still acknowledged, later packets are not
+    noAck = true;
+    return "OK";
+  }
+  if (packet == "qAttached") {
+    return "1";
+  }
+  if (packet == "qC") {
+    return "QC1";
+  }
+  if (packet == "qfThreadInfo") {
+    return "m1";
+  }
+  if (packet == "qsThreadInfo") {
+    return "l";
+  }
+  if (startsWith(packet, "vKill")) {
+    done = true;
+    return "OK";
+  }
+  // Unsupported, gdb falls back to the packets above
+  return "";
+}
+
+std::string GdbStub::stopReply() const {
+  switch (machine.getStat()) {
+  case Machine::Stat::HLT:
+    return "W00";
+  case Machine::Stat::ADR:
+    return signalReply(kSigSegv);
+  case Machine::Stat::INS:
+    return signalReply(kSigIll);
+  case Machine::Stat::TRP:
+    break;
+  default:
+    return signalReply(kSigTrap);
+  }
+
+  Machine::Watch access = machine.getTrapAccess();
+  if (access == Machine::Watch::None) {
+    return signalReply(kSigTrap);
+  }
+
+  // gdb looks the address up among its watchpoints, so report one inside
+  // the watchpoint that stopped the access rather than the quad's own
+  std::uint64_t addr = machine.getFaultValue();
+  const char *kind = access == Machine::Watch::Read ? "rwatch" : "watch";
+  for (const Machine::Watchpoint &w : machine.getWatchpoints()) {
+    if ((static_cast<std::uint8_t>(w.kind) &
+         static_cast<std::uint8_t>(access)) != 0 &&
+        addr < w.addr + w.len && w.addr < addr + sizeof(std::int64_t)) {
+      addr = std::max(addr, w.addr);
+      if (w.kind == Machine::Watch::Access) {
+        kind = "awatch";
+      }
+      break;
+    }
+  }
+
+  std::string reply = "T";
+  appendHexByte(reply, kSigTrap);
+  reply += kind;
+  reply += ':';
+  appendHexNumber(reply, addr);
+  reply += ';';
+  return reply;
+}
+
+std::uint64_t GdbStub::getGdbReg(std::size_t n) const {
+  if (n < kGdbGeneralRegs) {
+    std::uint8_t id = kGdbGeneralToY64[n];
+    return id == Register::none
+               ? 0
+               : static_cast<std::uint64_t>(machine.getReg(id));
+  }
+  if (n == kGdbRip) {
+    return machine.getPC();
+  }
+  if (n == kGdbEflags) {
+    std::uint8_t zf, sf, of;
+    machine.getFlags(zf, sf, of);
+    return static_cast<std::uint64_t>(zf) << kZeroBit |
+           static_cast<std::uint64_t>(sf) << kSignBit |
+           static_cast<std::uint64_t>(of) << kOverflowBit;
+  }
+  return 0;
+}
+
+void GdbStub::setGdbReg(std::size_t n, std::uint64_t value) {
+  if (n < kGdbGeneralRegs) {
+    std::uint8_t id = kGdbGeneralToY64[n];
+    if (id != Register::none) {
+      machine.setReg(id, static_cast<std::int64_t>(value));
+    }
+  } else if (n == kGdbRip) {
+    machine.setPC(value);
+  } else if (n == kGdbEflags) {
+    machine.setConditionCodes((value >> kZeroBit) & 1, (value >> kSignBit) & 1,
+                              (value >> kOverflowBit) & 1);
+  }
+}
+
+std::string GdbStub::readRegisters() const {
+  std::string reply;
+  for (std::size_t n = 0; n < kGdbRegs; ++n) {
+    appendHexValue(reply, getGdbReg(n), gdbRegSize(n));
+  }
+  return reply;
+}
+
+std::string GdbStub::writeRegisters(const std::string &hex) {
+  std::vector<std::uint8_t> bytes;
+  if (!parseHexBytes(hex, bytes)) {
+    return "E01";
+  }
+  // gdb may send more registers than ours, or fewer
+  std::size_t offset = 0;
+  for (std::size_t n = 0; n < kGdbRegs; ++n) {
+    std::size_t size = gdbRegSize(n);
+    if (offset + size > bytes.size()) {
+      break;
+    }
+    setGdbReg(n, littleEndianValue(bytes.data() + offset, size));
+    offset += size;
+  }
+  return "OK";
+}
+
+std::string GdbStub::readRegister(const std::string &args) const {
+  std::size_t pos = 0;
+  std::uint64_t n = 0;
+  if (!parseHexNumber(args, pos, n) || pos != args.size()) {
+    return "E01";
+  }
+  // Registers beyond ours, such as the x87 and SSE ones, are unavailable
+  if (n >= kGdbRegs) {
+    return "E01";
+  }
+  std::string reply;
+  appendHexValue(reply, getGdbReg(n), gdbRegSize(n));
+  return reply;
+}
+
+std::string GdbStub::writeRegister(const std::string &args) {
+  std::size_t pos = 0;
+  std::uint64_t n = 0;
+  std::vector<std::uint8_t> bytes;
+  if (!parseHexNumber(args, pos, n) || pos >= args.size() ||
+      args[pos] != '=' || !parseHexBytes(args.substr(pos + 1), bytes)) {
+    return "E01";
+  }
+  if (n < kGdbRegs) {
+    setGdbReg(n, littleEndianValue(bytes.data(),
+                                   std::min(bytes.size(), gdbRegSize(n))));
+  }
+  return "OK";
+}
+
+std::string GdbStub::readMemory(const std::string &args) const {
+  std::size_t pos = 0;
+  std::uint64_t addr = 0;
+  std::uint64_t len = 0;
+  if (!parseAddrLen(args, pos, addr, len, '\0')) {
+    return "E01";
+  }
+
+  // Stop at the end of memory, gdb takes the part it gets
+  const Memory &mem = machine.getMemory();
+  if (addr >= mem.size()) {
+    return "E01";
+  }
+  len = std::min({len, mem.size() - addr, kMaxReadBytes});
+  // One bulk read, a page at a time inside Memory
+  std::vector<std::uint8_t> bytes(len);
+  mem.read(addr, bytes.data(), len);
+
+  std::string reply;
+  reply.reserve(2 * len);
+  for (std::uint8_t byte : bytes) {
+    appendHexByte(reply, byte);
+  }
+  return reply;
+}
+
+std::string GdbStub::writeMemory(const std::string &args) {
+  std::size_t pos = 0;
+  std::uint64_t addr = 0;
+  std::uint64_t len = 0;
+  std::vector<std::uint8_t> bytes;
+  if (!parseAddrLen(args, pos, addr, len, ':') ||
+      !parseHexBytes(args.substr(pos + 1), bytes) || bytes.size() != len) {
+    return "E01";
+  }
+  return machine.setMemBytes(addr, bytes.data(), len) ? "OK" : "E01";
+}
+
+std::string GdbStub::resume(const std::string &args, bool step) {
+  std::size_t pos = 0;
+  std::uint64_t addr = 0;
+  if (parseHexNumber(args, pos, addr)) {
+    machine.setPC(addr);
+  }
+
+  // The first instruction moves past the breakpoint or watchpoint the
+  // machine may be stopped at, as gdb expects
+  interruptPending = false;
+  if (!machine.tryStepOver() || step) {
+    return stopReply();
+  }
+  while (machine.isOk()) {
+    if (interrupted()) {
+      interruptPending = false;
+      return signalReply(kSigInt);
+    }
+    machine.tryRun(kRunChunk);
+  }
+  return stopReply();
+}
+
+std::string GdbStub::changePoint(const std::string &args, bool insert) {
+  // type,addr,kind where kind is the length of a watchpoint
+  std::size_t pos = 0;
+  std::uint64_t type = 0;
+  std::uint64_t addr = 0;
+  std::uint64_t kind = 0;
+  if (!parseHexNumber(args, pos, type) || pos >= args.size() ||
+      args[pos] != ',') {
+    return "E01";
+  }
+  ++pos;
+  // Conditions and commands after ';' are not supported
+  std::string rest = args.substr(pos, args.find(';', pos) - pos);
+  pos = 0;
+  if (!parseAddrLen(rest, pos, addr, kind, '\0')) {
+    return "E01";
+  }
+
+  Machine::Watch access = Machine::Watch::None;
+  switch (type) {
+  case 0:
+    Y64_FALLTHROUGH;
+  case 1:
+    // Software and hardware breakpoints are the same here
+    if (insert) {
+      machine.setBreakpoint(addr);
+    } else {
+      machine.clearBreakpoint(addr);
+    }
+    return "OK";
+  case 2:
+    access = Machine::Watch::Write;
+    break;
+  case 3:
+    access = Machine::Watch::Read;
+    break;
+  case 4:
+    access = Machine::Watch::Access;
+    break;
+  default:
+    return "";
+  }
+
+  if (insert) {
+    return machine.setWatchpoint(addr, kind, access) ? "OK" : "E01";
+  }
+  machine.clearWatchpoint(addr, kind, access);
+  return "OK";
+}
+
+} // namespace y64
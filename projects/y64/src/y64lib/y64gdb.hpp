@@ -0,0 +1,82 @@
+#ifndef Y64_LIB_Y64_GDB_HPP
+#define Y64_LIB_Y64_GDB_HPP
+
+#include <cstdint>
+#include <string>
+
+#include "y64machine.hpp"
+
+namespace y64 {
+
+// Serves the GDB remote serial protocol for a Machine, one debugger at a
+// time. Registers are sent in the x86-64 layout gdb assumes without a
+// target description: the Y86-64 registers at their amd64 places, %r15
+// zero, %rip the PC and ZF, SF and OF at their eflags bits, so that
+// `target remote` from any x86-64 gdb works. Handled packets are
+//
+//   ?  g G p P  m M  c s  Z0-Z4 z0-z4  qSupported QStartNoAckMode  D k
+//
+// plus the thread queries gdb sends on attach. Breakpoints and watchpoints
+// are the machine's own, see Machine::setBreakpoint(), and continuing runs
+// on the machine's engine until one stops it or gdb sends Ctrl-C.
+class GdbStub {
+public:
+  explicit GdbStub(Machine &m);
+  // Closes the sockets and removes a Unix socket file
+  ~GdbStub();
+  GdbStub(const GdbStub &) = delete;
+  GdbStub &operator=(const GdbStub &) = delete;
+
+  // Listen on a TCP port of localhost when `address` is a number, on the
+  // Unix socket at that path otherwise. False if it can not be set up or
+  // the platform has no sockets.
+  bool listen(const std::string &address);
+
+  // Wait for a debugger and serve it until it detaches, kills the program
+  // or hangs up, false if no connection could be accepted
+  bool serve();
+
+private:
+  // Next packet from the debugger without its framing, acknowledged
+  // unless QStartNoAckMode was agreed, false once it hangs up
+  bool readPacket(std::string &packet);
+  bool sendPacket(const std::string &data);
+  bool sendRaw(const std::string &bytes);
+  // Read what the debugger sent into `input`, waiting for it if `block`,
+  // false once it hangs up
+  bool receive(bool block);
+  // Whether Ctrl-C arrived while the machine was running
+  bool interrupted();
+
+  // Reply to `packet`, setting `done` when the session ends
+  std::string handle(const std::string &packet, bool &done);
+  std::string stopReply() const;
+  std::string readRegisters() const;
+  std::string writeRegisters(const std::string &hex);
+  std::string readRegister(const std::string &args) const;
+  std::string writeRegister(const std::string &args);
+  std::string readMemory(const std::string &args) const;
+  std::string writeMemory(const std::string &args);
+  std::string resume(const std::string &args, bool step);
+  std::string changePoint(const std::string &args, bool insert);
+
+  std::uint64_t getGdbReg(std::size_t n) const;
+  void setGdbReg(std::size_t n, std::uint64_t value);
+
+private:
+  // Instructions run between two checks for Ctrl-C
+  static const std::uint64_t kRunChunk = std::uint64_t{1} << 20;
+
+  Machine &machine;
+  int listenFd;
+  int connFd;
+  std::string unixPath; // removed when the stub goes away
+  bool noAck;
+  bool interruptPending;
+  std::string input; // received bytes not parsed yet
+  std::string lastPacket; // resent when the debugger asks with '-'
+};
+
+} // namespace y64
+
+#endif // !Y64_LIB_Y64_GDB_HPP
@@ -0,0 +1,111 @@
+#include "y64history.hpp"
+
+#include <algorithm>
+
+#include "util.hpp"
+
+namespace y64 {
+
+History::History(Machine &m, std::uint64_t interval)
+    : machine(m), interval(std::max<std::uint64_t>(interval, 1)),
+      start(m.getSteps()), checkpoints() {
+  checkpoints.push_back(machine.snapshot());
+}
+
+std::uint64_t History::forward(std::uint64_t n) {
+  std::uint64_t done = 0;
+  while (done < n) {
+    std::uint64_t pos = machine.getSteps() - start;
+    std::uint64_t ran = 0;
+    if (done == 0) {
+      // Move on from the breakpoint or watchpoint the machine stopped at
+      ran = machine.tryStepOver() ? 1 : 0;
+    } else if (machine.isOk()) {
+      std::uint64_t room = interval - pos % interval;
+      ran = machine.tryRun(std::min(n - done, room));
+    }
+    done += ran;
+    pos += ran;
+    // A halted or faulted machine never runs past its last checkpoint, a
+    // trapped one is snapshotted as running
+    if (pos % interval == 0 && pos / interval == checkpoints.size() &&
+        (machine.isOk() || machine.getStat() == Machine::Stat::TRP)) {
+      checkpoints.push_back(machine.snapshot());
+    }
+    if (ran == 0) {
+      break;
+    }
+  }
+  return done;
+}
+
+std::uint64_t History::back(std::uint64_t n) {
+  std::uint64_t now = machine.getSteps();
+  std::uint64_t target = now - std::min(n, now - start);
+  if (target != now) {
+    seek(target);
+  }
+  return now - target;
+}
+
+bool History::backToWrite(std::uint64_t addr) {
+  std::uint64_t now = machine.getSteps();
+  if (now == start) {
+    return false;
+  }
+
+  // Replay the checkpoint intervals from the latest back, the last write
+  // in the first one that has any is the one
+  Machine::Snapshot here = machine.snapshot();
+  bool wasTrapping = machine.isTrapping();
+  machine.setTrapping(false);
+  DEFER { machine.setTrapping(wasTrapping); };
+  for (std::size_t k = (now - 1 - start) / interval;; --k) {
+    machine.restore(checkpoints[k]);
+    std::uint64_t end = std::min(now, start + (k + 1) * interval);
+    std::uint64_t found = UINT64_MAX;
+    while (machine.getSteps() < end) {
+      std::uint64_t at = machine.getSteps();
+      if (!machine.tryStep()) {
+        break;
+      }
+      switch (machine.inst.icode) {
+      case Instruction::icode_rmmovq:
+        Y64_FALLTHROUGH;
+      case Instruction::icode_pushq:
+        Y64_FALLTHROUGH;
+      case Instruction::icode_call:
+        if (addr - static_cast<std::uint64_t>(machine.valE) <
+            sizeof(std::int64_t)) {
+          found = at;
+        }
+        break;
+      default:
+        break;
+      }
+    }
+
+    if (found != UINT64_MAX) {
+      seek(found);
+      return true;
+    }
+    if (k == 0) {
+      machine.restore(here);
+      return false;
+    }
+  }
+}
+
+void History::seek(std::uint64_t target) {
+  // Breakpoints and watchpoints on the way were already passed
+  bool wasTrapping = machine.isTrapping();
+  machine.setTrapping(false);
+  DEFER { machine.setTrapping(wasTrapping); };
+
+  std::size_t k = std::min<std::uint64_t>((target - start) / interval,
+                                          checkpoints.size() - 1);
+  machine.restore(checkpoints[k]);
+  machine.tryRun(target - machine.getSteps());
+}
+
+} // namespace y64
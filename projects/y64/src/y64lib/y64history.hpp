@@ -0,0 +1,50 @@
+#ifndef Y64_LIB_Y64_HISTORY_HPP
+#define Y64_LIB_Y64_HISTORY_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "y64machine.hpp"
+
+namespace y64 {
+
+// Checkpoints of a Machine taken every `interval` instructions while it
+// runs forward, so that it can be moved back to any earlier step by
+// restoring the nearest checkpoint and executing forward again. Every
+// checkpoint is a Machine::Snapshot, which shares the pages not written
+// since the one before, so each costs its registers and dirty pages.
+class History {
+public:
+  static const std::uint64_t kDefaultInterval = 4096;
+
+  // Checkpoints `m` as it is now, the earliest step it can go back to
+  explicit History(Machine &m, std::uint64_t interval = kDefaultInterval);
+
+  // Execute up to n instructions, return how many were executed. Only a
+  // breakpoint or watchpoint past the first instruction stops them.
+  std::uint64_t forward(std::uint64_t n);
+  // Go back n instructions, no further than the first checkpoint, return
+  // how many steps back the machine went
+  std::uint64_t back(std::uint64_t n);
+  // Go back to right before the last instruction that wrote a byte at
+  // addr, false without moving if none did since the first checkpoint
+  bool backToWrite(std::uint64_t addr);
+
+  std::uint64_t getStart() const { return start; }
+  std::size_t getCheckpoints() const { return checkpoints.size(); }
+
+private:
+  // Restore the checkpoint at or before `target` and run up to it
+  void seek(std::uint64_t target);
+
+private:
+  Machine &machine;
+  std::uint64_t interval;
+  std::uint64_t start;
+  // checkpoints[i] is the machine at step start + i * interval
+  std::vector<Machine::Snapshot> checkpoints;
+};
+
+} // namespace y64
+
+#endif // !Y64_LIB_Y64_HISTORY_HPP
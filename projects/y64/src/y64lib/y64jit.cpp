@@ -0,0 +1,843 @@
+// Basic block translator from y86-64 to x86-64 for y64::Machine
+//
+// Translated code keeps the most used guest registers of a block in the
+// host callee-saved registers rbx, rbp, r12 and r13, the rest is accessed
+// through r15 which points at Machine::valueRegs. r14 holds the JitContext.
+// Memory accesses call back into Machine so that bounds checks, decoded
+// instruction invalidation and fault reporting stay in one place.
+//
+// ZF/SF/OF are taken from the host flags of the translated opq; they
+// are stored to the context only when the block may read them after the
+// host flags are clobbered or when they are live out of the block.
+
+#include "y64jit.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+
+#include "util.hpp"
+#include "y64machine.hpp"
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define Y64_HAS_JIT 1
+#include <sys/mman.h>
+#else
+#define Y64_HAS_JIT 0
+#endif
+
+namespace y64 {
+
+#if Y64_HAS_JIT
+
+namespace {
+
+enum HostReg : std::uint8_t {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSP = 4,
+  RBP = 5,
+  RSI = 6,
+  RDI = 7,
+  R12 = 12,
+  R13 = 13,
+  R14 = 14,
+  R15 = 15,
+  NOREG = 0xFF,
+};
+
+const HostReg kCtxReg = R14;
+const HostReg kRegsReg = R15;
+const HostReg kAllocatable[] = {RBX, RBP, R12, R13};
+
+const std::size_t kMaxBlockBytes = JitEngine::kMaxBlockInsts * kMaxInstLen;
+// Upper bound of the host code generated for one block
+const std::size_t kMaxBlockCode = 16 * 1024;
+
+const std::int32_t kStatusOffset = offsetof(JitContext, status);
+const std::int32_t kCountOffset = offsetof(JitContext, count);
+const std::int32_t kZeroFlagOffset = offsetof(JitContext, zeroFlag);
+const std::int32_t kSignedFlagOffset = offsetof(JitContext, signedFlag);
+const std::int32_t kOverflowFlagOffset = offsetof(JitContext, overflowFlag);
+
+// x86 condition codes
+enum HostCond : std::uint8_t {
+  CC_O = 0x0,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_S = 0x8,
+  CC_L = 0xC,
+  CC_GE = 0xD,
+  CC_LE = 0xE,
+  CC_G = 0xF,
+};
+
+HostCond hostCond(std::uint8_t ifun) {
+  switch (ifun) {
+  case Instruction::ifun_le:
+    return CC_LE;
+  case Instruction::ifun_l:
+    return CC_L;
+  case Instruction::ifun_e:
+    return CC_E;
+  case Instruction::ifun_ne:
+    return CC_NE;
+  case Instruction::ifun_ge:
+    return CC_GE;
+  case Instruction::ifun_g:
+    return CC_G;
+  default:
+    Y64_UNREACHABLE("Unknown condition");
+  }
+}
+
+// Minimal x86-64 encoder, only the forms used by the translator
+class Emitter {
+public:
+  explicit Emitter(std::uint8_t *buf) : begin(buf), cur(buf) {}
+
+  std::uint8_t *pos() const { return cur; }
+  std::size_t size() const { return cur - begin; }
+
+  void u8(std::uint8_t v) { *cur++ = v; }
+  void u32(std::uint32_t v) {
+    std::memcpy(cur, &v, sizeof(v));
+    cur += sizeof(v);
+  }
+  void u64(std::uint64_t v) {
+    std::memcpy(cur, &v, sizeof(v));
+    cur += sizeof(v);
+  }
+
+  // <op> reg, rm with both operands registers
+  void rr(std::uint8_t op, std::uint8_t reg, std::uint8_t rm) {
+    u8(0x48 | ((reg >> 3) << 2) | (rm >> 3));
+    u8(op);
+    u8(0xC0 | ((reg & 7) << 3) | (rm & 7));
+  }
+
+  // <op> reg, [base + disp]
+  void rm(std::uint8_t op, std::uint8_t reg, std::uint8_t base,
+          std::int32_t disp, bool wide = true) {
+    std::uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg >> 3) << 2) | (base >> 3);
+    if (rex != 0x40)
+      u8(rex);
+    u8(op);
+    mem(reg, base, disp);
+  }
+
+  void movRR(std::uint8_t dst, std::uint8_t src) { rr(0x8B, dst, src); }
+  void load(std::uint8_t dst, std::uint8_t base, std::int32_t disp) {
+    rm(0x8B, dst, base, disp);
+  }
+  void store(std::uint8_t base, std::int32_t disp, std::uint8_t src) {
+    rm(0x89, src, base, disp);
+  }
+
+  void movImm(std::uint8_t reg, std::uint64_t imm) {
+    u8(0x48 | (reg >> 3));
+    u8(0xB8 + (reg & 7));
+    u64(imm);
+  }
+
+  void addImm(std::uint8_t reg, std::int32_t imm) {
+    u8(0x48 | (reg >> 3));
+    u8(0x81);
+    u8(0xC0 | (reg & 7));
+    u32(static_cast<std::uint32_t>(imm));
+  }
+
+  void cmov(HostCond cc, std::uint8_t dst, std::uint8_t src) {
+    u8(0x48 | ((dst >> 3) << 2) | (src >> 3));
+    u8(0x0F);
+    u8(0x40 | cc);
+    u8(0xC0 | ((dst & 7) << 3) | (src & 7));
+  }
+
+  void setcc(HostCond cc, std::uint8_t base, std::int32_t disp) {
+    if (base >> 3)
+      u8(0x41);
+    u8(0x0F);
+    u8(0x90 | cc);
+    mem(0, base, disp);
+  }
+
+  // cmp qword [base + disp], imm8
+  void cmpImm8(std::uint8_t base, std::int32_t disp, std::int8_t imm) {
+    u8(0x48 | (base >> 3));
+    u8(0x83);
+    mem(7, base, disp);
+    u8(static_cast<std::uint8_t>(imm));
+  }
+
+  // mov qword [base + disp], imm32
+  void storeImm(std::uint8_t base, std::int32_t disp, std::int32_t imm) {
+    u8(0x48 | (base >> 3));
+    u8(0xC7);
+    mem(0, base, disp);
+    u32(static_cast<std::uint32_t>(imm));
+  }
+
+  void testAl() {
+    u8(0x84);
+    u8(0xC0);
+  }
+
+  void callRax() {
+    u8(0xFF);
+    u8(0xD0);
+  }
+
+  void push(std::uint8_t reg) {
+    if (reg >> 3)
+      u8(0x41);
+    u8(0x50 + (reg & 7));
+  }
+
+  void pop(std::uint8_t reg) {
+    if (reg >> 3)
+      u8(0x41);
+    u8(0x58 + (reg & 7));
+  }
+
+  void ret() { u8(0xC3); }
+
+  // Jumps return the position of their rel32 field for patch()
+  std::uint8_t *jcc(HostCond cc) {
+    u8(0x0F);
+    u8(0x80 | cc);
+    std::uint8_t *field = cur;
+    u32(0);
+    return field;
+  }
+
+  std::uint8_t *jmp() {
+    u8(0xE9);
+    std::uint8_t *field = cur;
+    u32(0);
+    return field;
+  }
+
+  static void patch(std::uint8_t *field, const std::uint8_t *target) {
+    std::int32_t rel = static_cast<std::int32_t>(target - (field + 4));
+    std::memcpy(field, &rel, sizeof(rel));
+  }
+
+private:
+  void mem(std::uint8_t reg, std::uint8_t base, std::int32_t disp) {
+    bool small = disp >= -128 && disp <= 127;
+    u8((small ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+      u8(0x24); // SIB: [base]
+    if (small)
+      u8(static_cast<std::uint8_t>(disp));
+    else
+      u32(static_cast<std::uint32_t>(disp));
+  }
+
+private:
+  std::uint8_t *begin;
+  std::uint8_t *cur;
+};
+
+bool isValidReg(std::uint8_t r) { return r < Machine::kNumGeneralRegs; }
+
+bool isTranslatable(const Machine::DecodedInst &d) {
+  switch (d.icode) {
+  case Instruction::icode_nop:
+    return d.ifun == 0;
+  case Instruction::icode_cmov:
+    return d.ifun <= Instruction::ifun_g && isValidReg(d.rA) &&
+           isValidReg(d.rB);
+  case Instruction::icode_irmovq:
+    return d.ifun == 0 && isValidReg(d.rB);
+  case Instruction::icode_rmmovq:
+  case Instruction::icode_mrmovq:
+    return d.ifun == 0 && isValidReg(d.rA) && isValidReg(d.rB);
+  case Instruction::icode_opq:
+    return d.ifun <= Instruction::ifun_xorq && isValidReg(d.rA) &&
+           isValidReg(d.rB);
+  case Instruction::icode_jmp:
+    return d.ifun <= Instruction::ifun_g;
+  case Instruction::icode_call:
+  case Instruction::icode_ret:
+    return d.ifun == 0;
+  case Instruction::icode_pushq:
+  case Instruction::icode_popq:
+    return d.ifun == 0 && isValidReg(d.rA);
+  default:
+    return false;
+  }
+}
+
+bool isTerminator(const Machine::DecodedInst &d) {
+  return d.icode == Instruction::icode_jmp ||
+         d.icode == Instruction::icode_call ||
+         d.icode == Instruction::icode_ret;
+}
+
+// The host add, sub, and and xor set ZF/SF/OF exactly like their y86-64
+// counterparts
+bool setsFlags(const Machine::DecodedInst &d) {
+  return d.icode == Instruction::icode_opq;
+}
+
+bool readsFlags(const Machine::DecodedInst &d) {
+  return (d.icode == Instruction::icode_cmov ||
+          d.icode == Instruction::icode_jmp) &&
+         d.ifun != 0;
+}
+
+// Memory accesses may leave the block through a side exit
+bool mayExit(const Machine::DecodedInst &d) {
+  switch (d.icode) {
+  case Instruction::icode_rmmovq:
+  case Instruction::icode_mrmovq:
+  case Instruction::icode_call:
+  case Instruction::icode_ret:
+  case Instruction::icode_pushq:
+  case Instruction::icode_popq:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Emits the host code of one block
+class Translator {
+public:
+  Translator(std::uint8_t *buf, const std::vector<std::uint64_t> &pcs,
+             const std::vector<Machine::DecodedInst> &insts)
+      : as(buf), pcs(pcs), insts(insts), flagsLive(false) {
+    hostOf.fill(NOREG);
+  }
+
+  void run(void *readHelper, void *writeHelper, void *condHelper);
+
+  std::size_t size() const { return as.size(); }
+
+private:
+  struct Exit {
+    std::uint8_t *field;
+    std::uint64_t nextPC;
+    std::uint64_t count;
+  };
+
+  void allocateRegisters();
+  void load(std::uint8_t dst, std::uint8_t guest) {
+    if (hostOf[guest] != NOREG)
+      as.movRR(dst, hostOf[guest]);
+    else
+      as.load(dst, kRegsReg, guest * 8);
+  }
+  void store(std::uint8_t guest, std::uint8_t src) {
+    if (hostOf[guest] != NOREG)
+      as.movRR(hostOf[guest], src);
+    else
+      as.store(kRegsReg, guest * 8, src);
+  }
+  void alu(std::uint8_t op, std::uint8_t dst, std::uint8_t guest) {
+    if (hostOf[guest] != NOREG)
+      as.rr(op, dst, hostOf[guest]);
+    else
+      as.rm(op, dst, kRegsReg, guest * 8);
+  }
+
+  void callHelper(void *helper) {
+    as.movRR(RDI, kCtxReg);
+    as.movImm(RAX, reinterpret_cast<std::uint64_t>(helper));
+    as.callRax();
+    flagsLive = false;
+  }
+
+  // Leave to the epilogue with `count` instructions completed
+  void exitIf(HostCond cc, std::uint64_t nextPC, std::uint64_t count) {
+    exits.push_back({as.jcc(cc), nextPC, count});
+  }
+
+  // Evaluate guest condition `ifun`, return the host condition holding it
+  HostCond condition(std::uint8_t ifun, void *helper) {
+    if (flagsLive)
+      return hostCond(ifun);
+    as.movImm(RSI, ifun);
+    callHelper(helper);
+    as.testAl();
+    return CC_NE;
+  }
+
+  // Flags of instruction i may be skipped only if the next flag producer
+  // overwrites them before anything reads them or leaves the block
+  bool needFlagsStored(std::size_t i) const {
+    for (std::size_t j = i + 1; j < insts.size(); ++j) {
+      if (setsFlags(insts[j]))
+        return false;
+      if (readsFlags(insts[j]) || mayExit(insts[j]))
+        return true;
+    }
+    return true;
+  }
+
+private:
+  Emitter as;
+  const std::vector<std::uint64_t> &pcs;
+  const std::vector<Machine::DecodedInst> &insts;
+  std::array<std::uint8_t, Machine::kNumGeneralRegs> hostOf;
+  std::vector<Exit> exits;
+  bool flagsLive;
+};
+
+void Translator::allocateRegisters() {
+  std::array<std::size_t, Machine::kNumGeneralRegs> uses{};
+  for (const Machine::DecodedInst &d : insts) {
+    if (isValidReg(d.rA))
+      ++uses[d.rA];
+    if (isValidReg(d.rB))
+      ++uses[d.rB];
+    if (d.srcB == Register::rsp)
+      uses[Register::rsp] += 2;
+  }
+
+  for (HostReg host : kAllocatable) {
+    auto best = std::max_element(uses.begin(), uses.end());
+    if (*best < 2)
+      break;
+    hostOf[best - uses.begin()] = host;
+    *best = 0;
+  }
+}
+
+void Translator::run(void *readHelper, void *writeHelper,
+                     void *condHelper) {
+  allocateRegisters();
+
+  // Prologue: keep the stack 16 bytes aligned for helper calls
+  as.push(RBX);
+  as.push(RBP);
+  as.push(R12);
+  as.push(R13);
+  as.push(R14);
+  as.push(R15);
+  as.addImm(RSP, -8);
+  as.movRR(kCtxReg, RDI);
+  as.movRR(kRegsReg, RSI);
+  for (std::uint8_t g = 0; g < Machine::kNumGeneralRegs; ++g) {
+    if (hostOf[g] != NOREG)
+      as.load(hostOf[g], kRegsReg, g * 8);
+  }
+
+  const std::uint8_t rsp = Register::rsp;
+  std::uint64_t nextPC = insts.back().valP;
+  for (std::size_t i = 0; i < insts.size(); ++i) {
+    const Machine::DecodedInst &d = insts[i];
+    switch (d.icode) {
+    case Instruction::icode_nop:
+      break;
+    case Instruction::icode_cmov:
+      if (d.ifun == 0) {
+        load(RAX, d.rA);
+        store(d.rB, RAX);
+      } else {
+        HostCond cc = condition(d.ifun, condHelper);
+        load(RAX, d.rA);
+        load(RCX, d.rB);
+        as.cmov(cc, RCX, RAX);
+        store(d.rB, RCX);
+      }
+      break;
+    case Instruction::icode_irmovq:
+      as.movImm(RAX, d.valC);
+      store(d.rB, RAX);
+      break;
+    case Instruction::icode_rmmovq:
+      load(RSI, d.rB);
+      as.movImm(RAX, d.valC);
+      as.rr(0x03, RSI, RAX);
+      load(RDX, d.rA);
+      callHelper(writeHelper);
+      as.cmpImm8(kCtxReg, kStatusOffset, JitEngine::kFault);
+      exitIf(CC_E, pcs[i], i);
+      as.cmpImm8(kCtxReg, kStatusOffset, JitEngine::kOk);
+      exitIf(CC_NE, d.valP, i + 1);
+      break;
+    case Instruction::icode_mrmovq:
+      load(RSI, d.rB);
+      as.movImm(RAX, d.valC);
+      as.rr(0x03, RSI, RAX);
+      callHelper(readHelper);
+      as.cmpImm8(kCtxReg, kStatusOffset, JitEngine::kOk);
+      exitIf(CC_NE, pcs[i], i);
+      store(d.rA, RAX);
+      break;
+    case Instruction::icode_opq: {
+      static const std::uint8_t ops[] = {0x03, 0x2B, 0x23, 0x33};
+      load(RAX, d.rB);
+      alu(ops[d.ifun], RAX, d.rA);
+      if (needFlagsStored(i)) {
+        as.setcc(CC_E, kCtxReg, kZeroFlagOffset);
+        as.setcc(CC_S, kCtxReg, kSignedFlagOffset);
+        as.setcc(CC_O, kCtxReg, kOverflowFlagOffset);
+      }
+      flagsLive = true;
+      store(d.rB, RAX);
+      break;
+    }
+    case Instruction::icode_jmp:
+      if (d.ifun == 0) {
+        as.movImm(RAX, d.valC);
+      } else {
+        HostCond cc = condition(d.ifun, condHelper);
+        as.movImm(RAX, d.valP);
+        as.movImm(RCX, d.valC);
+        as.cmov(cc, RAX, RCX);
+      }
+      break;
+    case Instruction::icode_call:
+      load(RSI, rsp);
+      as.addImm(RSI, -8);
+      as.movImm(RDX, d.valP);
+      callHelper(writeHelper);
+      as.cmpImm8(kCtxReg, kStatusOffset, JitEngine::kFault);
+      exitIf(CC_E, pcs[i], i);
+      load(RCX, rsp);
+      as.addImm(RCX, -8);
+      store(rsp, RCX);
+      as.movImm(RAX, d.valC);
+      break;
+    case Instruction::icode_ret:
+      load(RSI, rsp);
+      callHelper(readHelper);
+      as.cmpImm8(kCtxReg, kStatusOffset, JitEngine::kOk);
+      exitIf(CC_NE, pcs[i], i);
+      load(RCX, rsp);
+      as.addImm(RCX, 8);
+      store(rsp, RCX);
+      break;
+    case Instruction::icode_pushq:
+      load(RSI, rsp);
+      as.addImm(RSI, -8);
+      load(RDX, d.rA);
+      callHelper(writeHelper);
+      as.cmpImm8(kCtxReg, kStatusOffset, JitEngine::kFault);
+      exitIf(CC_E, pcs[i], i);
+      load(RCX, rsp);
+      as.addImm(RCX, -8);
+      store(rsp, RCX);
+      as.cmpImm8(kCtxReg, kStatusOffset, JitEngine::kOk);
+      exitIf(CC_NE, d.valP, i + 1);
+      break;
+    case Instruction::icode_popq:
+      load(RSI, rsp);
+      callHelper(readHelper);
+      as.cmpImm8(kCtxReg, kStatusOffset, JitEngine::kOk);
+      exitIf(CC_NE, pcs[i], i);
+      load(RCX, rsp);
+      as.addImm(RCX, 8);
+      store(rsp, RCX);
+      store(d.rA, RAX);
+      break;
+    default:
+      Y64_UNREACHABLE("Untranslatable instruction");
+    }
+  }
+
+  if (!isTerminator(insts.back())) {
+    as.movImm(RAX, nextPC);
+  }
+  as.storeImm(kCtxReg, kCountOffset, static_cast<std::int32_t>(insts.size()));
+
+  // Epilogue, next guest PC is in rax
+  std::uint8_t *epilogue = as.pos();
+  for (std::uint8_t g = 0; g < Machine::kNumGeneralRegs; ++g) {
+    if (hostOf[g] != NOREG)
+      as.store(kRegsReg, g * 8, hostOf[g]);
+  }
+  as.addImm(RSP, 8);
+  as.pop(R15);
+  as.pop(R14);
+  as.pop(R13);
+  as.pop(R12);
+  as.pop(RBP);
+  as.pop(RBX);
+  as.ret();
+
+  // Side exits out of the middle of the block
+  for (const Exit &exit : exits) {
+    Emitter::patch(exit.field, as.pos());
+    as.movImm(RAX, exit.nextPC);
+    as.storeImm(kCtxReg, kCountOffset, static_cast<std::int32_t>(exit.count));
+    Emitter::patch(as.jmp(), epilogue);
+  }
+}
+
+} // namespace
+
+bool JitEngine::isSupported() { return true; }
+
+JitEngine::JitEngine()
+    : code(nullptr), codeUsed(0), blocks(), ranges(), storage(),
+      generation(0), codeModified(false) {
+  void *p = mmap(nullptr, kCodeBufferSize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p != MAP_FAILED) {
+    code = static_cast<std::uint8_t *>(p);
+  }
+}
+
+JitEngine::~JitEngine() {
+  if (code) {
+    munmap(code, kCodeBufferSize);
+  }
+}
+
+JitEngine::Block *JitEngine::translate(Machine &m, std::uint64_t pc) {
+  std::vector<std::uint64_t> pcs;
+  std::vector<Machine::DecodedInst> insts;
+
+  // Decoding may hit an invalid address or opcode. The block then ends
+  // before it and the interpreter reports the fault when it gets there.
+  Machine::Stat stat = m.stat;
+  std::uint64_t faultValue = m.faultValue;
+  std::uint64_t addr = pc;
+  while (insts.size() < kMaxBlockInsts) {
+    const Machine::DecodedInst *d = m.decodeAhead(addr);
+    if (!d) {
+      m.fault(stat, faultValue);
+      break;
+    }
+
+    if (!isTranslatable(*d))
+      break;
+    pcs.push_back(addr);
+    insts.push_back(*d);
+    if (isTerminator(*d))
+      break;
+    addr = d->valP;
+  }
+
+  if (insts.empty()) {
+    // A breakpoint at pc is gone once cleared, so pc is not marked
+    if (m.isBreakpoint(pc)) {
+      return nullptr;
+    }
+    blocks[pc] = nullptr;
+    return nullptr;
+  }
+
+  if (kCodeBufferSize - codeUsed < kMaxBlockCode) {
+    flush();
+  }
+
+  std::uint8_t *begin = code + codeUsed;
+  if (mprotect(code, kCodeBufferSize, PROT_READ | PROT_WRITE) != 0) {
+    blocks[pc] = nullptr;
+    return nullptr;
+  }
+  Translator t{begin, pcs, insts};
+  t.run(reinterpret_cast<void *>(&JitEngine::readQuad),
+        reinterpret_cast<void *>(&JitEngine::writeQuad),
+        reinterpret_cast<void *>(&JitEngine::condition));
+  codeUsed += (t.size() + 15) & ~static_cast<std::size_t>(15);
+  if (mprotect(code, kCodeBufferSize, PROT_READ | PROT_EXEC) != 0) {
+    blocks[pc] = nullptr;
+    return nullptr;
+  }
+
+  storage.push_back(std::make_unique<Block>());
+  Block *b = storage.back().get();
+  b->func = reinterpret_cast<BlockFunc>(begin);
+  b->start = pc;
+  b->end = insts.back().valP;
+  b->count = insts.size();
+  b->valid = true;
+  b->ahead = true;
+  b->nextPC = 0;
+  b->next = nullptr;
+  blocks[pc] = b;
+  ranges[pc] = b;
+  ++m.jitStats.translated;
+  return b;
+}
+
+void JitEngine::flush() {
+  blocks.clear();
+  ranges.clear();
+  storage.clear();
+  codeUsed = 0;
+  ++generation;
+}
+
+#else // !Y64_HAS_JIT
+
+bool JitEngine::isSupported() { return false; }
+
+JitEngine::JitEngine()
+    : code(nullptr), codeUsed(0), blocks(), ranges(), storage(),
+      generation(0), codeModified(false) {}
+
+JitEngine::~JitEngine() {}
+
+JitEngine::Block *JitEngine::translate(Machine &, std::uint64_t) {
+  return nullptr;
+}
+
+void JitEngine::flush() {}
+
+#endif // Y64_HAS_JIT
+
+JitEngine::Block *JitEngine::lookup(Machine &m, std::uint64_t pc) {
+  auto iter = blocks.find(pc);
+  if (iter != blocks.end()) {
+    return iter->second;
+  }
+  return translate(m, pc);
+}
+
+void JitEngine::invalidate(std::uint64_t addr, std::uint64_t len,
+                           bool store) {
+  if (ranges.empty()) {
+    return;
+  }
+
+  // Only blocks starting less than kMaxBlockBytes before addr reach it
+  std::uint64_t end = addr + len;
+  std::uint64_t from = addr > kMaxBlockBytes ? addr - kMaxBlockBytes : 0;
+  for (auto iter = ranges.lower_bound(from);
+       iter != ranges.end() && iter->first < end;) {
+    Block *b = iter->second;
+    if (b->end <= addr) {
+      ++iter;
+      continue;
+    }
+
+    // Self-modifying code is left to the interpreter from now on
+    b->valid = false;
+    if (store) {
+      blocks[b->start] = nullptr;
+    } else {
+      blocks.erase(b->start);
+    }
+    iter = ranges.erase(iter);
+    codeModified = true;
+  }
+}
+
+std::int64_t JitEngine::readQuad(JitContext *ctx, std::uint64_t addr) {
+  std::int64_t val = 0;
+  if (!ctx->machine->readMemQuad(addr, val)) {
+    ctx->status = kFault;
+  }
+  return val;
+}
+
+void JitEngine::writeQuad(JitContext *ctx, std::uint64_t addr,
+                          std::int64_t val) {
+  JitEngine *self = ctx->machine->jit.get();
+  self->codeModified = false;
+  if (!ctx->machine->writeMemQuad(addr, val)) {
+    ctx->status = kFault;
+    return;
+  }
+
+  if (self->codeModified) {
+    ctx->status = kModified;
+  }
+}
+
+std::uint64_t JitEngine::condition(JitContext *ctx, std::uint64_t ifun) {
+  std::uint8_t zf = ctx->zeroFlag;
+  std::uint8_t sf = ctx->signedFlag;
+  std::uint8_t of = ctx->overflowFlag;
+  switch (ifun) {
+  case Instruction::ifun_le:
+    return (sf ^ of) | zf;
+  case Instruction::ifun_l:
+    return sf ^ of;
+  case Instruction::ifun_e:
+    return zf;
+  case Instruction::ifun_ne:
+    return zf ^ 1;
+  case Instruction::ifun_ge:
+    return sf ^ of ^ 1;
+  case Instruction::ifun_g:
+    return (sf ^ of ^ 1) & (zf ^ 1);
+  default:
+    return 1;
+  }
+}
+
+std::uint64_t Machine::runJit(std::uint64_t maxSteps) {
+  if (!isOk()) {
+    return 0;
+  }
+
+  if (!jit) {
+    jit = std::make_unique<JitEngine>();
+  }
+  if (!JitEngine::isSupported() || !jit->isReady()) {
+    return runThreaded(maxSteps);
+  }
+
+  const std::uint64_t start = steps;
+  const std::uint64_t limit =
+      maxSteps > kNoStepLimit - steps ? kNoStepLimit : steps + maxSteps;
+  materializeFlags();
+  JitContext ctx{this, JitEngine::kOk, 0, zeroFlag, signedFlag, overflowFlag};
+
+  auto syncFlags = [&]() {
+    zeroFlag = ctx.zeroFlag;
+    signedFlag = ctx.signedFlag;
+    overflowFlag = ctx.overflowFlag;
+  };
+
+  JitEngine::Block *prev = nullptr;
+  while (isOk() && steps < limit) {
+    JitEngine::Block *b = nullptr;
+    if (prev && prev->nextPC == pc && prev->next && prev->next->valid) {
+      b = prev->next;
+    } else {
+      std::uint64_t generation = jit->getGeneration();
+      b = jit->lookup(*this, pc);
+      if (prev && generation == jit->getGeneration()) {
+        prev->nextPC = pc;
+        prev->next = b;
+      }
+    }
+
+    if (!b || limit - steps < b->count) {
+      syncFlags();
+      std::uint64_t at = pc;
+      runThreaded(1);
+      if (!decodedAhead.empty()) {
+        settleAhead(at, 1, 1);
+      }
+      ++jitStats.interpreted;
+      materializeFlags();
+      ctx.zeroFlag = zeroFlag;
+      ctx.signedFlag = signedFlag;
+      ctx.overflowFlag = overflowFlag;
+      prev = nullptr;
+      continue;
+    }
+
+    ctx.status = JitEngine::kOk;
+    pc = b->func(&ctx, valueRegs.data());
+    steps += ctx.count;
+    if (b->ahead || !aheadHits.empty()) {
+      b->ahead = settleAhead(b->start, ctx.count, b->count);
+    }
+
+    // The memory access has already raised ADR, see Machine::fault()
+    if (ctx.status == JitEngine::kFault) {
+      break;
+    }
+    prev = b->valid ? b : nullptr;
+  }
+
+  syncFlags();
+  return steps - start;
+}
+
+} // namespace y64
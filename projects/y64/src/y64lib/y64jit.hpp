@@ -0,0 +1,103 @@
+#ifndef Y64_LIB_Y64_JIT_HPP
+#define Y64_LIB_Y64_JIT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace y64 {
+
+class Machine;
+
+// State shared between the dispatcher and translated code. Translated code
+// addresses the fields by offset, so keep this a standard layout type.
+struct JitContext {
+  Machine *machine;
+  std::uint64_t status; // one of JitEngine::Status
+  std::uint64_t count;  // instructions completed by the last block
+  std::uint8_t zeroFlag;
+  std::uint8_t signedFlag;
+  std::uint8_t overflowFlag;
+};
+
+// Translates basic blocks of y86-64 code to x86-64 machine code.
+// A block ends at jXX, call, ret, halt or the first instruction that can
+// not be translated; the dispatcher in Machine::runJit interprets whatever
+// has no translation. Blocks overwritten by guest stores are discarded and
+// their start addresses are interpreted from then on.
+class JitEngine {
+public:
+  enum Status : std::uint64_t {
+    kOk = 0,
+    kFault = 1,    // ADR raised by a memory access
+    kModified = 2, // a store overwrote translated code
+  };
+
+  using BlockFunc = std::uint64_t (*)(JitContext *ctx, std::int64_t *regs);
+
+  struct Block {
+    BlockFunc func;
+    std::uint64_t start;
+    std::uint64_t end;   // one past the last byte of guest code
+    std::uint64_t count; // number of guest instructions
+    bool valid;
+    // Some instructions were decoded for the block and did not run yet
+    bool ahead;
+    // Last successor seen, spares a table lookup for straight loops
+    std::uint64_t nextPC;
+    Block *next;
+  };
+
+  static const std::size_t kMaxBlockInsts = 64;
+  static const std::size_t kCodeBufferSize = 4 << 20;
+
+  JitEngine();
+  ~JitEngine();
+  JitEngine(const JitEngine &) = delete;
+  JitEngine &operator=(const JitEngine &) = delete;
+
+  // Whether this build and host can run translated code
+  static bool isSupported();
+
+  bool isReady() const { return code != nullptr; }
+
+  // Translated block starting at pc, nullptr when pc must be interpreted
+  Block *lookup(Machine &m, std::uint64_t pc);
+
+  // Discard blocks covering guest bytes [addr, addr + len). Those the
+  // program stored to are left to the interpreter from then on, the others
+  // are translated again.
+  void invalidate(std::uint64_t addr, std::uint64_t len, bool store);
+
+  // Bumped every time the whole cache is flushed
+  std::uint64_t getGeneration() const { return generation; }
+
+private:
+  Block *translate(Machine &m, std::uint64_t pc);
+  void flush();
+
+  static std::int64_t readQuad(JitContext *ctx, std::uint64_t addr);
+  static void writeQuad(JitContext *ctx, std::uint64_t addr,
+                        std::int64_t val);
+  static std::uint64_t condition(JitContext *ctx, std::uint64_t ifun);
+
+private:
+  std::uint8_t *code;
+  std::size_t codeUsed;
+
+  // nullptr entries mark addresses that must not be translated
+  std::unordered_map<std::uint64_t, Block *> blocks;
+  // Valid blocks ordered by start address, for invalidation
+  std::map<std::uint64_t, Block *> ranges;
+  std::vector<std::unique_ptr<Block>> storage;
+  std::uint64_t generation;
+
+  bool codeModified;
+};
+
+} // namespace y64
+
+#endif // !Y64_LIB_Y64_JIT_HPP
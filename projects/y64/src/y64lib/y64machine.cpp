@@ -1,26 +1,41 @@
 #include "y64machine.hpp"
 
+#include <algorithm>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <utility>
 
 #include "buffer.hpp"
 #include "util.hpp"
+#include "y64blockcache.hpp"
+#include "y64branch.hpp"
+#include "y64cache.hpp"
 #include "y64exception.hpp"
+#include "y64jit.hpp"
+#include "y64profile.hpp"
+#include "y64trace.hpp"
 
 namespace y64 {
 
-static const char *statToStr(Machine::Stat stat) {
+const Machine::DecodedInst Machine::kBubble = {
+    Instruction::icode_nop, 0, Register::none, Register::none,
+    Register::none,         Register::none, false,
+    Instruction::nop,       0,              0};
+
+const char *Machine::statName(Stat stat) {
   switch (stat) {
-  case Machine::Stat::AOK:
+  case Stat::AOK:
     return "AOK";
-  case Machine::Stat::HLT:
+  case Stat::HLT:
     return "HLT";
-  case Machine::Stat::ADR:
+  case Stat::ADR:
     return "ADR";
-  case Machine::Stat::INS:
+  case Stat::INS:
     return "INS";
+  case Stat::TRP:
+    return "TRP";
   default:
     Y64_UNREACHABLE("Unknown machine state");
   }
@@ -30,6 +45,26 @@ static std::uint64_t convertU64(std::uint8_t opcode) {
   return static_cast<std::uint64_t>(opcode) & 0xFF;
 }
 
+Machine::Machine(std::uint64_t memorySize, Memory::Backing backing)
+    : mem(memorySize, backing), pc(0), zeroFlag(0),
+      signedFlag(0), overflowFlag(0), stat(Stat::AOK), ccOp(kFlagsReady),
+      ccA(0), ccB(0), ccE(0), valA(0), valB(0),
+      valC(0), valE(0), valM(0), valP(0), cnd(false), inst(),
+      engine(Engine::Threaded), decodedPages(), decodedNum(UINT64_MAX),
+      decoded(nullptr), codeLow(UINT64_MAX), codeHigh(0), codeLines(),
+      codeStats(), decodedAhead(), aheadHits(), aheadStoreCounted(false),
+      fusionStats(), jit(), jitStats(), blockCache(),
+      pipeStats(), predictor(), caches(), profiler(), tracer(), breakpoints(),
+      watchpoints(), trapping(true), trapAccess(Watch::None), steps(0),
+      faultValue(0) {
+#define REGISTER(NAME, STR, ID) NAME = Register::make(ID);
+#include "registers.def"
+
+  valueRegs.fill(0);
+}
+
+Machine::~Machine() = default;
+
 // DEBUG
 #define CHECK_BYTE(EXPECT, ACTUAL)                                             \
   if (static_cast<std::uint8_t>(EXPECT) != ACTUAL) {                           \
@@ -63,7 +98,11 @@ bool Machine::load(const std::vector<std::uint8_t> &buffer) {
     InstBuffer instBuf;
     instBuf.append(buffer.data() + idx, lenInst);
     idx += lenInst;
-    writeMemInst(addr, instBuf);
+    if (!writeMemInst(addr, instBuf)) {
+      std::cerr << "error: Address 0x" << std::hex << addr
+                << " is out of memory\n";
+      return false;
+    }
     CHECK_BYTE('\n', buffer[idx++]);
   }
 
@@ -101,107 +140,418 @@ bool Machine::load(const std::string &filename) {
   return load(buffer);
 }
 
+Machine::Snapshot Machine::snapshot() {
+  materializeFlags();
+  Snapshot snap;
+  snap.memory = mem.snapshot();
+  snap.regs = valueRegs;
+  snap.pc = pc;
+  snap.zeroFlag = zeroFlag;
+  snap.signedFlag = signedFlag;
+  snap.overflowFlag = overflowFlag;
+  snap.steps = steps;
+  // A trap only stops the debugger, the program has not finished
+  snap.stat = stat == Stat::TRP ? Stat::AOK : stat;
+  snap.faultValue = stat == Stat::TRP ? 0 : faultValue;
+  return snap;
+}
+
+void Machine::restore(const Snapshot &snap) {
+  if (mem.isBasedOn(*snap.memory)) {
+    // Code decoded from the pages about to be reverted is stale
+    for (std::uint64_t num : mem.dirtyPages()) {
+      invalidateDecoded(num << Memory::kPageBits, Memory::kPageSize, false);
+    }
+  } else {
+    resetCodeCaches();
+  }
+  mem.restore(*snap.memory);
+
+  valueRegs = snap.regs;
+  pc = snap.pc;
+  zeroFlag = snap.zeroFlag;
+  signedFlag = snap.signedFlag;
+  overflowFlag = snap.overflowFlag;
+  ccOp = kFlagsReady;
+  stat = snap.stat;
+  steps = snap.steps;
+  faultValue = snap.faultValue;
+}
+
 void Machine::fetch() {
-  inst.setOpCode(readMemByte(pc));
-  switch (inst.icode) {
+  // An instruction that can not be fetched turns into a bubble, which the
+  // following stages pass through without side effects
+  const DecodedInst *d = lookupDecoded(pc);
+  inst = d ? *d : kBubble;
+  valC = inst.valC;
+  valP = inst.valP;
+}
+
+const Machine::DecodedInst *Machine::decodeSlow(std::uint64_t addr) {
+  // Breakpoints are never cached, so every fetch from one ends up here
+  if (isBreakpoint(addr)) {
+    trapAccess = Watch::None;
+    fault(Stat::TRP, addr);
+    return nullptr;
+  }
+
+  DecodedInst d;
+  if (!predecode(addr, d)) {
+    return nullptr;
+  }
+
+  codeLow = std::min(codeLow, addr);
+  codeHigh = std::max(codeHigh, d.valP);
+  markCodeLines(addr, d.valP);
+  d.op = findHandler(d);
+  DecodedInst *page = findDecodedPage(addr >> Memory::kPageBits, true);
+  decodedNum = addr >> Memory::kPageBits;
+  decoded = page;
+  page[addr & Memory::kPageMask] = d;
+  // Decoded again to be run right away
+  if (!decodedAhead.empty()) {
+    decodedAhead.erase(addr);
+  }
+  return &page[addr & Memory::kPageMask];
+}
+
+const Machine::DecodedInst *Machine::decodeAhead(std::uint64_t addr) {
+  DecodedInst *page = findDecodedPage(addr >> Memory::kPageBits, false);
+  if (page && page[addr & Memory::kPageMask].valid) {
+    return &page[addr & Memory::kPageMask];
+  }
+  const DecodedInst *d = decodeSlow(addr);
+  if (d) {
+    decodedAhead.insert(addr);
+  }
+  return d;
+}
+
+bool Machine::settleAhead(std::uint64_t start, std::uint64_t count,
+                          std::uint64_t total) {
+  bool discarded = false;
+  bool left = false;
+  std::uint64_t addr = start;
+  for (std::uint64_t i = 0; i < total; ++i) {
+    if (i >= count) {
+      left = left || decodedAhead.count(addr) != 0;
+    } else if (decodedAhead.erase(addr) != 0 &&
+               std::find(aheadHits.begin(), aheadHits.end(), addr) !=
+                   aheadHits.end()) {
+      ++codeStats.invalidated;
+      discarded = true;
+    }
+
+    // The walk follows the entries, valid or discarded since
+    const DecodedInst *page =
+        findDecodedPage(addr >> Memory::kPageBits, false);
+    if (!page) {
+      break;
+    }
+    addr = page[addr & Memory::kPageMask].valP;
+  }
+
+  if (discarded && !aheadStoreCounted) {
+    ++codeStats.codeWrites;
+  }
+  aheadHits.clear();
+  return left;
+}
+
+Machine::DecodedInst *Machine::findDecodedPage(std::uint64_t num,
+                                               bool create) {
+  auto iter = decodedPages.find(num);
+  if (iter != decodedPages.end()) {
+    return iter->second.get();
+  }
+  if (!create) {
+    return nullptr;
+  }
+
+  // Value-initialized entries are all invalid
+  DecodedPage &page = decodedPages[num];
+  page.reset(new DecodedInst[Memory::kPageSize]());
+  return page.get();
+}
+
+std::uint8_t Machine::findHandler(const DecodedInst &d) const {
+  static const std::uint8_t kPairs[][2] = {
+#define FUSION(NAME, FIRST, SECOND) {Instruction::FIRST, Instruction::SECOND},
+#include "fusions.def"
+  };
+
+  std::uint8_t op = d.getOpCode();
+  auto startsPair = [op](const std::uint8_t *pair) { return pair[0] == op; };
+  if (std::none_of(std::begin(kPairs), std::end(kPairs), startsPair)) {
+    return op;
+  }
+  // The pair is checked again when it runs, so a later store to the
+  // second instruction does not need to drop this entry
+  DecodedInst next;
+  std::uint64_t ignored = 0;
+  if (decodeInst(mem, d.valP, next, ignored) != Stat::AOK) {
+    return op;
+  }
+  for (std::size_t i = 0; i < sizeof(kPairs) / sizeof(kPairs[0]); ++i) {
+    if (kPairs[i][0] == op && kPairs[i][1] == next.getOpCode()) {
+      return kFusedOp + i;
+    }
+  }
+  return op;
+}
+
+bool Machine::predecode(std::uint64_t addr, DecodedInst &d) {
+  std::uint64_t value = 0;
+  Stat s = decodeInst(mem, addr, d, value);
+  if (s != Stat::AOK) {
+    fault(s, value);
+    return false;
+  }
+  return true;
+}
+
+// Readers for decodeInst(), failing with the fault values that
+// readMemByte() and readMemQuad() report
+static bool decodeByte(const Memory &mem, std::uint64_t addr,
+                       std::uint8_t &val, std::uint64_t &faultValue) {
+  if (!mem.contains(addr, 1)) {
+    faultValue = addr;
+    return false;
+  }
+  val = mem.readByte(addr);
+  return true;
+}
+
+static bool decodeQuad(const Memory &mem, std::uint64_t addr,
+                       std::int64_t &val, std::uint64_t &faultValue) {
+  if (!mem.contains(addr, sizeof(val))) {
+    faultValue = addr + 8;
+    return false;
+  }
+  val = mem.readQuad(addr);
+  return true;
+}
+
+Machine::Stat Machine::decodeInst(const Memory &mem, std::uint64_t addr,
+                                  DecodedInst &d, std::uint64_t &faultValue) {
+  std::uint8_t opcode = 0;
+  if (!decodeByte(mem, addr, opcode, faultValue)) {
+    return Stat::ADR;
+  }
+  d.icode = opcode >> 4;
+  d.ifun = opcode & 0xF;
+  d.rA = Register::none;
+  d.rB = Register::none;
+  d.valC = 0;
+  switch (d.icode) {
   case Instruction::icode_halt:
   case Instruction::icode_nop:
   case Instruction::icode_ret:
-    valP = pc + 1;
+    d.valP = addr + 1;
     break;
   case Instruction::icode_cmov:
   case Instruction::icode_opq:
   case Instruction::icode_pushq:
-  case Instruction::icode_popq:
-    inst.setRegister(readMemByte(pc + 1));
-    valP = pc + 2;
+  case Instruction::icode_popq: {
+    std::uint8_t reg = 0;
+    if (!decodeByte(mem, addr + 1, reg, faultValue)) {
+      return Stat::ADR;
+    }
+    d.rA = reg >> 4;
+    d.rB = reg & 0xF;
+    d.valP = addr + 2;
     break;
+  }
   case Instruction::icode_jmp:
   case Instruction::icode_call:
-    valC = readMemQuad(pc + 1);
-    valP = pc + 9;
+    if (!decodeQuad(mem, addr + 1, d.valC, faultValue)) {
+      return Stat::ADR;
+    }
+    d.valP = addr + 9;
     break;
   case Instruction::icode_irmovq:
   case Instruction::icode_rmmovq:
-  case Instruction::icode_mrmovq:
-    inst.setRegister(readMemByte(pc + 1));
-    valC = readMemQuad(pc + 2);
-    valP = pc + 10;
+  case Instruction::icode_mrmovq: {
+    std::uint8_t reg = 0;
+    if (!decodeByte(mem, addr + 1, reg, faultValue) ||
+        !decodeQuad(mem, addr + 2, d.valC, faultValue)) {
+      return Stat::ADR;
+    }
+    d.rA = reg >> 4;
+    d.rB = reg & 0xF;
+    d.valP = addr + 10;
     break;
+  }
   default:
-    stat = Stat::INS;
-    throw RunningException{stat, convertU64(inst.getOpCode())};
+    faultValue = convertU64(opcode);
+    return Stat::INS;
   }
-}
 
-void Machine::decode() {
-  switch (inst.icode) {
+  // Registers read by the decode stage
+  switch (d.icode) {
   case Instruction::icode_cmov:
-    valA = valueRegs[inst.regA.id()];
+    d.srcA = d.rA;
+    d.srcB = Register::none;
     break;
   case Instruction::icode_mrmovq:
-    valB = valueRegs[inst.regB.id()];
+    d.srcA = Register::none;
+    d.srcB = d.rB;
     break;
   case Instruction::icode_rmmovq:
     Y64_FALLTHROUGH;
   case Instruction::icode_opq:
-    valA = valueRegs[inst.regA.id()];
-    valB = valueRegs[inst.regB.id()];
+    d.srcA = d.rA;
+    d.srcB = d.rB;
     break;
   case Instruction::icode_call:
-    valB = valueRegs[rsp.id()];
+    d.srcA = Register::none;
+    d.srcB = Register::rsp;
     break;
   case Instruction::icode_ret:
     Y64_FALLTHROUGH;
   case Instruction::icode_popq:
-    valA = valueRegs[rsp.id()];
-    valB = valueRegs[rsp.id()];
+    d.srcA = Register::rsp;
+    d.srcB = Register::rsp;
     break;
   case Instruction::icode_pushq:
-    valA = valueRegs[inst.regA.id()];
-    valB = valueRegs[rsp.id()];
+    d.srcA = d.rA;
+    d.srcB = Register::rsp;
     break;
   default:
+    d.srcA = Register::none;
+    d.srcB = Register::none;
     break;
   }
+  d.valid = true;
+  d.op = d.getOpCode();
+  return Stat::AOK;
+}
+
+void Machine::markCodeLines(std::uint64_t addr, std::uint64_t end) {
+  for (std::uint64_t line = addr >> kCodeLineBits;
+       line <= (end - 1) >> kCodeLineBits; ++line) {
+    std::uint64_t num = line >> (Memory::kPageBits - kCodeLineBits);
+    codeLines[num] |= std::uint64_t{1} << (line & 63);
+  }
+}
+
+bool Machine::touchesCode(std::uint64_t addr, std::uint64_t len) const {
+  std::uint64_t first = addr >> kCodeLineBits;
+  std::uint64_t last = (addr + len - 1) >> kCodeLineBits;
+  const std::uint64_t lineToPage = Memory::kPageBits - kCodeLineBits;
+  for (std::uint64_t num = first >> lineToPage;
+       num <= last >> lineToPage; ++num) {
+    auto iter = codeLines.find(num);
+    if (iter == codeLines.end()) {
+      continue;
+    }
+
+    std::uint64_t mask = ~std::uint64_t{0};
+    if (num == first >> lineToPage) {
+      mask &= ~std::uint64_t{0} << (first & 63);
+    }
+    if (num == last >> lineToPage) {
+      mask &= ~std::uint64_t{0} >> (63 - (last & 63));
+    }
+    if (iter->second & mask) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Machine::invalidateDecoded(std::uint64_t addr, std::uint64_t len,
+                                bool store) {
+  if (addr >= codeHigh || addr + len <= codeLow) {
+    return;
+  }
+  // Lines outside [codeLow, codeHigh) hold no code
+  std::uint64_t from = std::max(addr, codeLow);
+  if (!touchesCode(from, std::min(addr + len, codeHigh) - from)) {
+    return;
+  }
+  if (store) {
+    aheadHits.clear();
+  }
+
+  // An instruction is at most kMaxInstLen bytes long, so only the entries
+  // starting in [addr - kMaxInstLen + 1, addr + len) can cover the bytes
+  std::uint64_t first = addr >= kMaxInstLen ? addr - kMaxInstLen + 1 : 0;
+  std::uint64_t last = std::min(addr + len, codeHigh);
+  std::uint64_t discarded = 0;
+  for (std::uint64_t i = std::max(first, codeLow); i < last;) {
+    DecodedInst *page = findDecodedPage(i >> Memory::kPageBits, false);
+    std::uint64_t pageEnd = (i | Memory::kPageMask) + 1;
+    std::uint64_t end = std::min(last, pageEnd);
+    for (; page && i < end; ++i) {
+      DecodedInst &d = page[i & Memory::kPageMask];
+      if (!d.valid || d.valP <= addr) {
+        continue;
+      }
+      d.valid = false;
+      if (!store) {
+        continue;
+      }
+      // Whether one decoded ahead ran before the store is only known once
+      // the block running the store ends
+      if (!decodedAhead.empty() && decodedAhead.count(i) != 0) {
+        aheadHits.push_back(i);
+      } else {
+        ++discarded;
+      }
+    }
+    i = end;
+  }
+
+  if (store) {
+    codeStats.codeWrites += discarded > 0 ? 1 : 0;
+    codeStats.invalidated += discarded;
+    aheadStoreCounted = discarded > 0;
+  }
+
+  if (jit) {
+    jit->invalidate(addr, len, store);
+  }
+  if (blockCache) {
+    blockCache->invalidate(addr, len);
+  }
+}
+
+void Machine::resetCodeCaches() {
+  decodedPages.clear();
+  decodedNum = UINT64_MAX;
+  decoded = nullptr;
+  codeLow = UINT64_MAX;
+  codeHigh = 0;
+  codeLines.clear();
+  decodedAhead.clear();
+  aheadHits.clear();
+  jit.reset();
+  blockCache.reset();
+}
+
+void Machine::decode() {
+  // Register::none has a slot of its own in valueRegs, which the stages
+  // never use as a source, so the reads need no branch
+  valA = valueRegs[inst.srcA];
+  valB = valueRegs[inst.srcB];
 }
 
 bool Machine::getCondition() {
-  switch (inst.ifun) {
-  case Instruction::ifun_jmp:
-    return 1;
-  case Instruction::ifun_le:
-    return (signedFlag ^ overflowFlag) | zeroFlag;
-  case Instruction::ifun_l:
-    return signedFlag ^ overflowFlag;
-  case Instruction::ifun_e:
-    return zeroFlag == 1;
-  case Instruction::ifun_ne:
-    return zeroFlag == 0;
-  case Instruction::ifun_ge:
-    return signedFlag ^ overflowFlag ^ 1;
-  case Instruction::ifun_g:
-    return (signedFlag ^ overflowFlag ^ 1) & (zeroFlag ^ 1);
-  default:
-    stat = Stat::INS;
-    throw RunningException{stat, convertU64(inst.getOpCode())};
-    break;
+  if (inst.ifun > Instruction::ifun_g) {
+    fault(Stat::INS, convertU64(inst.getOpCode()));
+    return false;
   }
+  return testCondition(inst.ifun);
 }
 
 void Machine::executeOpInst() {
   switch (inst.ifun) {
   case Instruction::ifun_addq:
     valE = valB + valA;
-    zeroFlag = valE == 0;
-    signedFlag = valE < 0;
-    overflowFlag = ((valA < 0) == (valB < 0)) && ((valE < 0) != (valA < 0));
     break;
   case Instruction::ifun_subq:
     valE = valB - valA;
-    zeroFlag = valE == 0;
-    signedFlag = valE < 0;
-    overflowFlag = ((valA > 0) == (valB < 0)) && ((valE < 0) != (valB < 0));
     break;
   case Instruction::ifun_andq:
     valE = valB & valA;
@@ -210,9 +560,10 @@ void Machine::executeOpInst() {
     valE = valB ^ valA;
     break;
   default:
-    stat = Stat::INS;
-    throw RunningException{stat, convertU64(inst.getOpCode())};
+    fault(Stat::INS, convertU64(inst.getOpCode()));
+    return;
   }
+  setFlags(inst.ifun, valA, valB, valE);
 }
 
 void Machine::execute() {
@@ -256,22 +607,20 @@ void Machine::execute() {
 void Machine::accessMemory() {
   switch (inst.icode) {
   case Instruction::icode_rmmovq:
+    Y64_FALLTHROUGH;
+  case Instruction::icode_pushq:
     writeMemQuad(valE, valA);
     break;
-  case Instruction::icode_mrmovq:
-    valM = readMemQuad(valE);
-    break;
   case Instruction::icode_call:
     writeMemQuad(valE, valP);
     break;
-  case Instruction::icode_ret:
-    valM = readMemQuad(valA);
-    break;
-  case Instruction::icode_pushq:
-    writeMemQuad(valE, valA);
+  case Instruction::icode_mrmovq:
+    readMemQuad(valE, valM);
     break;
+  case Instruction::icode_ret:
+    Y64_FALLTHROUGH;
   case Instruction::icode_popq:
-    valM = readMemQuad(valA);
+    readMemQuad(valA, valM);
     break;
   default:
     break;
@@ -282,16 +631,16 @@ void Machine::writeBack() {
   switch (inst.icode) {
   case Instruction::icode_cmov:
     if (cnd)
-      valueRegs[inst.regB.id()] = valE;
+      valueRegs[inst.rB] = valE;
     break;
   case Instruction::icode_irmovq:
-    valueRegs[inst.regB.id()] = valE;
+    valueRegs[inst.rB] = valE;
     break;
   case Instruction::icode_mrmovq:
-    valueRegs[inst.regA.id()] = valM;
+    valueRegs[inst.rA] = valM;
     break;
   case Instruction::icode_opq:
-    valueRegs[inst.regB.id()] = valE;
+    valueRegs[inst.rB] = valE;
     break;
   case Instruction::icode_call:
     Y64_FALLTHROUGH;
@@ -302,7 +651,7 @@ void Machine::writeBack() {
     break;
   case Instruction::icode_popq:
     valueRegs[rsp.id()] = valE;
-    valueRegs[inst.regA.id()] = valM;
+    valueRegs[inst.rA] = valM;
     break;
   default:
     break;
@@ -315,6 +664,9 @@ void Machine::updatePC() {
     pc = 0;
     break;
   case Instruction::icode_j:
+    if (predictor && inst.ifun != Instruction::ifun_jmp) {
+      predictor->record(pc, valC, cnd);
+    }
     pc = cnd ? valC : valP;
     break;
   case Instruction::icode_call:
@@ -329,43 +681,164 @@ void Machine::updatePC() {
   }
 }
 
-std::uint8_t Machine::readMemByte(std::uint64_t addr) {
-  if (addr >= mem.size()) {
-    stat = Stat::ADR;
-    throw RunningException{stat, addr};
+bool Machine::stepStages() {
+  fetch();
+  decode();
+  execute();
+  accessMemory();
+  // A faulting or trapped instruction does not write back or advance the PC
+  if (stat > Stat::HLT) {
+    return false;
+  }
+  writeBack();
+  updatePC();
+  ++steps;
+  return true;
+}
+
+bool Machine::stepTraced() {
+  std::uint64_t at = pc;
+  if (!tryStep()) {
+    return false;
+  }
+  if (caches) {
+    feedCaches(at);
+  }
+  if (profiler) {
+    profiler->record(at, inst.getOpCode(), pc);
+  }
+  if (tracer) {
+    tracer->record(*this);
+  }
+  return true;
+}
+
+void Machine::feedCaches(std::uint64_t at) {
+  caches->fetch(at, valP - at);
+  switch (inst.icode) {
+  case Instruction::icode_rmmovq:
+    Y64_FALLTHROUGH;
+  case Instruction::icode_pushq:
+    Y64_FALLTHROUGH;
+  case Instruction::icode_call:
+    caches->write(valE, sizeof(std::int64_t));
+    break;
+  case Instruction::icode_mrmovq:
+    caches->read(valE, sizeof(std::int64_t));
+    break;
+  case Instruction::icode_ret:
+    Y64_FALLTHROUGH;
+  case Instruction::icode_popq:
+    caches->read(valA, sizeof(std::int64_t));
+    break;
+  default:
+    break;
+  }
+}
+
+void Machine::throwFault() const {
+  throw RunningException{stat, faultValue};
+}
+
+std::uint64_t Machine::run(std::uint64_t maxSteps) {
+  bool wasOk = isOk();
+  std::uint64_t n = tryRun(maxSteps);
+  if (wasOk && hasFault()) {
+    throwFault();
+  }
+  return n;
+}
+
+std::uint64_t Machine::tryRun(std::uint64_t maxSteps) {
+  if (isTraced() && engine != Engine::Pipe) {
+    return runTraced(maxSteps);
+  }
+
+  switch (engine) {
+  case Engine::Staged:
+    return runStaged(maxSteps);
+  case Engine::Threaded:
+    return runThreaded(maxSteps);
+  case Engine::Jit:
+    return runJit(maxSteps);
+  case Engine::Block:
+    return runBlocks(maxSteps);
+  case Engine::Pipe:
+    return runPipe(maxSteps);
+  default:
+    Y64_UNREACHABLE("Unknown engine");
+  }
+}
+
+std::uint64_t Machine::runStaged(std::uint64_t maxSteps) {
+  std::uint64_t start = steps;
+  while (steps - start < maxSteps && tryStep()) {
   }
-  return mem[addr];
+  return steps - start;
 }
 
-std::int64_t Machine::readMemQuad(std::uint64_t addr) {
-  if (addr + sizeof(std::uint64_t) > mem.size()) {
-    stat = Stat::ADR;
-    throw RunningException{stat, addr + 8};
+std::uint64_t Machine::runTraced(std::uint64_t maxSteps) {
+  std::uint64_t start = steps;
+  while (steps - start < maxSteps && stepTraced()) {
   }
+  return steps - start;
+}
+
+void Machine::setBranchPredictor(std::unique_ptr<BranchPredictor> p) {
+  predictor = std::move(p);
+}
+
+void Machine::setCacheHierarchy(std::unique_ptr<CacheHierarchy> c) {
+  caches = std::move(c);
+}
 
-  InstBuffer buf;
-  buf.append(mem.data() + addr, 8);
-  return buf.retrieveI64();
+void Machine::setProfiler(std::unique_ptr<Profiler> p) {
+  profiler = std::move(p);
 }
 
-void Machine::writeMemQuad(std::uint64_t addr, std::int64_t val) {
-  if (addr + sizeof(val) > mem.size()) {
-    stat = Stat::ADR;
-    throw RunningException{stat, addr + 8};
+void Machine::setTraceRecorder(std::unique_ptr<TraceRecorder> r) {
+  tracer = std::move(r);
+}
+
+bool Machine::readMemByte(std::uint64_t addr, std::uint8_t &val) {
+  if (!mem.contains(addr, 1)) {
+    fault(Stat::ADR, addr);
+    return false;
   }
+  val = mem.readByte(addr);
+  return true;
+}
 
-  InstBuffer buf;
-  buf.append(val);
-  std::memmove(mem.data() + addr, buf.data().data(), buf.size());
+bool Machine::setMemQuad(std::uint64_t addr, std::int64_t value) {
+  if (!mem.contains(addr, sizeof(value))) {
+    return false;
+  }
+
+  mem.writeQuad(addr, value);
+  invalidateDecoded(addr, sizeof(value), false);
+  return true;
 }
 
-void Machine::writeMemInst(std::uint64_t addr, const InstBuffer &buf) {
-  if (addr + buf.size() > mem.size()) {
-    stat = Stat::ADR;
-    throw RunningException{stat, addr + 8};
+bool Machine::setMemBytes(std::uint64_t addr, const std::uint8_t *src,
+                          std::uint64_t len) {
+  if (len > mem.size() || !mem.contains(addr, len)) {
+    return false;
   }
 
-  std::memmove(mem.data() + addr, buf.data().data(), buf.size());
+  mem.write(addr, src, len);
+  invalidateDecoded(addr, len, false);
+  return true;
+}
+
+bool Machine::writeMemInst(std::uint64_t addr, const InstBuffer &buf) {
+  if (!mem.contains(addr, buf.size())) {
+    fault(Stat::ADR, addr + 8);
+    return false;
+  }
+
+  mem.write(addr, buf.data().data(), buf.size());
+  invalidateDecoded(addr, buf.size(), false);
+  return true;
 }
 
 void Machine::printGenRegs() const {
@@ -380,17 +853,18 @@ void Machine::printGenRegs() const {
 }
 
 void Machine::printAllRegs() const {
-  std::cout << "PC:" << pc << '\t' << "ZF:" << convertU64(zeroFlag) << ' '
-            << "SF:" << convertU64(signedFlag) << ' '
-            << "OF:" << convertU64(overflowFlag) << '\t'
-            << "Stat:" << statToStr(stat) << "\n";
+  std::uint8_t zf, sf, of;
+  getFlags(zf, sf, of);
+  std::cout << "PC:" << pc << '\t' << "ZF:" << convertU64(zf) << ' '
+            << "SF:" << convertU64(sf) << ' ' << "OF:" << convertU64(of) << '\t'
+            << "Stat:" << statName(stat) << "\n";
   printGenRegs();
 }
 
 void Machine::printLineMemoryByte(std::uint64_t offset, std::uint64_t n,
                                   void (*print)(std::uint8_t)) const {
-  for (std::uint64_t i = 0; i < n && offset < kMemorySize; ++i) {
-    print(mem[offset++]);
+  for (std::uint64_t i = 0; i < n && offset < mem.size(); ++i) {
+    print(mem.readByte(offset++));
   }
 }
 
@@ -417,7 +891,7 @@ void Machine::printMemory(std::uint64_t offset, std::uint64_t len) const {
               << std::setw(2) << std::setfill('0') << i << ' ';
   }
   std::cout << '\n';
-  for (std::uint64_t i = 0; offset < kMemorySize && i < len;) {
+  for (std::uint64_t i = 0; offset < mem.size() && i < len;) {
     std::cout << "0x" << std::hex << std::setw(8) << std::setfill('0') << offset
               << ": ";
 
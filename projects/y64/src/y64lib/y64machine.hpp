@@ -2,42 +2,171 @@
 #define Y64_LIB_Y64_MACHINE_HPP
 
 #include <array>
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "buffer.hpp"
 #include "instruction.hpp"
 #include "register.hpp"
+#include "y64memory.hpp"
 
 namespace y64 {
 
+class Batch;
+class BlockCache;
+class BranchPredictor;
+class CacheHierarchy;
+class History;
+class JitEngine;
+class Profiler;
+class TraceRecorder;
+class TraceReplayer;
+
 class Machine {
+  friend class Batch;
+  friend class BlockCache;
+  friend class Cfg;
+  friend class History;
+  friend class JitEngine;
+  friend class TraceRecorder;
+  friend class TraceReplayer;
+
 public:
-  static const std::uint64_t kMemorySize = 0x2000;
+  static const std::uint64_t kDefaultMemorySize = 0x2000;
   static const std::size_t kNumGeneralRegs = 15;
+  static const std::uint64_t kNoStepLimit = UINT64_MAX;
 
   enum Stat : std::uint8_t {
     AOK,
     HLT, // execute `halt` instruction
     ADR, // invalid address
     INS, // invalid instruction
+    TRP, // stopped by a breakpoint or watchpoint, the program is not done
   };
 
-public:
-  Machine()
-      : mem(std::vector<std::uint8_t>(kMemorySize)), pc(0), zeroFlag(0),
-        signedFlag(0), overflowFlag(0), stat(Stat::AOK), valA(0), valB(0),
-        valC(0), valE(0), valM(0), valP(0), cnd(false), inst() {
-#define REGISTER(NAME, STR, ID) NAME = Register::make(ID);
-#include "registers.def"
+  // "AOK", "HLT", ... as printed after "Stat:"
+  static const char *statName(Stat stat);
 
-    valueRegs.fill(0);
-  }
+  // Interpreter used by run()
+  enum class Engine : std::uint8_t {
+    Staged,   // call the six stage functions per instruction
+    Threaded, // fused loop with one handler per opcode
+    Jit,      // native x86-64 basic blocks, falls back to Threaded
+    Block,    // cached and chained basic blocks of micro-ops
+    Pipe,     // Staged, timed on the five-stage PIPE pipeline
+  };
+
+  // Accesses a watchpoint stops at
+  enum class Watch : std::uint8_t {
+    None = 0,
+    Read = 1,
+    Write = 2,
+    Access = 3, // Read | Write
+  };
+
+  struct Watchpoint {
+    std::uint64_t addr;
+    std::uint64_t len;
+    Watch kind;
+  };
+
+  // Counters of Engine::Block
+  struct BlockStats {
+    std::uint64_t hits;        // blocks found by the dispatcher
+    std::uint64_t misses;      // blocks built
+    std::uint64_t chained;     // exits that followed a linked successor
+    std::uint64_t invalidated; // blocks discarded by stores to their code
+  };
+
+  // Counters of Engine::Jit
+  struct JitStats {
+    std::uint64_t translated;  // blocks translated
+    std::uint64_t interpreted; // instructions run without a translation
+  };
+
+  // Counters of program stores into instructions that already ran, the
+  // same for every engine
+  struct CodeStats {
+    std::uint64_t codeWrites;  // stores that discarded such an instruction
+    std::uint64_t invalidated; // decoded instructions they discarded
+  };
+
+  // Pairs of fusions.def Engine::Threaded ran as one
+  struct FusionStats {
+#define FUSION(NAME, FIRST, SECOND) std::uint64_t NAME;
+#include "fusions.def"
+  };
+
+  // Counters of Engine::Pipe, CPI is cycles / instructions
+  struct PipeStats {
+    std::uint64_t cycles;            // including filling and draining
+    std::uint64_t instructions;      // completed
+    std::uint64_t loadUseStalls;     // cycles decode waited for a load
+    std::uint64_t mispredicts;       // jXX predicted taken but not taken
+    std::uint64_t mispredictBubbles; // two per mispredict
+    std::uint64_t returnBubbles;     // three per ret
+  };
+
+  // Instruction fields extracted by fetch, cached per PC so that
+  // re-executed instructions skip fetch and decode
+  struct DecodedInst {
+    std::uint8_t icode;
+    std::uint8_t ifun;
+    std::uint8_t rA;
+    std::uint8_t rB;
+    std::uint8_t srcA; // register read into valA, or Register::none
+    std::uint8_t srcB; // register read into valB, or Register::none
+    bool valid;
+    // Handler of Engine::Threaded, getOpCode() unless this instruction
+    // starts a pair of fusions.def
+    std::uint8_t op;
+    std::int64_t valC;
+    std::uint64_t valP;
+
+    std::uint8_t getOpCode() const { return (icode << 4) | ifun; }
+  };
+
+  // nop injected by fetch() when the instruction at PC can not be fetched
+  static const DecodedInst kBubble;
+
+  // Architectural state saved by snapshot(). The memory pages are shared
+  // copy-on-write, so taking and restoring one is cheap.
+  struct Snapshot {
+    std::shared_ptr<const Memory::Snapshot> memory;
+    std::array<std::int64_t, kNumGeneralRegs + 1> regs;
+    std::uint64_t pc;
+    std::uint8_t zeroFlag;
+    std::uint8_t signedFlag;
+    std::uint8_t overflowFlag;
+    Stat stat;
+    std::uint64_t steps;
+    std::uint64_t faultValue;
+  };
+
+public:
+  // Guest memory of `memorySize` bytes, see Memory for the rounding
+  explicit Machine(std::uint64_t memorySize = kDefaultMemorySize,
+                   Memory::Backing backing = Memory::Backing::Heap);
+  Machine(const Machine &) = delete;
+  Machine &operator=(const Machine &) = delete;
+  ~Machine();
 
 public:
   // Load bytes buffer or file to memory
   bool load(const std::vector<std::uint8_t> &buffer);
   bool load(const std::string &filename);
 
+  // Save the current state, typically right after load(), and bring the
+  // machine back to it. Restoring a snapshot of this machine only reverts
+  // the memory pages written since, a snapshot of another machine with
+  // the same program may be restored too.
+  Snapshot snapshot();
+  void restore(const Snapshot &snap);
+
   // Fetch, decode, excute, memory, write back, update PC
   // See https://w3.cs.jmu.edu/lam2mo/cs261_2018_08/files/y86-isa.pdf
   void fetch();
@@ -47,16 +176,293 @@ public:
   void writeBack();
   void updatePC();
 
+  // Execute one instruction through all the stages above, return false if
+  // it did not complete
+  bool tryStep() { return isOk() && stepStages(); }
+
+  // Execute instructions until the machine leaves the AOK state or
+  // `maxSteps` instructions have been executed, return the number of
+  // instructions executed by this call
+  std::uint64_t tryRun(std::uint64_t maxSteps = kNoStepLimit);
+
+  // Same as tryStep() and tryRun(), but throw RunningException when the
+  // machine faults with ADR or INS
+  void step() {
+    // tryStep() only fails on a running machine when it faults
+    if (isOk() && !tryStep()) {
+      throwFault();
+    }
+  }
+  std::uint64_t run(std::uint64_t maxSteps = kNoStepLimit);
+
   bool isOk() const {
     return stat == Stat::AOK;
   }
 
+  bool hasFault() const { return stat == Stat::ADR || stat == Stat::INS; }
+
+  // Invalid address of an ADR or opcode of an INS fault, see
+  // setBreakpoint() for TRP
+  std::uint64_t getFaultValue() const { return faultValue; }
+
+  Stat getStat() const { return stat; }
+  const Memory &getMemory() const { return mem; }
+  std::uint64_t getPC() const { return pc; }
+
+  // Current ZF, SF and OF
+  void getFlags(std::uint8_t &zf, std::uint8_t &sf, std::uint8_t &of) const {
+    if (ccOp == kFlagsReady) {
+      zf = zeroFlag;
+      sf = signedFlag;
+      of = overflowFlag;
+      return;
+    }
+
+    zf = ccE == 0;
+    sf = ccE < 0;
+    switch (ccOp) {
+    case Instruction::ifun_addq:
+      of = ((ccA < 0) == (ccB < 0)) && ((ccE < 0) != (ccA < 0));
+      break;
+    case Instruction::ifun_subq:
+      of = ((ccA > 0) == (ccB < 0)) && ((ccE < 0) != (ccB < 0));
+      break;
+    default:
+      of = 0;
+      break;
+    }
+  }
+  std::int64_t getReg(std::size_t id) const { return valueRegs[id]; }
+  void setReg(std::size_t id, std::int64_t value) { valueRegs[id] = value; }
+  void setPC(std::uint64_t addr) { pc = addr; }
+  // Replace ZF, SF and OF, each 0 or 1
+  void setConditionCodes(std::uint8_t zf, std::uint8_t sf, std::uint8_t of) {
+    zeroFlag = zf;
+    signedFlag = sf;
+    overflowFlag = of;
+    ccOp = kFlagsReady;
+  }
+
+  // Store to memory from outside the program, false without a fault if
+  // addr is out of memory
+  bool setMemQuad(std::uint64_t addr, std::int64_t value);
+  bool setMemBytes(std::uint64_t addr, const std::uint8_t *src,
+                   std::uint64_t len);
+
+  void setEngine(Engine e) { engine = e; }
+  Engine getEngine() const { return engine; }
+
+  BlockStats getBlockStats() const;
+  JitStats getJitStats() const { return jitStats; }
+  CodeStats getCodeStats() const { return codeStats; }
+  FusionStats getFusionStats() const { return fusionStats; }
+  PipeStats getPipeStats() const;
+
+  // Conditional jumps retired by updatePC() are fed to the predictor, so
+  // while one is set run() uses the staged functions unless the engine is
+  // Pipe. Pass nullptr to detach it.
+  void setBranchPredictor(std::unique_ptr<BranchPredictor> p);
+  const BranchPredictor *getBranchPredictor() const {
+    return predictor.get();
+  }
+
+  // The instruction fetch and data access of every instruction run()
+  // completes are fed to the cache model, with the same restriction on the
+  // engine as the predictor. Pass nullptr to detach it.
+  void setCacheHierarchy(std::unique_ptr<CacheHierarchy> c);
+  const CacheHierarchy *getCacheHierarchy() const { return caches.get(); }
+
+  // Every instruction run() completes is counted by the profiler, with the
+  // same restriction on the engine as the predictor. Pass nullptr to
+  // detach it.
+  void setProfiler(std::unique_ptr<Profiler> p);
+  const Profiler *getProfiler() const { return profiler.get(); }
+
+  // Every instruction run() completes is appended to the trace, with the
+  // same restriction on the engine as the predictor. Pass nullptr to
+  // detach it.
+  void setTraceRecorder(std::unique_ptr<TraceRecorder> r);
+  TraceRecorder *getTraceRecorder() { return tracer.get(); }
+
+  // Breakpoints stop the machine with TRP right before the instruction at
+  // their address, watchpoints right before an instruction reads or writes
+  // a byte they cover, in every engine. Neither costs anything on the fast
+  // paths: a breakpoint is never predecoded and Memory never caches a
+  // watched page. The fault value of TRP is the breakpoint address or the
+  // address of the accessed quad, getTrapAccess() tells which.
+  void setBreakpoint(std::uint64_t addr);
+  bool clearBreakpoint(std::uint64_t addr);
+  const std::set<std::uint64_t> &getBreakpoints() const {
+    return breakpoints;
+  }
+  // False if [addr, addr + len) is empty or leaves memory
+  bool setWatchpoint(std::uint64_t addr, std::uint64_t len, Watch kind);
+  // Remove the watchpoints starting at addr, or only the one set with
+  // these arguments, false if there are none
+  bool clearWatchpoint(std::uint64_t addr);
+  bool clearWatchpoint(std::uint64_t addr, std::uint64_t len, Watch kind);
+  const std::vector<Watchpoint> &getWatchpoints() const {
+    return watchpoints;
+  }
+  // Access that stopped the machine with TRP, Watch::None for a breakpoint
+  Watch getTrapAccess() const { return trapAccess; }
+
+  // Whether breakpoints and watchpoints stop the machine, true unless
+  // turned off to re-execute past them
+  void setTrapping(bool on);
+  bool isTrapping() const { return trapping; }
+
+  // Leave TRP and execute one instruction with trapping off, so that a
+  // machine stopped at a breakpoint or watchpoint can move on
+  bool tryStepOver();
+
+  // Total number of instructions executed since the machine was created
+  std::uint64_t getSteps() const { return steps; }
+
 private:
-  std::uint8_t readMemByte(std::uint64_t addr);
-  std::int64_t readMemQuad(std::uint64_t addr);
-  void writeMemQuad(std::uint64_t addr, std::int64_t val);
-  void writeMemInst(std::uint64_t addr, const InstBuffer &buf);
+  bool stepStages();
+  // Whether anything watches each instruction, which needs stepTraced()
+  bool isTraced() const { return predictor || caches || profiler || tracer; }
+  // tryStep() followed by the cache model, profiler and trace recorder,
+  // kept off the plain staged path
+  bool stepTraced();
+  // Replay what fetch() and accessMemory() read and wrote for the
+  // instruction just executed at `at`
+  void feedCaches(std::uint64_t at);
+  std::uint64_t runStaged(std::uint64_t maxSteps);
+  std::uint64_t runTraced(std::uint64_t maxSteps);
+  std::uint64_t runThreaded(std::uint64_t maxSteps);
+  std::uint64_t runJit(std::uint64_t maxSteps);
+  std::uint64_t runBlocks(std::uint64_t maxSteps);
+  std::uint64_t runPipe(std::uint64_t maxSteps);
+
+  // Decoded instruction at addr, nullptr if fetching it faults
+  const DecodedInst *lookupDecoded(std::uint64_t addr) {
+    if ((addr >> Memory::kPageBits) == decodedNum &&
+        decoded[addr & Memory::kPageMask].valid)
+      return &decoded[addr & Memory::kPageMask];
+    return decodeSlow(addr);
+  }
+  const DecodedInst *decodeSlow(std::uint64_t addr);
+  // lookupDecoded() for Engine::Jit and Engine::Block, which decode a block
+  // before running it. What is decoded here is recorded as not run yet.
+  const DecodedInst *decodeAhead(std::uint64_t addr);
+  // A block at `start` of `total` instructions ran the first `count` of
+  // them: they are no longer ahead, and the last store counts in
+  // codeStats for those it discarded. Whether some of the rest are ahead.
+  bool settleAhead(std::uint64_t start, std::uint64_t count,
+                   std::uint64_t total);
+  bool isBreakpoint(std::uint64_t addr) const {
+    return trapping && !breakpoints.empty() && breakpoints.count(addr) != 0;
+  }
+  DecodedInst *findDecodedPage(std::uint64_t num, bool create);
+  // Handler for d, a fused one if d starts a pair of fusions.def
+  std::uint8_t findHandler(const DecodedInst &d) const;
+  bool predecode(std::uint64_t addr, DecodedInst &d);
+  // Decode the instruction at addr of `mem`. On failure return ADR or INS
+  // and set faultValue to what fetch() reports.
+  static Stat decodeInst(const Memory &mem, std::uint64_t addr,
+                         DecodedInst &d, std::uint64_t &faultValue);
+  // Mark the lines of [addr, end) as holding decoded code
+  void markCodeLines(std::uint64_t addr, std::uint64_t end);
+  bool touchesCode(std::uint64_t addr, std::uint64_t len) const;
+  // `store` is set for stores of the program, as opposed to changes made
+  // from outside it such as breakpoints, restore() and setMemQuad()
+  void invalidateDecoded(std::uint64_t addr, std::uint64_t len, bool store);
+  // Drop every decoded instruction, translated and micro-op block
+  void resetCodeCaches();
+
+  [[noreturn]] void throwFault() const;
+  void fault(Stat s, std::uint64_t value) {
+    stat = s;
+    faultValue = value;
+  }
+
+  // Memory accessors raise ADR and return false on invalid addresses
+  bool readMemByte(std::uint64_t addr, std::uint8_t &val);
+  bool readMemQuad(std::uint64_t addr, std::int64_t &val) {
+    if (!mem.contains(addr, sizeof(val))) {
+      fault(Stat::ADR, addr + 8);
+      return false;
+    }
+
+    return mem.readCachedQuad(addr, val) || readMemQuadSlow(addr, val);
+  }
+  bool writeMemQuad(std::uint64_t addr, std::int64_t val) {
+    if (!mem.contains(addr, sizeof(val))) {
+      fault(Stat::ADR, addr + 8);
+      return false;
+    }
+
+    if (!mem.writeCachedQuad(addr, val)) {
+      return writeMemQuadSlow(addr, val);
+    }
+    invalidateDecoded(addr, sizeof(val), true);
+    return true;
+  }
+  // Accesses missing the cached pages, which raise TRP instead when a
+  // watchpoint covers the quad
+  bool readMemQuadSlow(std::uint64_t addr, std::int64_t &val);
+  bool writeMemQuadSlow(std::uint64_t addr, std::int64_t val);
+  bool checkWatchpoints(std::uint64_t addr, Watch access);
+  void updateWatchedPages();
+  bool writeMemInst(std::uint64_t addr, const InstBuffer &buf);
   bool getCondition();
+
+  // Record the condition codes of opq `ifun` computing e from a and b
+  void setFlags(std::uint8_t ifun, std::int64_t a, std::int64_t b,
+                std::int64_t e) {
+    ccOp = ifun;
+    ccA = a;
+    ccB = b;
+    ccE = e;
+  }
+  void materializeFlags() {
+    if (ccOp != kFlagsReady) {
+      getFlags(zeroFlag, signedFlag, overflowFlag);
+      ccOp = kFlagsReady;
+    }
+  }
+  bool testCondition(std::uint8_t ifun) const {
+    if (ccOp == Instruction::ifun_subq) {
+      // SF ^ OF of b - a is exactly b < a, so no flag is needed
+      switch (ifun) {
+      case Instruction::ifun_le:
+        return ccB <= ccA;
+      case Instruction::ifun_l:
+        return ccB < ccA;
+      case Instruction::ifun_e:
+        return ccB == ccA;
+      case Instruction::ifun_ne:
+        return ccB != ccA;
+      case Instruction::ifun_ge:
+        return ccB >= ccA;
+      case Instruction::ifun_g:
+        return ccB > ccA;
+      default:
+        return true;
+      }
+    }
+
+    std::uint8_t zf, sf, of;
+    getFlags(zf, sf, of);
+    switch (ifun) {
+    case Instruction::ifun_le:
+      return (sf ^ of) | zf;
+    case Instruction::ifun_l:
+      return sf ^ of;
+    case Instruction::ifun_e:
+      return zf == 1;
+    case Instruction::ifun_ne:
+      return zf == 0;
+    case Instruction::ifun_ge:
+      return sf ^ of ^ 1;
+    case Instruction::ifun_g:
+      return (sf ^ of ^ 1) & (zf ^ 1);
+    default:
+      return true;
+    }
+  }
   void executeOpInst();
 
 public:
@@ -70,13 +476,21 @@ private:
                            void (*print)(std::uint8_t)) const;
 
 private:
-  std::vector<std::uint8_t> mem;
+  Memory mem;
   std::uint64_t pc;
   std::uint8_t zeroFlag;
   std::uint8_t signedFlag;
   std::uint8_t overflowFlag;
   Stat stat;
 
+  // Condition codes are kept as the last opq and its operands, the flags
+  // above are only computed from them when a condition is tested
+  static const std::uint8_t kFlagsReady = 0xFF;
+  std::uint8_t ccOp; // ifun of the last opq, or kFlagsReady
+  std::int64_t ccA;
+  std::int64_t ccB;
+  std::int64_t ccE;
+
   // value registers, save temporary results
   std::int64_t valA;  // R[ra] in instruction
   std::int64_t valB;  // R[rb] in instruction or R[%rsp]
@@ -86,14 +500,70 @@ private:
   std::uint64_t valP; // R[PC]
   bool cnd;
 
-  // For get icode:ifun and rA:rB
-  Instruction inst;
+  // Current instruction
+  DecodedInst inst;
+
+  Engine engine;
+
+  // Predecoded instructions in pages parallel to the memory pages, entries
+  // covering [codeLow, codeHigh) may be valid. `decoded` is the page of PC
+  // number `decodedNum`, the one the last lookup hit.
+  using DecodedPage = std::unique_ptr<DecodedInst[]>;
+  std::unordered_map<std::uint64_t, DecodedPage> decodedPages;
+  std::uint64_t decodedNum;
+  DecodedInst *decoded;
+  std::uint64_t codeLow;
+  std::uint64_t codeHigh;
+  // One bit per 64-byte line of a page, set once an instruction decoded
+  // from the line is cached. Stores to other lines skip invalidation. The
+  // bits are only cleared with the caches, so a line may stay marked after
+  // its instructions were discarded.
+  static const std::uint64_t kCodeLineBits = 6;
+  static_assert(Memory::kPageBits - kCodeLineBits == 6,
+                "one 64-bit mask covers the lines of a page");
+  std::unordered_map<std::uint64_t, std::uint64_t> codeLines;
+  CodeStats codeStats;
+  // Addresses decodeAhead() decoded that no engine ran yet. The entries
+  // the last store discarded among them wait in aheadHits for the block
+  // running to tell whether they ran before the store.
+  std::unordered_set<std::uint64_t> decodedAhead;
+  std::vector<std::uint64_t> aheadHits;
+  bool aheadStoreCounted;
+
+  // Fused handlers take the opcodes of icode 0xD and up, which never decode
+  enum class Fusion : std::uint8_t {
+#define FUSION(NAME, FIRST, SECOND) NAME,
+#include "fusions.def"
+  };
+  static const std::uint8_t kFusedOp = 0xD0;
+  FusionStats fusionStats;
+
+  // Translated blocks, created on the first run with Engine::Jit
+  std::unique_ptr<JitEngine> jit;
+  JitStats jitStats;
+  // Micro-op blocks, created on the first run with Engine::Block
+  std::unique_ptr<BlockCache> blockCache;
+  PipeStats pipeStats;
+  std::unique_ptr<BranchPredictor> predictor;
+  std::unique_ptr<CacheHierarchy> caches;
+  std::unique_ptr<Profiler> profiler;
+  std::unique_ptr<TraceRecorder> tracer;
+
+  std::set<std::uint64_t> breakpoints;
+  std::vector<Watchpoint> watchpoints;
+  bool trapping;
+  Watch trapAccess;
 
 // General registers
 #define REGISTER(NAME, STR, ID) Register NAME;
 #include "registers.def"
 
-  std::array<std::int64_t, kNumGeneralRegs> valueRegs;
+  // The extra slot absorbs accesses through Register::none so that
+  // malformed register bytes never index out of the array
+  std::array<std::int64_t, kNumGeneralRegs + 1> valueRegs;
+
+  std::uint64_t steps;
+  std::uint64_t faultValue;
 };
 
 } // namespace y64
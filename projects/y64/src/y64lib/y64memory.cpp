@@ -0,0 +1,241 @@
+#include "y64memory.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define Y64_HAS_MMAP 1
+#include <sys/mman.h>
+#else
+#define Y64_HAS_MMAP 0
+#endif
+
+namespace y64 {
+
+namespace {
+
+const std::uint8_t kZeroPage[Memory::kPageSize] = {};
+
+// Ids of snapshots, unique across all memories so that a snapshot taken
+// from one memory is never mistaken for the base of another
+std::atomic<std::uint64_t> nextSnapshotId{1};
+
+std::uint64_t roundSize(std::uint64_t size) {
+  if (size > Memory::kMaxSize) {
+    return Memory::kMaxSize;
+  }
+  if (size < Memory::kPageSize) {
+    return Memory::kPageSize;
+  }
+  return (size + Memory::kPageMask) & ~Memory::kPageMask;
+}
+
+} // namespace
+
+// Page storage carved from anonymous mmap regions of kRegionPages pages.
+// Freed pages are recycled, regions are only unmapped with the arena. Every
+// page handed out keeps the arena alive, and pages may be released from
+// other threads once snapshots are shared, hence the lock.
+class PageArena {
+public:
+  static const std::size_t kRegionPages = 512;
+
+  PageArena() : regions(), freePages(), next(nullptr), end(nullptr), lock() {}
+  PageArena(const PageArena &) = delete;
+  PageArena &operator=(const PageArena &) = delete;
+
+  ~PageArena() {
+#if Y64_HAS_MMAP
+    for (void *region : regions) {
+      munmap(region, kRegionPages * Memory::kPageSize);
+    }
+#endif
+  }
+
+  // Uninitialized page storage, nullptr if no region can be mapped
+  void *allocate() {
+    std::lock_guard<std::mutex> guard{lock};
+    if (!freePages.empty()) {
+      void *p = freePages.back();
+      freePages.pop_back();
+      return p;
+    }
+
+    if (next == end && !grow()) {
+      return nullptr;
+    }
+    void *p = next;
+    next += Memory::kPageSize;
+    return p;
+  }
+
+  void release(void *p) {
+    std::lock_guard<std::mutex> guard{lock};
+    freePages.push_back(p);
+  }
+
+private:
+  bool grow() {
+#if Y64_HAS_MMAP
+    void *p = mmap(nullptr, kRegionPages * Memory::kPageSize,
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      return false;
+    }
+    regions.push_back(p);
+    next = static_cast<std::uint8_t *>(p);
+    end = next + kRegionPages * Memory::kPageSize;
+    return true;
+#else
+    return false;
+#endif
+  }
+
+private:
+  std::vector<void *> regions;
+  std::vector<void *> freePages;
+  std::uint8_t *next; // unused part of the last region
+  std::uint8_t *end;
+  std::mutex lock;
+};
+
+Memory::Memory(std::uint64_t size, Backing backing)
+    : memSize(roundSize(size)), pages(),
+      arena(backing == Backing::Mmap ? std::make_shared<PageArena>()
+                                     : nullptr),
+      baseId(0), dirty(), watched(), lastReadNum(kNoPage), lastRead(nullptr),
+      lastWriteNum(kNoPage), lastWrite(nullptr) {}
+
+std::shared_ptr<const Memory::Snapshot> Memory::snapshot() {
+  auto snap = std::make_shared<Snapshot>();
+  snap->memSize = memSize;
+  snap->id = nextSnapshotId++;
+  snap->pages = pages;
+
+  // Every page is shared from now on
+  baseId = snap->id;
+  dirty.clear();
+  lastWriteNum = kNoPage;
+  return snap;
+}
+
+void Memory::restore(const Snapshot &snap) {
+  if (isBasedOn(snap)) {
+    for (std::uint64_t num : dirty) {
+      auto iter = snap.pages.find(num);
+      if (iter != snap.pages.end()) {
+        pages[num] = iter->second;
+      } else {
+        pages.erase(num);
+      }
+    }
+  } else {
+    pages = snap.pages;
+  }
+
+  memSize = snap.memSize;
+  baseId = snap.id;
+  dirty.clear();
+  forgetLastPages();
+}
+
+std::vector<std::uint64_t> Memory::residentPageNumbers() const {
+  std::vector<std::uint64_t> nums;
+  nums.reserve(pages.size());
+  for (const auto &entry : pages) {
+    nums.push_back(entry.first);
+  }
+  std::sort(nums.begin(), nums.end());
+  return nums;
+}
+
+void Memory::read(std::uint64_t addr, std::uint8_t *dst,
+                  std::uint64_t len) const {
+  while (len > 0) {
+    std::uint64_t offset = addr & kPageMask;
+    std::uint64_t n = std::min(len, kPageSize - offset);
+    std::memcpy(dst, readPage(addr) + offset, n);
+    addr += n;
+    dst += n;
+    len -= n;
+  }
+}
+
+void Memory::write(std::uint64_t addr, const std::uint8_t *src,
+                   std::uint64_t len) {
+  while (len > 0) {
+    std::uint64_t offset = addr & kPageMask;
+    std::uint64_t n = std::min(len, kPageSize - offset);
+    std::memcpy(writePage(addr) + offset, src, n);
+    addr += n;
+    src += n;
+    len -= n;
+  }
+}
+
+void Memory::setWatchedPages(std::vector<std::uint64_t> nums) {
+  std::sort(nums.begin(), nums.end());
+  nums.erase(std::unique(nums.begin(), nums.end()), nums.end());
+  watched = std::move(nums);
+  forgetLastPages();
+}
+
+const std::uint8_t *Memory::findReadPage(std::uint64_t num) const {
+  auto iter = pages.find(num);
+  const std::uint8_t *page =
+      iter != pages.end() ? iter->second->bytes : kZeroPage;
+  if (!isWatched(num)) {
+    lastReadNum = num;
+    lastRead = page;
+  }
+  return page;
+}
+
+std::uint8_t *Memory::findWritePage(std::uint64_t num) {
+  PagePtr &page = pages[num];
+  if (!page || page.use_count() > 1) {
+    // Allocate the page, or copy it away from the snapshots sharing it
+    PagePtr copy = allocPage();
+    if (page) {
+      std::memcpy(copy->bytes, page->bytes, kPageSize);
+    } else {
+      std::memset(copy->bytes, 0, kPageSize);
+    }
+    page = std::move(copy);
+    dirty.push_back(num);
+
+    // The read cache may still point at the zero page or the shared copy
+    if (lastReadNum == num) {
+      lastRead = page->bytes;
+    }
+  }
+
+  if (!isWatched(num)) {
+    lastWriteNum = num;
+    lastWrite = page->bytes;
+  }
+  return page->bytes;
+}
+
+Memory::PagePtr Memory::allocPage() {
+  if (arena) {
+    void *p = arena->allocate();
+    if (p) {
+      std::shared_ptr<PageArena> owner = arena;
+      return PagePtr{static_cast<Page *>(p),
+                     [owner](Page *page) { owner->release(page); }};
+    }
+  }
+  return PagePtr{new Page};
+}
+
+void Memory::forgetLastPages() {
+  lastReadNum = kNoPage;
+  lastRead = nullptr;
+  lastWriteNum = kNoPage;
+  lastWrite = nullptr;
+}
+
+} // namespace y64
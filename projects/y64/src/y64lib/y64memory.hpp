@@ -0,0 +1,192 @@
+#ifndef Y64_LIB_Y64_MEMORY_HPP
+#define Y64_LIB_Y64_MEMORY_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace y64 {
+
+class PageArena;
+
+// Guest memory of a size chosen at construction. Storage is allocated in
+// pages on the first write to them, untouched pages read as zero, so a
+// large address space only costs the pages a program actually writes.
+//
+// Pages are reference counted and shared with snapshots, the first write
+// to a shared page copies it. restore() only swaps back the pages written
+// since the memory was last snapshotted or restored from the same
+// snapshot, so resetting a machine costs the pages it dirtied.
+class Memory {
+  struct Page;
+  using PagePtr = std::shared_ptr<Page>;
+  using PageTable = std::unordered_map<std::uint64_t, PagePtr>;
+
+public:
+  static const std::uint64_t kPageBits = 12;
+  static const std::uint64_t kPageSize = std::uint64_t{1} << kPageBits;
+  static const std::uint64_t kPageMask = kPageSize - 1;
+  // The top page stays unmapped so that `addr + len` never wraps around
+  static const std::uint64_t kMaxSize = 0 - kPageSize;
+
+  // Where page storage comes from
+  enum class Backing : std::uint8_t {
+    Heap, // operator new
+    Mmap, // pages carved from anonymous mmap regions, where available
+  };
+
+  // Pages of a memory at the time snapshot() was called
+  class Snapshot {
+    friend class Memory;
+
+  public:
+    std::uint64_t size() const { return memSize; }
+
+  private:
+    std::uint64_t memSize;
+    std::uint64_t id;
+    PageTable pages;
+  };
+
+  // `size` is rounded up to whole pages and clamped to [kPageSize, kMaxSize]
+  explicit Memory(std::uint64_t size, Backing backing = Backing::Heap);
+  Memory(const Memory &) = delete;
+  Memory &operator=(const Memory &) = delete;
+
+  std::shared_ptr<const Snapshot> snapshot();
+
+  // Make memory equal to `snap`, which may come from another Memory
+  void restore(const Snapshot &snap);
+
+  // Whether restore(snap) only has to revert dirtyPages()
+  bool isBasedOn(const Snapshot &snap) const { return snap.id == baseId; }
+
+  // Numbers of the pages written since the last snapshot() or restore()
+  const std::vector<std::uint64_t> &dirtyPages() const { return dirty; }
+
+  std::uint64_t size() const { return memSize; }
+
+  // Whether [addr, addr + len) lies in memory, len is at most kPageSize
+  bool contains(std::uint64_t addr, std::uint64_t len) const {
+    return addr <= memSize - len;
+  }
+
+  // Number of pages holding storage
+  std::size_t residentPages() const { return pages.size(); }
+  // Their page numbers, in increasing order
+  std::vector<std::uint64_t> residentPageNumbers() const;
+
+  // Accessors below expect contains() to hold for the accessed bytes
+  std::uint8_t readByte(std::uint64_t addr) const {
+    return readPage(addr)[addr & kPageMask];
+  }
+  void writeByte(std::uint64_t addr, std::uint8_t val) {
+    writePage(addr)[addr & kPageMask] = val;
+  }
+
+  std::int64_t readQuad(std::uint64_t addr) const {
+    std::int64_t val;
+    if ((addr & kPageMask) <= kPageSize - sizeof(val)) {
+      std::memcpy(&val, readPage(addr) + (addr & kPageMask), sizeof(val));
+    } else {
+      read(addr, reinterpret_cast<std::uint8_t *>(&val), sizeof(val));
+    }
+    return val;
+  }
+  void writeQuad(std::uint64_t addr, std::int64_t val) {
+    if ((addr & kPageMask) <= kPageSize - sizeof(val)) {
+      std::memcpy(writePage(addr) + (addr & kPageMask), &val, sizeof(val));
+    } else {
+      write(addr, reinterpret_cast<const std::uint8_t *>(&val), sizeof(val));
+    }
+  }
+
+  void read(std::uint64_t addr, std::uint8_t *dst, std::uint64_t len) const;
+  void write(std::uint64_t addr, const std::uint8_t *src, std::uint64_t len);
+
+  // readQuad() and writeQuad() when the quad lies in the page cached as
+  // the last one read or written, false without an access otherwise. A
+  // watched page is never cached, so watchers only have to check accesses
+  // these miss.
+  bool readCachedQuad(std::uint64_t addr, std::int64_t &val) const {
+    std::uint64_t offset = addr & kPageMask;
+    if ((addr >> kPageBits) != lastReadNum ||
+        offset > kPageSize - sizeof(val)) {
+      return false;
+    }
+    std::memcpy(&val, lastRead + offset, sizeof(val));
+    return true;
+  }
+  bool writeCachedQuad(std::uint64_t addr, std::int64_t val) {
+    std::uint64_t offset = addr & kPageMask;
+    if ((addr >> kPageBits) != lastWriteNum ||
+        offset > kPageSize - sizeof(val)) {
+      return false;
+    }
+    std::memcpy(lastWrite + offset, &val, sizeof(val));
+    return true;
+  }
+
+  // Replace the watched pages by the page numbers `nums`
+  void setWatchedPages(std::vector<std::uint64_t> nums);
+  bool isWatched(std::uint64_t num) const {
+    return !watched.empty() &&
+           std::binary_search(watched.begin(), watched.end(), num);
+  }
+
+private:
+  struct Page {
+    std::uint8_t bytes[kPageSize];
+  };
+
+  // Page containing addr, the shared zero page if it was never written
+  const std::uint8_t *readPage(std::uint64_t addr) const {
+    if ((addr >> kPageBits) == lastReadNum) {
+      return lastRead;
+    }
+    return findReadPage(addr >> kPageBits);
+  }
+  // Page containing addr, allocated on first use
+  std::uint8_t *writePage(std::uint64_t addr) {
+    if ((addr >> kPageBits) == lastWriteNum) {
+      return lastWrite;
+    }
+    return findWritePage(addr >> kPageBits);
+  }
+
+  const std::uint8_t *findReadPage(std::uint64_t num) const;
+  std::uint8_t *findWritePage(std::uint64_t num);
+  PagePtr allocPage();
+  void forgetLastPages();
+
+private:
+  std::uint64_t memSize;
+  PageTable pages;
+  // Null for Backing::Heap
+  std::shared_ptr<PageArena> arena;
+
+  // Snapshot the pages not in `dirty` are shared with, 0 for none
+  std::uint64_t baseId;
+  std::vector<std::uint64_t> dirty;
+
+  // Sorted numbers of the watched pages
+  std::vector<std::uint64_t> watched;
+
+  // Last pages used by reads and by writes, so that a loop reading one
+  // array and writing another does not look up the table on every access.
+  // lastWrite is always a page owned by this memory alone, and neither is
+  // ever a watched page. kNoPage never matches since page numbers fit in
+  // 64 - kPageBits bits.
+  static const std::uint64_t kNoPage = UINT64_MAX;
+  mutable std::uint64_t lastReadNum;
+  mutable const std::uint8_t *lastRead;
+  std::uint64_t lastWriteNum;
+  std::uint8_t *lastWrite;
+};
+
+} // namespace y64
+
+#endif // !Y64_LIB_Y64_MEMORY_HPP
@@ -26,6 +26,7 @@ static std::unordered_map<std::uint64_t /*pending addr*/, std::string /*label*/>
     pendingAddr2Label;
 
 std::uint64_t AsmParser::pendingAddress = 1;
+const std::size_t AsmParser::kNoEntry;
 
 // statement := label | instruction | pseudo_instruction
 // label := identifier:
@@ -40,6 +41,12 @@ std::vector<Instruction> AsmParser::parseStatements() {
     switch (nextKind) {
     case AsmToken::TKEOF:
       calcPendingAddress(insts);
+      if (peephole) {
+        runPeephole(insts);
+      }
+      if (stripUnreachable) {
+        removeUnreachable(insts);
+      }
       genAllCode(insts);
       return insts;
     case AsmToken::ERROR:
@@ -74,7 +81,9 @@ std::vector<Instruction> AsmParser::parseStatements() {
 }
 
 void AsmParser::calcPendingAddress(std::vector<Instruction> &insts) {
-  for (Instruction &inst : insts) {
+  labelTargets.assign(insts.size(), kNoEntry);
+  for (std::size_t i = 0; i < insts.size(); ++i) {
+    Instruction &inst = insts[i];
     if (!inst.isPendingAddress) {
       continue;
     }
@@ -92,6 +101,7 @@ void AsmParser::calcPendingAddress(std::vector<Instruction> &insts) {
 
     inst.value = static_cast<std::int64_t>(iter->second);
     inst.isPendingAddress = false;
+    labelTargets[i] = labelEntries[label];
   }
 }
 
@@ -101,6 +111,76 @@ void AsmParser::genAllCode(const std::vector<Instruction> &insts) {
   }
 }
 
+void AsmParser::relocate(std::vector<Instruction> &insts,
+                         const std::vector<bool> &removed) {
+  // Lay the kept instructions out again as the parser did, a removed one
+  // and the end get the address the next instruction would have
+  std::vector<std::uint64_t> addrs(insts.size() + 1);
+  std::uint64_t pos = 0;
+  std::size_t align = 8;
+  for (std::size_t i = 0; i < insts.size(); ++i) {
+    Instruction &inst = insts[i];
+    addrs[i] = pos;
+    if (removed[i]) {
+      continue;
+    }
+
+    switch (inst.getOpCode()) {
+    case Instruction::dot_pos:
+      pos = static_cast<std::uint64_t>(inst.value);
+      break;
+    case Instruction::dot_align:
+      align = static_cast<std::size_t>(inst.value);
+      break;
+    case Instruction::dot_quad:
+      pos = (pos + align - 1) / align * align;
+      inst.setAddress(pos);
+      addrs[i] = pos;
+      pos += 8;
+      break;
+    default:
+      inst.setAddress(pos);
+      pos += inst.length();
+      break;
+    }
+  }
+  addrs[insts.size()] = pos;
+  curPos = pos;
+  curAlign = align;
+
+  for (std::size_t i = 0; i < insts.size(); ++i) {
+    if (labelTargets[i] != kNoEntry) {
+      insts[i].value = static_cast<std::int64_t>(addrs[labelTargets[i]]);
+    }
+  }
+  for (const auto &entry : labelEntries) {
+    labelTable[entry.first] = addrs[entry.second];
+  }
+
+  // Drop the removed instructions, renumbering what points at them
+  std::vector<std::size_t> index(insts.size() + 1);
+  std::size_t kept = 0;
+  for (std::size_t i = 0; i < insts.size(); ++i) {
+    index[i] = kept;
+    if (!removed[i]) {
+      insts[kept] = insts[i];
+      labelTargets[kept] = labelTargets[i];
+      ++kept;
+    }
+  }
+  index[insts.size()] = kept;
+  insts.resize(kept);
+  labelTargets.resize(kept);
+  for (std::size_t &target : labelTargets) {
+    if (target != kNoEntry) {
+      target = index[target];
+    }
+  }
+  for (auto &entry : labelEntries) {
+    entry.second = index[entry.second];
+  }
+}
+
 void AsmParser::emit(std::ofstream &fout) {
   assert(fout.is_open());
   fout << magicNumber;
@@ -320,7 +400,7 @@ void AsmParser::parseLabel(std::vector<Instruction> &insts) {
   while (true) {
     switch (nextKind) {
     case AsmToken::TKEOF:
-      setLabelsAddress(labels, addr);
+      setLabelsAddress(labels, addr, insts.size());
       return;
     case AsmToken::ERROR:
       parseError("%d: Unknown token", lexer.getLine());
@@ -330,14 +410,14 @@ void AsmParser::parseLabel(std::vector<Instruction> &insts) {
     case AsmToken::INST: {
       Instruction inst = parseInstruction();
       insts.push_back(inst);
-      setLabelsAddress(labels, inst.addr);
+      setLabelsAddress(labels, inst.addr, insts.size() - 1);
       return;
     }
     case AsmToken::PSEUDO_INST: {
       Instruction inst = parseDirective();
       insts.push_back(inst);
       if (inst.hasAddr) {
-        setLabelsAddress(labels, inst.addr);
+        setLabelsAddress(labels, inst.addr, insts.size() - 1);
         return;
       }
       break;
@@ -357,10 +437,22 @@ void AsmParser::parseLabel(std::vector<Instruction> &insts) {
   }
 }
 
+std::map<std::uint64_t, std::string> AsmParser::getSymbols() const {
+  std::map<std::uint64_t, std::string> symbols;
+  for (const auto &entry : labelTable) {
+    auto iter = symbols.find(entry.second);
+    if (iter == symbols.end() || entry.first < iter->second) {
+      symbols[entry.second] = entry.first;
+    }
+  }
+  return symbols;
+}
+
 void AsmParser::setLabelsAddress(const std::vector<std::string> &labels,
-                                 std::uint64_t addr) {
+                                 std::uint64_t addr, std::size_t entry) {
   for (const std::string &label : labels) {
     labelTable[label] = addr;
+    labelEntries[label] = entry;
   }
 }
 
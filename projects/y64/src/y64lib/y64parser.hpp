@@ -4,14 +4,50 @@
 #include "instruction.hpp"
 #include "y64lexer.hpp"
 
+#include <cstdint>
 #include <fstream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace y64 {
 
 class AsmParser {
 public:
+  // What the peephole pass changed
+  struct PeepholeStats {
+    std::uint64_t nops;   // nop removed
+    std::uint64_t moves;  // rrmovq of a register to itself removed
+    std::uint64_t jumps;  // jXX to the next instruction removed
+    std::uint64_t chains; // jXX to a jmp sent to the jmp's target
+    std::uint64_t zeros;  // irmovq $0 turned into xorq
+  };
+
+  // A run of unreachable instructions
+  struct DeadCode {
+    int line;          // of the first one
+    std::string label; // naming the first one, or empty
+    std::size_t instructions;
+    std::uint64_t bytes;
+    // false when a jump or call to a number no instruction starts at kept
+    // the code from being moved
+    bool removed;
+  };
+
   AsmParser(const std::string &source)
-      : lexer(source), out(), curPos(0), curAlign(8) {}
+      : lexer(source), out(), curPos(0), curAlign(8), labelEntries(),
+        labelTargets(), peephole(false), peepholeStats(),
+        stripUnreachable(false), deadCode() {}
+
+  // Run the peephole pass of y64asmopt.cpp before generating code, which
+  // moves code and so assumes it is only addressed through labels
+  void setPeephole(bool enable) { peephole = enable; }
+  const PeepholeStats &getPeepholeStats() const { return peepholeStats; }
+  // Also remove the instructions that neither the entry at address 0 nor
+  // a label used by reachable code leads to, after the peephole pass
+  void setStripUnreachable(bool enable) { stripUnreachable = enable; }
+  const std::vector<DeadCode> &getDeadCode() const { return deadCode; }
 
   // parse y86-64 assembly statements and
   // write output buffer and return all instructions
@@ -20,6 +56,8 @@ public:
   const std::vector<std::uint8_t> &getOutputBuffer() const {
     return out;
   }
+  // Address of every label, the alphabetically first when several share one
+  std::map<std::uint64_t, std::string> getSymbols() const;
 
 private:
   Instruction parseInstruction();
@@ -27,7 +65,7 @@ private:
   void parseLabel(std::vector<Instruction> &insts);
   std::string parseLabelName();
   void setLabelsAddress(const std::vector<std::string> &labels,
-                        std::uint64_t addr);
+                        std::uint64_t addr, std::size_t entry);
 
   void assertNextToken(AsmToken::Kind expectedKind, int line,
                        bool consume = false, const char *before = nullptr);
@@ -40,6 +78,14 @@ private:
   void calcPendingAddress(std::vector<Instruction> &insts);
   void genAllCode(const std::vector<Instruction> &insts);
 
+  bool resolveTargets(const std::vector<Instruction> &insts);
+  void runPeephole(std::vector<Instruction> &insts);
+  bool flagsDead(const std::vector<Instruction> &insts,
+                 const std::vector<bool> &removed, std::size_t i) const;
+  void removeUnreachable(std::vector<Instruction> &insts);
+  void relocate(std::vector<Instruction> &insts,
+                const std::vector<bool> &removed);
+
   void genBinary(const Instruction &inst);
   void genValue64(std::uint64_t value);
   void genAddress(std::uint64_t addr);
@@ -50,11 +96,24 @@ private:
   static std::uint64_t pendingAddress;
   static const bool kLeft = true;
   static const bool kRight = false;
+  static const std::size_t kNoEntry = SIZE_MAX;
 
   AsmLexer lexer;
   std::vector<std::uint8_t> out;
   std::uint64_t curPos;
   std::size_t curAlign;
+
+  // Index of the instruction each label names, the count of instructions
+  // for labels at the end
+  std::unordered_map<std::string, std::size_t> labelEntries;
+  // Per instruction, the labelEntries value of its label operand, or after
+  // resolveTargets() the entry a numeric jXX or call target starts, or
+  // kNoEntry
+  std::vector<std::size_t> labelTargets;
+  bool peephole;
+  PeepholeStats peepholeStats;
+  bool stripUnreachable;
+  std::vector<DeadCode> deadCode;
 };
 
 } // namespace y64
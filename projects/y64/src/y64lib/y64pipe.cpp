@@ -0,0 +1,126 @@
+// Five-stage PIPE timing model for y64::Machine
+//
+// The pipeline of CSAPP 4.5: fetch, decode, execute, memory and write back
+// registers with full forwarding, jXX predicted taken and the control logic
+// of figure 4.66. Instructions are executed through the staged functions
+// when they enter decode, so the architectural state is exactly that of
+// SEQ. The model only tracks what each pipeline register holds, enough to
+// tell when to stall or inject a bubble, and counts the cycles.
+
+#include "y64machine.hpp"
+
+#include "util.hpp"
+
+namespace y64 {
+
+namespace {
+
+// Contents of a pipeline register, the fields the control logic looks at
+struct Slot {
+  bool valid;        // false for a bubble
+  bool wrongPath;    // fetched after a mispredicted jXX or a ret
+  bool last;         // the pipeline drains once this reaches write back
+  bool mispredicted; // jXX predicted taken but falling through
+  std::uint8_t icode;
+  std::uint8_t srcA;
+  std::uint8_t srcB;
+  std::uint8_t dstM; // register loaded from memory, or Register::none
+};
+
+const Slot kBubbleSlot = {false,           false,          false,
+                          false,           Instruction::icode_nop,
+                          Register::none,  Register::none, Register::none};
+
+// What fetch reads off the predicted path, none of it ever executes
+const Slot kWrongPathSlot = {true,           true,           false,
+                             false,          Instruction::icode_nop,
+                             Register::none, Register::none, Register::none};
+
+bool isRet(const Slot &s) {
+  return s.valid && s.icode == Instruction::icode_ret;
+}
+
+} // namespace
+
+std::uint64_t Machine::runPipe(std::uint64_t maxSteps) {
+  if (!isOk() || maxSteps == 0) {
+    return 0;
+  }
+
+  const std::uint64_t start = steps;
+  Slot d = kBubbleSlot;
+  Slot e = kBubbleSlot;
+  Slot m = kBubbleSlot;
+  Slot w = kBubbleSlot;
+  // Whether the PC fetch predicts is the one the program takes. The
+  // pipeline starts empty and drains at the end of each call.
+  bool onPath = true;
+  bool fetchedLast = false;
+
+  while (true) {
+    ++pipeStats.cycles;
+    if (w.valid && w.last) {
+      break;
+    }
+
+    // Pipeline control logic
+    bool loadUse = e.valid &&
+                   (e.icode == Instruction::icode_mrmovq ||
+                    e.icode == Instruction::icode_popq) &&
+                   e.dstM != Register::none && d.valid &&
+                   (e.dstM == d.srcA || e.dstM == d.srcB);
+    bool mispredict = e.valid && e.mispredicted;
+    bool retHazard = isRet(d) || isRet(e) || isRet(m);
+    bool stallD = loadUse;
+    bool bubbleD = mispredict || (retHazard && !loadUse);
+    bool bubbleE = mispredict || loadUse;
+
+    // The fall-through of a mispredicted jXX leaving execute and the
+    // address a ret loaded are both correct
+    if ((m.valid && m.mispredicted) || isRet(w)) {
+      onPath = true;
+    }
+
+    Slot f = kWrongPathSlot;
+    if (!stallD && !bubbleD && onPath && !fetchedLast) {
+      // The instruction enters decode this cycle, run it
+      bool ok = stepTraced();
+      f.wrongPath = false;
+      f.icode = inst.icode;
+      f.srcA = inst.srcA;
+      f.srcB = inst.srcB;
+      if (inst.icode == Instruction::icode_mrmovq ||
+          inst.icode == Instruction::icode_popq) {
+        f.dstM = inst.rA;
+      }
+      f.mispredicted = ok && inst.icode == Instruction::icode_jmp && !cnd;
+      f.last = !ok || !isOk() || steps - start >= maxSteps;
+      fetchedLast = f.last;
+      onPath = !f.mispredicted && inst.icode != Instruction::icode_ret;
+    }
+
+    if (loadUse) {
+      ++pipeStats.loadUseStalls;
+    }
+    if (mispredict) {
+      ++pipeStats.mispredicts;
+      pipeStats.mispredictBubbles += 2;
+    } else if (bubbleD) {
+      ++pipeStats.returnBubbles;
+    }
+
+    w = m;
+    m = e;
+    e = bubbleE ? kBubbleSlot : d;
+    if (!stallD) {
+      d = bubbleD ? kBubbleSlot : f;
+    }
+  }
+
+  pipeStats.instructions += steps - start;
+  return steps - start;
+}
+
+Machine::PipeStats Machine::getPipeStats() const { return pipeStats; }
+
+} // namespace y64
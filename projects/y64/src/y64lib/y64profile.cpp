@@ -0,0 +1,159 @@
+#include "y64profile.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+#include "instruction.hpp"
+
+namespace y64 {
+
+namespace {
+
+std::array<const char *, 256> makeOpcodeNames() {
+  std::array<const char *, 256> names{};
+#define INST(NAME, ICODE, IFUN) names[(ICODE << 4) | IFUN] = #NAME;
+#include "insts.def"
+
+  // The cmov, opq and j placeholders share the encoding of real
+  // instructions, and the directives are never executed
+  names[Instruction::rrmovq] = "rrmovq";
+  names[Instruction::addq] = "addq";
+  names[Instruction::jmp] = "jmp";
+  names[Instruction::dot_pos] = nullptr;
+  names[Instruction::dot_align] = nullptr;
+  names[Instruction::dot_quad] = nullptr;
+  return names;
+}
+
+} // namespace
+
+Profiler::Profiler()
+    : executed(0), opcodes(), sites(), calls(), frames(), current(0) {}
+
+const char *Profiler::opcodeName(std::uint8_t opcode) {
+  static const std::array<const char *, 256> names = makeOpcodeNames();
+  return names[opcode];
+}
+
+std::string Profiler::functionName(const Symbols &symbols,
+                                   std::uint64_t addr) {
+  auto iter = symbols.find(addr);
+  if (iter != symbols.end()) {
+    return iter->second;
+  }
+  std::ostringstream name;
+  name << "0x" << std::hex << addr;
+  return name.str();
+}
+
+void Profiler::record(std::uint64_t pc, std::uint8_t opcode,
+                      std::uint64_t next) {
+  if (frames.empty()) {
+    frames.push_back(Frame{pc, 0, 0, {}});
+  }
+
+  ++executed;
+  ++opcodes[opcode];
+  ++sites[pc];
+  ++frames[current].self;
+
+  // The call belongs to the caller and the ret to the callee
+  std::uint8_t icode = opcode >> 4;
+  if (icode == Instruction::icode_call) {
+    ++calls[next];
+    current = enter(current, next);
+  } else if (icode == Instruction::icode_ret && current != 0) {
+    current = frames[current].parent;
+  }
+}
+
+std::size_t Profiler::enter(std::size_t caller, std::uint64_t function) {
+  auto iter = frames[caller].children.find(function);
+  if (iter != frames[caller].children.end()) {
+    return iter->second;
+  }
+  std::size_t callee = frames.size();
+  frames[caller].children.emplace(function, callee);
+  frames.push_back(Frame{function, caller, 0, {}});
+  return callee;
+}
+
+std::vector<Profiler::Site> Profiler::getSites() const {
+  std::vector<Site> result;
+  result.reserve(sites.size());
+  for (const auto &entry : sites) {
+    result.push_back({entry.first, entry.second});
+  }
+  std::sort(result.begin(), result.end(), [](const Site &a, const Site &b) {
+    return a.count != b.count ? a.count > b.count : a.pc < b.pc;
+  });
+  return result;
+}
+
+std::vector<Profiler::Function> Profiler::getFunctions() const {
+  // Children always come after their parent, so one backward pass sums
+  // each subtree
+  std::vector<std::uint64_t> total(frames.size());
+  for (std::size_t i = frames.size(); i-- > 0;) {
+    total[i] += frames[i].self;
+    if (i != 0) {
+      total[frames[i].parent] += total[i];
+    }
+  }
+
+  std::map<std::uint64_t, Function> functions;
+  for (std::size_t i = 0; i < frames.size(); ++i) {
+    std::uint64_t entry = frames[i].function;
+    Function &f = functions[entry];
+    f.entry = entry;
+    f.self += frames[i].self;
+
+    // A recursive call is already inside the outermost frame's total
+    bool nested = false;
+    for (std::size_t j = i; j != 0 && !nested;) {
+      j = frames[j].parent;
+      nested = frames[j].function == entry;
+    }
+    if (!nested) {
+      f.inclusive += total[i];
+    }
+  }
+  for (const auto &entry : calls) {
+    Function &f = functions[entry.first];
+    f.entry = entry.first;
+    f.calls = entry.second;
+  }
+
+  std::vector<Function> result;
+  result.reserve(functions.size());
+  for (const auto &entry : functions) {
+    result.push_back(entry.second);
+  }
+  std::stable_sort(result.begin(), result.end(),
+                   [](const Function &a, const Function &b) {
+                     return a.inclusive > b.inclusive;
+                   });
+  return result;
+}
+
+void Profiler::writeFolded(std::ostream &out, const Symbols &symbols) const {
+  for (const Frame &frame : frames) {
+    if (frame.self == 0) {
+      continue;
+    }
+
+    std::vector<const Frame *> stack{&frame};
+    while (stack.back() != &frames[0]) {
+      stack.push_back(&frames[stack.back()->parent]);
+    }
+    for (auto iter = stack.rbegin(); iter != stack.rend(); ++iter) {
+      if (iter != stack.rbegin()) {
+        out << ';';
+      }
+      out << functionName(symbols, (*iter)->function);
+    }
+    out << ' ' << frame.self << '\n';
+  }
+}
+
+} // namespace y64
@@ -0,0 +1,81 @@
+#ifndef Y64_LIB_Y64_PROFILE_HPP
+#define Y64_LIB_Y64_PROFILE_HPP
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace y64 {
+
+// Counts the instructions a Machine executes per opcode, per PC and per
+// guest function. Calls and returns rebuild the guest call stack, every
+// instruction is charged to the frame on top of it, one cycle each as on
+// SEQ. Attached with Machine::setProfiler().
+class Profiler {
+public:
+  struct Site {
+    std::uint64_t pc;
+    std::uint64_t count;
+  };
+
+  struct Function {
+    std::uint64_t entry;
+    std::uint64_t calls;
+    std::uint64_t self;      // instructions executed in the function
+    std::uint64_t inclusive; // and in everything it called
+  };
+
+  // Address to label, for naming functions
+  using Symbols = std::map<std::uint64_t, std::string>;
+
+  Profiler();
+
+  // Name of an opcode from insts.def, nullptr if it is not an instruction
+  static const char *opcodeName(std::uint8_t opcode);
+
+  // Label at addr, or addr in hex
+  static std::string functionName(const Symbols &symbols, std::uint64_t addr);
+
+  // The instruction at pc with `opcode` completed and the PC moved to next
+  void record(std::uint64_t pc, std::uint8_t opcode, std::uint64_t next);
+
+  std::uint64_t getExecuted() const { return executed; }
+  std::uint64_t getOpcodeCount(std::uint8_t opcode) const {
+    return opcodes[opcode];
+  }
+
+  // Every PC executed, ordered by count then PC
+  std::vector<Site> getSites() const;
+  // The first PC executed and every call target, ordered by inclusive count
+  std::vector<Function> getFunctions() const;
+
+  // One "outer;inner count" line per call stack, as flamegraph.pl reads
+  void writeFolded(std::ostream &out, const Symbols &symbols) const;
+
+private:
+  struct Frame {
+    std::uint64_t function;
+    std::size_t parent;
+    std::uint64_t self;
+    std::unordered_map<std::uint64_t, std::size_t> children;
+  };
+
+  std::size_t enter(std::size_t caller, std::uint64_t function);
+
+private:
+  std::uint64_t executed;
+  std::array<std::uint64_t, 256> opcodes;
+  std::unordered_map<std::uint64_t, std::uint64_t> sites;
+  std::unordered_map<std::uint64_t, std::uint64_t> calls;
+  // Call tree, frames[0] is the function the machine started in
+  std::vector<Frame> frames;
+  std::size_t current;
+};
+
+} // namespace y64
+
+#endif // !Y64_LIB_Y64_PROFILE_HPP
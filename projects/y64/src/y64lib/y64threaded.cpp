@@ -0,0 +1,332 @@
+// Fused interpreter loop for y64::Machine
+//
+// Every opcode listed in insts.def gets its own handler which performs all
+// the stages of the instruction at once, and every pair listed in
+// fusions.def one more which runs both. Handlers are chained with computed
+// goto when the compiler supports it (GCC and Clang), otherwise with a
+// switch in a loop.
+
+#include "y64machine.hpp"
+
+#include <algorithm>
+
+#include "util.hpp"
+
+#ifndef Y64_USE_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define Y64_USE_COMPUTED_GOTO 1
+#else
+#define Y64_USE_COMPUTED_GOTO 0
+#endif
+#endif // !Y64_USE_COMPUTED_GOTO
+
+namespace y64 {
+
+std::uint64_t Machine::runThreaded(std::uint64_t maxSteps) {
+  if (!isOk()) {
+    return 0;
+  }
+
+  const std::uint64_t start = steps;
+  const std::uint64_t limit =
+      maxSteps > kNoStepLimit - steps ? kNoStepLimit : steps + maxSteps;
+  const DecodedInst *d = nullptr;
+  std::int64_t *regs = valueRegs.data();
+
+#define TEST_COND(NAME) testCondition(Instruction::ifun_##NAME)
+
+#if Y64_USE_COMPUTED_GOTO
+#define HANDLER(NAME) op_##NAME
+#define FUSED(NAME) op_fused_##NAME
+#define ALIAS(NAME) op_##NAME:
+#define FALLBACK() op_fallback
+#define NEXT()                                                                 \
+  do {                                                                         \
+    if (steps == limit)                                                        \
+      goto done;                                                               \
+    d = lookupDecoded(pc);                                                     \
+    if (!d)                                                                    \
+      goto done;                                                               \
+    goto *dispatch[d->op];                                                     \
+  } while (0)
+
+  void *dispatch[256];
+  std::fill(std::begin(dispatch), std::end(dispatch), &&op_fallback);
+#define INST(NAME, ICODE, IFUN) dispatch[Instruction::NAME] = &&op_##NAME;
+#include "insts.def"
+#define FUSION(NAME, FIRST, SECOND)                                            \
+  dispatch[kFusedOp + static_cast<int>(Fusion::NAME)] = &&op_fused_##NAME;
+#include "fusions.def"
+
+  NEXT();
+#else
+#define HANDLER(NAME) case Instruction::NAME
+#define FUSED(NAME) case kFusedOp + static_cast<int>(Fusion::NAME)
+#define ALIAS(NAME)
+#define FALLBACK() default
+#define NEXT() continue
+
+  while (true) {
+    if (steps == limit)
+      goto done;
+    d = lookupDecoded(pc);
+    if (!d)
+      goto done;
+    switch (d->op) {
+#endif // Y64_USE_COMPUTED_GOTO
+
+  HANDLER(halt):
+    stat = Stat::HLT;
+    pc = 0;
+    ++steps;
+    goto done;
+
+  HANDLER(nop):
+    pc = d->valP;
+    ++steps;
+    NEXT();
+
+  ALIAS(cmov)
+  HANDLER(rrmovq):
+    regs[d->rB] = regs[d->rA];
+    pc = d->valP;
+    ++steps;
+    NEXT();
+
+#define CMOV_HANDLER(NAME)                                                     \
+  HANDLER(cmov##NAME) : if (TEST_COND(NAME)) regs[d->rB] = regs[d->rA];        \
+  pc = d->valP;                                                                \
+  ++steps;                                                                     \
+  NEXT();
+
+  CMOV_HANDLER(le)
+  CMOV_HANDLER(l)
+  CMOV_HANDLER(e)
+  CMOV_HANDLER(ne)
+  CMOV_HANDLER(ge)
+  CMOV_HANDLER(g)
+
+#define DO_IRMOVQ()                                                            \
+  regs[d->rB] = d->valC;                                                       \
+  pc = d->valP;                                                                \
+  ++steps;
+
+  HANDLER(irmovq):
+    DO_IRMOVQ();
+    NEXT();
+
+  HANDLER(rmmovq):
+    if (!writeMemQuad(regs[d->rB] + d->valC, regs[d->rA]))
+      goto done;
+    pc = d->valP;
+    ++steps;
+    NEXT();
+
+#define DO_MRMOVQ()                                                            \
+  if (!readMemQuad(regs[d->rB] + d->valC, regs[d->rA]))                        \
+    goto done;                                                                 \
+  pc = d->valP;                                                                \
+  ++steps;
+
+  HANDLER(mrmovq):
+    DO_MRMOVQ();
+    NEXT();
+
+  ALIAS(opq)
+  HANDLER(addq):
+  run_addq: {
+    std::int64_t a = regs[d->rA];
+    std::int64_t b = regs[d->rB];
+    std::int64_t e = static_cast<std::int64_t>(static_cast<std::uint64_t>(b) +
+                                               static_cast<std::uint64_t>(a));
+    setFlags(Instruction::ifun_addq, a, b, e);
+    regs[d->rB] = e;
+    pc = d->valP;
+    ++steps;
+    NEXT();
+  }
+
+#define DO_SUBQ()                                                              \
+  {                                                                            \
+    std::int64_t a = regs[d->rA];                                              \
+    std::int64_t b = regs[d->rB];                                              \
+    std::int64_t e = static_cast<std::int64_t>(static_cast<std::uint64_t>(b) - \
+                                               static_cast<std::uint64_t>(a)); \
+    setFlags(Instruction::ifun_subq, a, b, e);                                 \
+    regs[d->rB] = e;                                                           \
+    pc = d->valP;                                                              \
+    ++steps;                                                                   \
+  }
+
+  HANDLER(subq):
+  run_subq:
+    DO_SUBQ();
+    NEXT();
+
+#define DO_ANDQ()                                                              \
+  {                                                                            \
+    std::int64_t e = regs[d->rB] & regs[d->rA];                                \
+    ccOp = Instruction::ifun_andq;                                             \
+    ccE = e;                                                                   \
+    regs[d->rB] = e;                                                           \
+    pc = d->valP;                                                              \
+    ++steps;                                                                   \
+  }
+
+  HANDLER(andq):
+    DO_ANDQ();
+    NEXT();
+
+  HANDLER(xorq): {
+    std::int64_t e = regs[d->rB] ^ regs[d->rA];
+    ccOp = Instruction::ifun_xorq;
+    ccE = e;
+    regs[d->rB] = e;
+    pc = d->valP;
+    ++steps;
+    NEXT();
+  }
+
+  ALIAS(j)
+  HANDLER(jmp):
+    pc = d->valC;
+    ++steps;
+    NEXT();
+
+#define JUMP_HANDLER(NAME)                                                     \
+  HANDLER(j##NAME) : run_j##NAME : pc = TEST_COND(NAME) ? d->valC : d->valP;   \
+  ++steps;                                                                     \
+  NEXT();
+
+  JUMP_HANDLER(le)
+  JUMP_HANDLER(l)
+  JUMP_HANDLER(e)
+  JUMP_HANDLER(ne)
+  JUMP_HANDLER(ge)
+  JUMP_HANDLER(g)
+
+  HANDLER(call): {
+    std::int64_t sp = regs[Register::rsp] - 8;
+    if (!writeMemQuad(sp, d->valP))
+      goto done;
+    regs[Register::rsp] = sp;
+    pc = d->valC;
+    ++steps;
+    NEXT();
+  }
+
+  HANDLER(ret): {
+    std::int64_t sp = regs[Register::rsp];
+    std::int64_t target;
+    if (!readMemQuad(sp, target))
+      goto done;
+    regs[Register::rsp] = sp + 8;
+    pc = target;
+    ++steps;
+    NEXT();
+  }
+
+  HANDLER(pushq): {
+    std::int64_t sp = regs[Register::rsp] - 8;
+    if (!writeMemQuad(sp, regs[d->rA]))
+      goto done;
+    regs[Register::rsp] = sp;
+    pc = d->valP;
+    ++steps;
+    NEXT();
+  }
+
+  HANDLER(popq): {
+    std::int64_t sp = regs[Register::rsp];
+    std::int64_t val;
+    if (!readMemQuad(sp, val))
+      goto done;
+    regs[Register::rsp] = sp + 8;
+    regs[d->rA] = val;
+    pc = d->valP;
+    ++steps;
+    NEXT();
+  }
+
+  // A fused pair runs its first instruction, then goes straight to the
+  // handler of the second. The second is looked up again, since it may
+  // have been stored to after the first was decoded, may be a breakpoint
+  // or may be past the step limit.
+#define FUSED_TAIL(NAME, SECOND)                                               \
+  {                                                                            \
+    if (steps == limit)                                                        \
+      goto done;                                                               \
+    d = lookupDecoded(pc);                                                     \
+    if (!d)                                                                    \
+      goto done;                                                               \
+    if (d->getOpCode() != Instruction::SECOND)                                 \
+      NEXT();                                                                  \
+    ++fusionStats.NAME;                                                        \
+    goto run_##SECOND;                                                         \
+  }
+
+  FUSED(irmovq_addq):
+    DO_IRMOVQ();
+    FUSED_TAIL(irmovq_addq, addq);
+
+  FUSED(irmovq_subq):
+    DO_IRMOVQ();
+    FUSED_TAIL(irmovq_subq, subq);
+
+  FUSED(mrmovq_addq):
+    DO_MRMOVQ();
+    FUSED_TAIL(mrmovq_addq, addq);
+
+#define FUSED_JUMP_HANDLER(OP, DO_OP, NAME)                                    \
+  FUSED(OP##_j##NAME) : DO_OP();                                               \
+  FUSED_TAIL(OP##_j##NAME, j##NAME);
+
+  FUSED_JUMP_HANDLER(subq, DO_SUBQ, le)
+  FUSED_JUMP_HANDLER(subq, DO_SUBQ, l)
+  FUSED_JUMP_HANDLER(subq, DO_SUBQ, e)
+  FUSED_JUMP_HANDLER(subq, DO_SUBQ, ne)
+  FUSED_JUMP_HANDLER(subq, DO_SUBQ, ge)
+  FUSED_JUMP_HANDLER(subq, DO_SUBQ, g)
+  FUSED_JUMP_HANDLER(andq, DO_ANDQ, le)
+  FUSED_JUMP_HANDLER(andq, DO_ANDQ, l)
+  FUSED_JUMP_HANDLER(andq, DO_ANDQ, e)
+  FUSED_JUMP_HANDLER(andq, DO_ANDQ, ne)
+  FUSED_JUMP_HANDLER(andq, DO_ANDQ, ge)
+  FUSED_JUMP_HANDLER(andq, DO_ANDQ, g)
+
+  // Encodings without a dedicated handler (non-zero ifun on instructions
+  // that ignore it, invalid conditions or ALU functions) go through the
+  // stages, which either execute them or raise INS
+  ALIAS(dot_pos)
+  ALIAS(dot_align)
+  ALIAS(dot_quad)
+  FALLBACK():
+    if (!tryStep() || !isOk())
+      goto done;
+    NEXT();
+
+#if !Y64_USE_COMPUTED_GOTO
+    }
+  }
+#endif // !Y64_USE_COMPUTED_GOTO
+
+#undef HANDLER
+#undef FUSED
+#undef ALIAS
+#undef FALLBACK
+#undef NEXT
+#undef CMOV_HANDLER
+#undef JUMP_HANDLER
+#undef DO_IRMOVQ
+#undef DO_MRMOVQ
+#undef DO_SUBQ
+#undef DO_ANDQ
+#undef FUSED_TAIL
+#undef FUSED_JUMP_HANDLER
+#undef TEST_COND
+
+done:
+  return steps - start;
+}
+
+} // namespace y64
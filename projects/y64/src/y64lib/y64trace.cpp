@@ -0,0 +1,454 @@
+#include "y64trace.hpp"
+
+#include <cstring>
+#include <iterator>
+
+#include "util.hpp"
+
+namespace y64 {
+
+namespace {
+
+const char kMagic[] = "Y64TRACE";
+const char kEndMagic[] = "Y64E";
+const std::size_t kMagicSize = sizeof(kMagic) - 1;
+const std::size_t kEndMagicSize = sizeof(kEndMagic) - 1;
+const std::uint8_t kVersion = 1;
+const std::size_t kTrailerSize =
+    kEndMagicSize + 1 + 2 * sizeof(std::uint64_t);
+// Opcode, info and flags bytes, then at most five LEB128 numbers
+const std::size_t kMaxRecordSize = 3 + 5 * 10;
+
+const std::uint8_t kInfoReg = 0x0F;
+const std::uint8_t kInfoRsp = 0x10;
+const std::uint8_t kInfoMem = 0x20;
+const std::uint8_t kInfoFlags = 0x40;
+
+std::uint8_t packFlags(std::uint8_t zf, std::uint8_t sf, std::uint8_t of) {
+  return zf | sf << 1 | of << 2;
+}
+
+void putRaw64(std::uint8_t *buf, std::uint64_t value) {
+  for (std::size_t i = 0; i < sizeof(value); ++i) {
+    buf[i] = static_cast<std::uint8_t>(value >> (8 * i));
+  }
+}
+
+std::uint64_t getRaw64(const std::uint8_t *buf) {
+  std::uint64_t value = 0;
+  for (std::size_t i = 0; i < sizeof(value); ++i) {
+    value |= static_cast<std::uint64_t>(buf[i]) << (8 * i);
+  }
+  return value;
+}
+
+// Appends header fields to a byte vector
+class HeaderWriter {
+public:
+  explicit HeaderWriter(std::vector<std::uint8_t> &out) : out(out) {}
+
+  void putByte(std::uint8_t byte) { out.push_back(byte); }
+  void putU(std::uint64_t value) {
+    std::uint8_t buf[10];
+    out.insert(out.end(), buf, buf + encodeULEB128(value, buf));
+  }
+  void putS(std::int64_t value) {
+    std::uint8_t buf[10];
+    out.insert(out.end(), buf, buf + encodeSLEB128(value, buf));
+  }
+
+private:
+  std::vector<std::uint8_t> &out;
+};
+
+} // namespace
+
+TraceRecorder::TraceRecorder()
+    : out(), buffer(), used(0), bytes(0), records(0), regs(), lastPC(0),
+      lastAddr(0), writer(), lock(), ready(), spare(), full(), idle(),
+      closing(false), failed(false) {}
+
+TraceRecorder::~TraceRecorder() { stop(); }
+
+bool TraceRecorder::open(const std::string &path, const Machine &m) {
+  out.open(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    return false;
+  }
+
+  std::uint8_t zf = 0;
+  std::uint8_t sf = 0;
+  std::uint8_t of = 0;
+  m.getFlags(zf, sf, of);
+  std::vector<std::uint64_t> pages = m.mem.residentPageNumbers();
+
+  std::vector<std::uint8_t> header(kMagic, kMagic + kMagicSize);
+  HeaderWriter w{header};
+  w.putByte(kVersion);
+  w.putU(m.mem.size());
+  w.putU(m.pc);
+  for (std::size_t i = 0; i < Machine::kNumGeneralRegs; ++i) {
+    w.putS(m.valueRegs[i]);
+  }
+  w.putByte(packFlags(zf, sf, of));
+  w.putByte(m.stat);
+  w.putU(m.steps);
+  w.putU(m.faultValue);
+  w.putU(pages.size());
+  for (std::uint64_t num : pages) {
+    w.putU(num);
+    std::size_t at = header.size();
+    header.resize(at + Memory::kPageSize);
+    m.mem.read(num << Memory::kPageBits, &header[at], Memory::kPageSize);
+  }
+  out.write(reinterpret_cast<const char *>(header.data()), header.size());
+  if (!out) {
+    return false;
+  }
+
+  regs = m.valueRegs;
+  lastPC = m.pc;
+  lastAddr = 0;
+  bytes = header.size();
+  buffer.resize(kBufferSize);
+  idle.assign(kBuffers - 1, std::vector<std::uint8_t>(kBufferSize));
+  writer = std::thread{&TraceRecorder::writeLoop, this};
+  return true;
+}
+
+void TraceRecorder::record(const Machine &m) {
+  if (used > kBufferSize - kMaxRecordSize) {
+    flush();
+  }
+
+  const Machine::DecodedInst &inst = m.inst;
+  std::uint8_t info = Register::none;
+  std::int64_t regValue = 0;
+  std::int64_t memValue = 0;
+  switch (inst.icode) {
+  case Instruction::icode_cmov:
+    if (m.cnd) {
+      info = inst.rB;
+      regValue = m.valE;
+    }
+    break;
+  case Instruction::icode_irmovq:
+    info = inst.rB;
+    regValue = m.valE;
+    break;
+  case Instruction::icode_rmmovq:
+    info |= kInfoMem;
+    memValue = m.valA;
+    break;
+  case Instruction::icode_mrmovq:
+    info = inst.rA;
+    regValue = m.valM;
+    break;
+  case Instruction::icode_opq:
+    info = inst.rB | kInfoFlags;
+    regValue = m.valE;
+    break;
+  case Instruction::icode_call:
+    info |= kInfoRsp | kInfoMem;
+    memValue = static_cast<std::int64_t>(m.valP);
+    break;
+  case Instruction::icode_ret:
+    info |= kInfoRsp;
+    break;
+  case Instruction::icode_pushq:
+    info |= kInfoRsp | kInfoMem;
+    memValue = m.valA;
+    break;
+  case Instruction::icode_popq:
+    info = inst.rA | kInfoRsp;
+    regValue = m.valM;
+    break;
+  default:
+    break;
+  }
+
+  std::uint8_t *p = buffer.data() + used;
+  *p++ = inst.getOpCode();
+  *p++ = info;
+  if (info & kInfoFlags) {
+    std::uint8_t zf = 0;
+    std::uint8_t sf = 0;
+    std::uint8_t of = 0;
+    m.getFlags(zf, sf, of);
+    *p++ = packFlags(zf, sf, of);
+  }
+  p += encodeSLEB128(static_cast<std::int64_t>(m.pc - lastPC), p);
+  lastPC = m.pc;
+  // %rsp first, popq %rsp leaves the loaded value
+  if (info & kInfoRsp) {
+    p += encodeSLEB128(m.valE - regs[Register::rsp], p);
+    regs[Register::rsp] = m.valE;
+  }
+  std::uint8_t reg = info & kInfoReg;
+  if (reg != Register::none) {
+    p += encodeSLEB128(regValue - regs[reg], p);
+    regs[reg] = regValue;
+  }
+  if (info & kInfoMem) {
+    std::uint64_t addr = static_cast<std::uint64_t>(m.valE);
+    p += encodeSLEB128(static_cast<std::int64_t>(addr - lastAddr), p);
+    p += encodeSLEB128(memValue, p);
+    lastAddr = addr;
+  }
+  used = p - buffer.data();
+  ++records;
+}
+
+bool TraceRecorder::close(const Machine &m) {
+  if (!writer.joinable()) {
+    return false;
+  }
+
+  if (used > kBufferSize - kTrailerSize) {
+    flush();
+  }
+  std::uint8_t *p = buffer.data() + used;
+  std::memcpy(p, kEndMagic, kEndMagicSize);
+  p[kEndMagicSize] = m.stat;
+  putRaw64(p + kEndMagicSize + 1, m.faultValue);
+  putRaw64(p + kEndMagicSize + 1 + sizeof(std::uint64_t), records);
+  used += kTrailerSize;
+
+  stop();
+  out.close();
+  return !failed && out;
+}
+
+void TraceRecorder::flush() {
+  std::unique_lock<std::mutex> guard{lock};
+  spare.wait(guard, [this] { return !idle.empty(); });
+  buffer.resize(used);
+  full.push_back(std::move(buffer));
+  buffer = std::move(idle.back());
+  idle.pop_back();
+  bytes += used;
+  used = 0;
+  guard.unlock();
+  ready.notify_one();
+}
+
+void TraceRecorder::stop() {
+  if (!writer.joinable()) {
+    return;
+  }
+
+  if (used > 0) {
+    flush();
+  }
+  {
+    std::lock_guard<std::mutex> guard{lock};
+    closing = true;
+  }
+  ready.notify_one();
+  writer.join();
+}
+
+void TraceRecorder::writeLoop() {
+  std::unique_lock<std::mutex> guard{lock};
+  while (true) {
+    ready.wait(guard, [this] { return !full.empty() || closing; });
+    if (full.empty()) {
+      return;
+    }
+
+    std::vector<std::uint8_t> chunk = std::move(full.front());
+    full.pop_front();
+    guard.unlock();
+    out.write(reinterpret_cast<const char *>(chunk.data()), chunk.size());
+    bool ok = static_cast<bool>(out);
+    chunk.resize(kBufferSize);
+    guard.lock();
+
+    failed = failed || !ok;
+    idle.push_back(std::move(chunk));
+    spare.notify_one();
+  }
+}
+
+TraceReplayer::TraceReplayer()
+    : data(), recordsEnd(0), offset(0), machine(), checkpoints(), step(0),
+      length(UINT64_MAX), lastAddr(0), opcode(Instruction::nop), instPC(0),
+      hasTrailer(false), endStat(Machine::Stat::AOK), endFaultValue(0) {}
+
+bool TraceReplayer::open(const std::string &path) {
+  std::ifstream in{path, std::ios::binary};
+  if (!in) {
+    return false;
+  }
+  data.assign(std::istreambuf_iterator<char>{in},
+              std::istreambuf_iterator<char>{});
+
+  recordsEnd = data.size();
+  const std::uint8_t *trailer = nullptr;
+  if (data.size() >= kMagicSize + kTrailerSize) {
+    trailer = data.data() + data.size() - kTrailerSize;
+  }
+  if (trailer && std::memcmp(trailer, kEndMagic, kEndMagicSize) == 0) {
+    recordsEnd -= kTrailerSize;
+    hasTrailer = true;
+    endStat = static_cast<Machine::Stat>(trailer[kEndMagicSize]);
+    endFaultValue = getRaw64(trailer + kEndMagicSize + 1);
+    length = getRaw64(trailer + kEndMagicSize + 1 + sizeof(std::uint64_t));
+  }
+  // A truncated record decodes into the padding and stops the replay
+  data.resize(data.size() + kMaxRecordSize, 0);
+
+  if (!readHeader()) {
+    return false;
+  }
+  checkpoints.clear();
+  checkpoints.push_back({0, offset, 0, machine->snapshot()});
+  return true;
+}
+
+bool TraceReplayer::readHeader() {
+  if (recordsEnd < kMagicSize ||
+      std::memcmp(data.data(), kMagic, kMagicSize) != 0 ||
+      data[kMagicSize] != kVersion) {
+    return false;
+  }
+
+  offset = kMagicSize + 1;
+  std::uint32_t n = 0;
+  auto getU = [&]() {
+    std::uint64_t value = decodeULEB128(&data[offset], n);
+    offset += n;
+    return value;
+  };
+  auto getS = [&]() {
+    std::int64_t value = decodeSLEB128(&data[offset], n);
+    offset += n;
+    return value;
+  };
+
+  machine = std::make_unique<Machine>(getU());
+  Machine &m = *machine;
+  m.pc = getU();
+  for (std::size_t i = 0; i < Machine::kNumGeneralRegs; ++i) {
+    m.valueRegs[i] = getS();
+  }
+  std::uint8_t flags = data[offset++];
+  m.zeroFlag = flags & 1;
+  m.signedFlag = (flags >> 1) & 1;
+  m.overflowFlag = (flags >> 2) & 1;
+  m.ccOp = Machine::kFlagsReady;
+  m.stat = static_cast<Machine::Stat>(data[offset++]);
+  m.steps = getU();
+  m.faultValue = getU();
+  std::uint64_t pages = getU();
+  for (std::uint64_t i = 0; i < pages; ++i) {
+    std::uint64_t num = getU();
+    if (offset + Memory::kPageSize > recordsEnd ||
+        !m.mem.contains(num << Memory::kPageBits, Memory::kPageSize)) {
+      return false;
+    }
+    m.mem.write(num << Memory::kPageBits, &data[offset], Memory::kPageSize);
+    offset += Memory::kPageSize;
+  }
+  return offset <= recordsEnd;
+}
+
+bool TraceReplayer::seek(std::uint64_t target) {
+  if (target < step) {
+    std::size_t i = checkpoints.size();
+    while (checkpoints[--i].step > target) {
+    }
+    const Checkpoint &cp = checkpoints[i];
+    machine->restore(cp.snap);
+    step = cp.step;
+    offset = cp.offset;
+    lastAddr = cp.lastAddr;
+    opcode = Instruction::nop;
+    instPC = machine->pc;
+  }
+  while (step < target && next()) {
+  }
+  return step == target;
+}
+
+bool TraceReplayer::next() {
+  if (offset >= recordsEnd) {
+    finish();
+    return false;
+  }
+
+  Machine &m = *machine;
+  std::size_t at = offset;
+  std::uint32_t n = 0;
+  auto getS = [&]() {
+    std::int64_t value = decodeSLEB128(&data[at], n);
+    at += n;
+    return value;
+  };
+
+  std::uint8_t op = data[at++];
+  std::uint8_t info = data[at++];
+  std::uint8_t flags = (info & kInfoFlags) ? data[at++] : 0;
+  std::uint64_t pc = m.pc + getS();
+  std::int64_t rsp = (info & kInfoRsp) ? m.valueRegs[Register::rsp] + getS()
+                                       : 0;
+  std::uint8_t reg = info & kInfoReg;
+  // The delta of popq %rsp is from the %rsp just decoded, as recorded
+  std::int64_t regBase =
+      reg == Register::rsp && (info & kInfoRsp) ? rsp : m.valueRegs[reg];
+  std::int64_t regValue = reg != Register::none ? regBase + getS() : 0;
+  std::uint64_t addr = 0;
+  std::int64_t memValue = 0;
+  if (info & kInfoMem) {
+    addr = lastAddr + getS();
+    memValue = getS();
+  }
+  if (at > recordsEnd) {
+    finish();
+    return false;
+  }
+
+  // Apply in the order writeBack() does
+  if (info & kInfoFlags) {
+    m.zeroFlag = flags & 1;
+    m.signedFlag = (flags >> 1) & 1;
+    m.overflowFlag = (flags >> 2) & 1;
+    m.ccOp = Machine::kFlagsReady;
+  }
+  if (info & kInfoMem) {
+    m.setMemQuad(addr, memValue);
+    lastAddr = addr;
+  }
+  if (info & kInfoRsp) {
+    m.valueRegs[Register::rsp] = rsp;
+  }
+  if (reg != Register::none) {
+    m.valueRegs[reg] = regValue;
+  }
+  if ((op >> 4) == Instruction::icode_halt) {
+    m.stat = Machine::Stat::HLT;
+  }
+  instPC = m.pc;
+  m.pc = pc;
+  ++m.steps;
+  opcode = op;
+  offset = at;
+  ++step;
+  if (step == length) {
+    finish();
+  }
+
+  if (step % kCheckpointInterval == 0 && checkpoints.back().step < step) {
+    checkpoints.push_back({step, offset, lastAddr, m.snapshot()});
+  }
+  return true;
+}
+
+void TraceReplayer::finish() {
+  if (hasTrailer) {
+    machine->stat = endStat;
+    machine->faultValue = endFaultValue;
+  }
+}
+
+} // namespace y64
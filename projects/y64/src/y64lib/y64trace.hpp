@@ -0,0 +1,153 @@
+#ifndef Y64_LIB_Y64_TRACE_HPP
+#define Y64_LIB_Y64_TRACE_HPP
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "y64machine.hpp"
+
+namespace y64 {
+
+// Trace file layout, all numbers LEB128 unless noted:
+//
+//   header  "Y64TRACE", version byte, memory size, PC, the general
+//           registers (signed), flags byte ZF | SF << 1 | OF << 2, stat
+//           byte, steps, fault value, page count, then number and raw
+//           bytes of every resident page
+//   record  opcode byte, info byte, [flags byte], PC delta, [%rsp delta],
+//           [register delta], [address delta, value (signed)]
+//   trailer "Y64E", stat byte, fault value and record count as raw
+//           little-endian 64-bit numbers
+//
+// The low nibble of the info byte is the register an instruction wrote
+// besides %rsp, Register::none for none. Bit 4 marks a %rsp write, bit 5
+// a memory write and bit 6 a flags byte. Register and PC deltas are taken
+// from their previous values and memory addresses from the previous
+// written address, so most records take three to six bytes.
+
+// Streams every instruction a Machine completes to a trace file. Records
+// are packed into large buffers that a background thread writes out, so
+// the machine only waits when the disk falls behind. Attached with
+// Machine::setTraceRecorder() after open().
+class TraceRecorder {
+public:
+  TraceRecorder();
+  // Writes out what was recorded, without a trailer unless close() was
+  // called
+  ~TraceRecorder();
+  TraceRecorder(const TraceRecorder &) = delete;
+  TraceRecorder &operator=(const TraceRecorder &) = delete;
+
+  // Create `path` and write the state `m` starts from, false if it can
+  // not be created
+  bool open(const std::string &path, const Machine &m);
+
+  // The instruction `m` just completed
+  void record(const Machine &m);
+
+  // Write how `m` stopped and wait for every byte to reach the file,
+  // false if any write failed
+  bool close(const Machine &m);
+
+  std::uint64_t getRecords() const { return records; }
+  std::uint64_t getBytes() const { return bytes + used; }
+
+private:
+  void flush();
+  void stop();
+  void writeLoop();
+
+private:
+  static const std::size_t kBufferSize = std::size_t{1} << 20;
+  static const std::size_t kBuffers = 4;
+
+  std::ofstream out;
+  // Filled by record(), handed to the writer thread when full
+  std::vector<std::uint8_t> buffer;
+  std::size_t used;
+  std::uint64_t bytes; // handed to the writer so far
+  std::uint64_t records;
+
+  // Values the next deltas are taken from
+  std::array<std::int64_t, Machine::kNumGeneralRegs + 1> regs;
+  std::uint64_t lastPC;
+  std::uint64_t lastAddr;
+
+  std::thread writer;
+  std::mutex lock;
+  std::condition_variable ready; // a full buffer or closing
+  std::condition_variable spare; // a buffer returned to `idle`
+  std::deque<std::vector<std::uint8_t>> full;
+  std::vector<std::vector<std::uint8_t>> idle;
+  bool closing;
+  bool failed;
+};
+
+// Rebuilds the machine state after any step of a trace by applying the
+// recorded writes, nothing is executed. Snapshots taken every
+// kCheckpointInterval steps on the way make seeking backwards cheap.
+class TraceReplayer {
+public:
+  static const std::uint64_t kCheckpointInterval = 1 << 16;
+
+  TraceReplayer();
+
+  // Read the trace at `path` and go to its first step, false if it can
+  // not be read or is not a trace
+  bool open(const std::string &path);
+
+  // Go to the state after `step` records, false if the trace ends first,
+  // which leaves the state at its end
+  bool seek(std::uint64_t step);
+  // Apply one record, false at the end of the trace
+  bool next();
+
+  // Records applied, the machine's own step count may start higher
+  std::uint64_t getStep() const { return step; }
+  // Number of records, UINT64_MAX if the trace has no trailer
+  std::uint64_t getLength() const { return length; }
+  // Opcode and address of the instruction the last record completed
+  std::uint8_t getOpcode() const { return opcode; }
+  std::uint64_t getInstPC() const { return instPC; }
+
+  const Machine &getMachine() const { return *machine; }
+
+private:
+  struct Checkpoint {
+    std::uint64_t step;
+    std::size_t offset;
+    std::uint64_t lastAddr;
+    Machine::Snapshot snap;
+  };
+
+  bool readHeader();
+  void finish();
+
+private:
+  std::vector<std::uint8_t> data;
+  std::size_t recordsEnd;
+  std::size_t offset;
+  std::unique_ptr<Machine> machine;
+  std::vector<Checkpoint> checkpoints;
+  std::uint64_t step;
+  std::uint64_t length;
+  std::uint64_t lastAddr;
+  std::uint8_t opcode;
+  std::uint64_t instPC;
+  // Trailer values, applied once the last record is
+  bool hasTrailer;
+  Machine::Stat endStat;
+  std::uint64_t endFaultValue;
+};
+
+} // namespace y64
+
+#endif // !Y64_LIB_Y64_TRACE_HPP
@@ -0,0 +1,127 @@
+// Breakpoints and watchpoints of y64::Machine
+//
+// Kept apart from the stage functions so that the slow paths of memory
+// accesses are never inlined into them.
+
+#include "y64machine.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace y64 {
+
+void Machine::setBreakpoint(std::uint64_t addr) {
+  breakpoints.insert(addr);
+  // Drop the decoded instruction and the blocks running through it
+  invalidateDecoded(addr, 1, false);
+}
+
+bool Machine::clearBreakpoint(std::uint64_t addr) {
+  return breakpoints.erase(addr) != 0;
+}
+
+bool Machine::setWatchpoint(std::uint64_t addr, std::uint64_t len,
+                            Watch kind) {
+  if (len == 0 || addr >= mem.size() || len > mem.size() - addr) {
+    return false;
+  }
+  watchpoints.push_back({addr, len, kind});
+  updateWatchedPages();
+  return true;
+}
+
+bool Machine::clearWatchpoint(std::uint64_t addr) {
+  auto iter = std::remove_if(
+      watchpoints.begin(), watchpoints.end(),
+      [addr](const Watchpoint &w) { return w.addr == addr; });
+  if (iter == watchpoints.end()) {
+    return false;
+  }
+  watchpoints.erase(iter, watchpoints.end());
+  updateWatchedPages();
+  return true;
+}
+
+bool Machine::clearWatchpoint(std::uint64_t addr, std::uint64_t len,
+                              Watch kind) {
+  auto iter = std::find_if(watchpoints.begin(), watchpoints.end(),
+                           [&](const Watchpoint &w) {
+                             return w.addr == addr && w.len == len &&
+                                    w.kind == kind;
+                           });
+  if (iter == watchpoints.end()) {
+    return false;
+  }
+  watchpoints.erase(iter);
+  updateWatchedPages();
+  return true;
+}
+
+void Machine::updateWatchedPages() {
+  std::vector<std::uint64_t> nums;
+  for (const Watchpoint &w : watchpoints) {
+    for (std::uint64_t num = w.addr >> Memory::kPageBits;
+         num <= (w.addr + w.len - 1) >> Memory::kPageBits; ++num) {
+      nums.push_back(num);
+    }
+  }
+  mem.setWatchedPages(std::move(nums));
+}
+
+void Machine::setTrapping(bool on) {
+  if (on && !trapping) {
+    // Breakpoints may have been decoded while trapping was off
+    for (std::uint64_t addr : breakpoints) {
+      invalidateDecoded(addr, 1, false);
+    }
+  }
+  trapping = on;
+}
+
+bool Machine::tryStepOver() {
+  if (stat == Stat::TRP) {
+    fault(Stat::AOK, 0);
+  }
+  bool wasTrapping = trapping;
+  setTrapping(false);
+  bool ok = isTraced() ? stepTraced() : tryStep();
+  setTrapping(wasTrapping);
+  return ok;
+}
+
+bool Machine::checkWatchpoints(std::uint64_t addr, Watch access) {
+  if (!trapping || (!mem.isWatched(addr >> Memory::kPageBits) &&
+                    !mem.isWatched((addr + sizeof(std::int64_t) - 1) >>
+                                   Memory::kPageBits))) {
+    return true;
+  }
+  for (const Watchpoint &w : watchpoints) {
+    if ((static_cast<std::uint8_t>(w.kind) &
+         static_cast<std::uint8_t>(access)) != 0 &&
+        addr < w.addr + w.len && w.addr < addr + sizeof(std::int64_t)) {
+      trapAccess = access;
+      fault(Stat::TRP, addr);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Machine::readMemQuadSlow(std::uint64_t addr, std::int64_t &val) {
+  if (!checkWatchpoints(addr, Watch::Read)) {
+    return false;
+  }
+  val = mem.readQuad(addr);
+  return true;
+}
+
+bool Machine::writeMemQuadSlow(std::uint64_t addr, std::int64_t val) {
+  if (!checkWatchpoints(addr, Watch::Write)) {
+    return false;
+  }
+  mem.writeQuad(addr, val);
+  invalidateDecoded(addr, sizeof(val), true);
+  return true;
+}
+
+} // namespace y64
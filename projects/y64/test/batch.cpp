@@ -0,0 +1,145 @@
+// Batch lanes stop where a Machine seeded the same way stops
+
+#include "testing.hpp"
+
+#include "../src/y64lib/y64batch.hpp"
+
+using namespace y64;
+
+namespace {
+
+// Lanes loop %rdi times and then split four ways on %rdi: a load outside
+// memory, code that patches g, a jump to an invalid instruction, and
+// conditional moves
+const char *kProgram = R"(
+    irmovq stack, %rsp
+    irmovq $1, %r8
+    irmovq table, %rbx
+    rrmovq %rdi, %rcx
+    andq %rcx, %rcx
+    je split
+loop:
+    mrmovq (%rbx), %rax
+    addq %rcx, %rax
+    xorq %rdi, %rax
+    rmmovq %rax, (%rbx)
+    pushq %rax
+    call g
+    popq %rdx
+    subq %r8, %rcx
+    jg loop
+split:
+    rrmovq %rdi, %rsi
+    irmovq $3, %r9
+    andq %r9, %rsi
+    je fault
+    subq %r8, %rsi
+    je patch
+    subq %r8, %rsi
+    je ins
+    irmovq $-5, %r11
+    rrmovq %rdi, %r12
+    subq %r11, %r12
+    cmovl %r11, %r12
+    cmovg %rdi, %r13
+    halt
+fault:
+    irmovq $0x100000, %r10
+    addq %rdi, %r10
+    mrmovq (%r10), %rax
+    halt
+patch:
+    irmovq g, %rsi
+    irmovq newinst, %r9
+    mrmovq (%r9), %r9
+    rmmovq %r9, (%rsi)
+    call g
+    halt
+ins:
+    jmp bad
+g:
+    irmovq $3, %r10
+    addq %r10, %r14
+    ret
+    .align 8
+newinst:
+    irmovq $77, %r10
+    .align 8
+bad:
+    .quad 0xf0
+    .pos 0x1000
+table:
+    .quad 9
+    .pos 0x3000
+stack:
+)";
+
+const std::uint64_t kMemorySize = 0x4000;
+
+void checkLane(const Batch &batch, std::size_t lane, const Machine &m) {
+  Y64_CHECK_EQ(batch.getStat(lane), m.getStat());
+  Y64_CHECK_EQ(batch.getPC(lane), m.getPC());
+  Y64_CHECK_EQ(batch.getSteps(lane), m.getSteps());
+  Y64_CHECK_EQ(batch.getFaultValue(lane), m.getFaultValue());
+  for (std::size_t id = 0; id < Machine::kNumGeneralRegs; ++id) {
+    Y64_CHECK_EQ(batch.getReg(lane, id), m.getReg(id));
+  }
+}
+
+// Run `lanes` lanes, first for `firstSteps` instructions and then to the
+// end, next to one Machine per lane
+void checkBatch(const std::vector<std::uint8_t> &image, std::size_t lanes,
+                std::uint64_t firstSteps) {
+  Machine loaded{kMemorySize};
+  loaded.load(image);
+  Batch batch{loaded.snapshot(), lanes};
+  Y64_CHECK_EQ(batch.size(), lanes);
+
+  std::vector<std::unique_ptr<Machine>> machines;
+  for (std::size_t lane = 0; lane < lanes; ++lane) {
+    std::int64_t seed = static_cast<std::int64_t>(lane);
+    batch.setReg(lane, Register::rdi, seed);
+    Y64_CHECK(batch.setMemQuad(lane, 0x1008, seed * 11));
+    machines.emplace_back(new Machine{kMemorySize});
+    Machine &m = *machines.back();
+    m.load(image);
+    m.setReg(Register::rdi, seed);
+    m.setMemQuad(0x1008, seed * 11);
+  }
+  Y64_CHECK(!batch.setMemQuad(0, kMemorySize, 1));
+
+  std::uint64_t total = batch.run(firstSteps);
+  std::uint64_t expected = 0;
+  for (std::size_t lane = 0; lane < lanes; ++lane) {
+    machines[lane]->tryRun(firstSteps);
+    expected += machines[lane]->getSteps();
+    checkLane(batch, lane, *machines[lane]);
+  }
+  Y64_CHECK_EQ(total, expected);
+
+  total += batch.run();
+  expected = 0;
+  for (std::size_t lane = 0; lane < lanes; ++lane) {
+    machines[lane]->tryRun();
+    expected += machines[lane]->getSteps();
+    checkLane(batch, lane, *machines[lane]);
+    Y64_CHECK(batch.getStat(lane) != Machine::Stat::AOK);
+  }
+  Y64_CHECK_EQ(total, expected);
+
+  // Lanes taking `patch` leave the batch once they get there
+  std::size_t patching = lanes / 4 + (lanes % 4 > 1 ? 1 : 0);
+  Y64_CHECK_EQ(batch.getStats().handedOff, patching);
+}
+
+} // namespace
+
+int main() {
+  std::vector<std::uint8_t> image = testing::assemble(kProgram);
+  for (std::size_t lanes : {1, 4, 16, 37}) {
+    checkBatch(image, lanes, Machine::kNoStepLimit);
+    checkBatch(image, lanes, 30);
+    checkBatch(image, lanes, 1);
+  }
+  return testing::result();
+}
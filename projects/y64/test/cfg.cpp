@@ -0,0 +1,170 @@
+// Cfg blocks, functions, dominators and loops of a program with nested
+// loops, a call, an irreducible cycle and a jump to bytes that do not decode
+
+#include "testing.hpp"
+
+#include "../src/y64lib/y64cfg.hpp"
+
+#include <map>
+
+using namespace y64;
+
+namespace {
+
+const char *kProgram = R"(
+    irmovq stack, %rsp
+    irmovq $3, %rcx
+    irmovq $1, %r8
+outer:
+    irmovq $4, %rdx
+inner:
+    call f
+back:
+    subq %r8, %rdx
+    jne inner
+latch:
+    subq %r8, %rcx
+    jne outer
+split:
+    andq %rax, %rax
+    jl ia
+ib:
+    subq %r8, %rax
+    jg ia
+tail:
+    andq %rcx, %rcx
+    je done
+leave:
+    jmp bad
+ia:
+    addq %r8, %rax
+    jmp ib
+done:
+    halt
+f:
+    addq %r8, %rax
+    ret
+dead:
+    irmovq $1, %rax
+    .align 8
+bad:
+    .quad 0xf0
+    .pos 0x800
+stack:
+)";
+
+const std::size_t kNone = Cfg::kNone;
+
+} // namespace
+
+int main() {
+  std::string source = kProgram;
+  AsmParser parser{source};
+  parser.parseStatements();
+  std::map<std::string, std::uint64_t> at;
+  for (const auto &symbol : parser.getSymbols()) {
+    at[symbol.second] = symbol.first;
+  }
+
+  Machine m;
+  m.load(parser.getOutputBuffer());
+  Cfg cfg{m.snapshot()};
+
+  // Blocks in address order, by the label each starts at
+  const char *names[] = {"", "outer", "inner", "back", "latch", "split",
+                         "ib", "tail", "leave", "ia", "done", "f"};
+  const std::size_t kNumBlocks = sizeof(names) / sizeof(names[0]);
+  std::map<std::string, std::size_t> block;
+  const std::vector<Cfg::Block> &blocks = cfg.getBlocks();
+  Y64_CHECK_EQ(blocks.size(), kNumBlocks);
+  for (std::size_t i = 0; i < kNumBlocks && i < blocks.size(); ++i) {
+    std::uint64_t start = i == 0 ? 0 : at[names[i]];
+    Y64_CHECK_EQ(blocks[i].start, start);
+    Y64_CHECK_EQ(cfg.findBlock(start), i);
+    block[names[i]] = i;
+  }
+  if (blocks.size() != kNumBlocks) {
+    return testing::result();
+  }
+
+  // A call continues at its return address, ret and halt end the graph
+  Y64_CHECK(blocks[block["inner"]].succs ==
+            std::vector<std::size_t>{block["back"]});
+  Y64_CHECK((blocks[block["split"]].succs ==
+             std::vector<std::size_t>{block["ib"], block["ia"]}));
+  Y64_CHECK(blocks[block["f"]].succs.empty());
+  Y64_CHECK(blocks[block["done"]].succs.empty());
+  Y64_CHECK_EQ(blocks[block[""]].instructions, 3u);
+  Y64_CHECK_EQ(blocks[block["back"]].end, at["latch"]);
+  Y64_CHECK_EQ(cfg.getInstructions(), 21u);
+
+  // Only the jump to `bad` faults, with what running it reports
+  for (std::size_t i = 0; i < kNumBlocks; ++i) {
+    Y64_CHECK_EQ(blocks[i].faults, i == block["leave"]);
+  }
+  Machine run;
+  run.load(parser.getOutputBuffer());
+  run.setPC(at["bad"]);
+  run.tryStep();
+  Y64_CHECK_EQ(cfg.getFaults().size(), 1u);
+  auto fault = cfg.getFaults().find(at["bad"]);
+  if (Y64_CHECK(fault != cfg.getFaults().end())) {
+    Y64_CHECK_EQ(fault->second.stat, run.getStat());
+    Y64_CHECK_EQ(fault->second.value, run.getFaultValue());
+  }
+  Y64_CHECK(!cfg.findInstruction(at["bad"]));
+  Y64_CHECK(!cfg.findInstruction(at["dead"]));
+  Y64_CHECK_EQ(cfg.findInstruction(at["inner"])->icode,
+               Instruction::icode_call);
+  Y64_CHECK_EQ(cfg.findBlock(at["dead"]), kNone);
+
+  const std::vector<Cfg::Function> &functions = cfg.getFunctions();
+  if (Y64_CHECK_EQ(functions.size(), 2u)) {
+    Y64_CHECK_EQ(functions[0].entry, 0u);
+    Y64_CHECK_EQ(functions[0].blocks.size(), kNumBlocks - 1);
+    Y64_CHECK_EQ(functions[0].instructions, 19u);
+    Y64_CHECK_EQ(functions[1].entry, at["f"]);
+    Y64_CHECK(functions[1].blocks == std::vector<std::size_t>{block["f"]});
+    Y64_CHECK_EQ(functions[1].instructions, 2u);
+  }
+
+  // Both blocks of the cycle are entered from `split`, which dominates them
+  const std::map<std::string, std::string> idoms = {
+      {"outer", ""},  {"inner", "outer"}, {"back", "inner"},
+      {"latch", "back"}, {"split", "latch"}, {"ib", "split"},
+      {"tail", "ib"}, {"leave", "tail"},  {"ia", "split"},
+      {"done", "tail"}};
+  Y64_CHECK_EQ(blocks[block[""]].idom, kNone);
+  Y64_CHECK_EQ(blocks[block["f"]].idom, kNone);
+  for (const auto &idom : idoms) {
+    Y64_CHECK_EQ(blocks[block[idom.first]].idom, block[idom.second]);
+  }
+  Y64_CHECK(cfg.dominates(block["outer"], block["done"]));
+  Y64_CHECK(cfg.dominates(block["ia"], block["ia"]));
+  Y64_CHECK(!cfg.dominates(block["ia"], block["ib"]));
+  Y64_CHECK(!cfg.dominates(block["ib"], block["ia"]));
+  Y64_CHECK(!cfg.dominates(block[""], block["f"]));
+
+  // The inner loop inside the outer one, and no loop for the cycle
+  const std::vector<Cfg::Loop> &loops = cfg.getLoops();
+  if (Y64_CHECK_EQ(loops.size(), 2u)) {
+    Y64_CHECK_EQ(loops[0].header, block["outer"]);
+    Y64_CHECK_EQ(loops[0].parent, kNone);
+    Y64_CHECK_EQ(loops[0].depth, 1u);
+    Y64_CHECK((loops[0].blocks ==
+               std::vector<std::size_t>{block["outer"], block["inner"],
+                                        block["back"], block["latch"]}));
+    Y64_CHECK_EQ(loops[0].instructions, 6u);
+    Y64_CHECK_EQ(loops[1].header, block["inner"]);
+    Y64_CHECK_EQ(loops[1].parent, 0u);
+    Y64_CHECK_EQ(loops[1].depth, 2u);
+    Y64_CHECK((loops[1].blocks ==
+               std::vector<std::size_t>{block["inner"], block["back"]}));
+    Y64_CHECK_EQ(loops[1].instructions, 3u);
+  }
+  Y64_CHECK_EQ(blocks[block["back"]].loop, 1u);
+  Y64_CHECK_EQ(blocks[block["latch"]].loop, 0u);
+  Y64_CHECK_EQ(blocks[block["ia"]].loop, kNone);
+  Y64_CHECK_EQ(blocks[block["ib"]].loop, kNone);
+  return testing::result();
+}
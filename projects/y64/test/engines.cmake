@@ -0,0 +1,38 @@
+# Run CASE, a .ys program, with every engine of yis --batch and check that
+# they all stop in the same state as the staged one:
+#   # max-steps: N   stop after N instructions (default 100000)
+#   # expect: TEXT   the staged run has to print TEXT
+# Counters only some engines keep are left out of the comparison.
+
+file(READ ${CASE} source)
+set(maxSteps 100000)
+if(source MATCHES "# max-steps: ([0-9]+)")
+  set(maxSteps ${CMAKE_MATCH_1})
+endif()
+string(REGEX MATCHALL "# expect: [^\n]*" expectedLines "${source}")
+
+foreach(engine staged threaded jit block pipe)
+  execute_process(COMMAND ${YIS} --batch --max-steps ${maxSteps}
+    --engine ${engine} -ys ${CASE}
+    RESULT_VARIABLE result OUTPUT_VARIABLE out ERROR_VARIABLE err)
+  string(REGEX REPLACE ", time: [^\n]*" "" out "${out}")
+  string(REGEX REPLACE
+    "(fused pairs|jit|block cache|pipeline):[^\n]*\n" ""
+    out "${out}")
+  set(state "exit code ${result}\n${out}${err}")
+
+  if(engine STREQUAL "staged")
+    set(expected "${state}")
+    foreach(line ${expectedLines})
+      string(REPLACE "# expect: " "" line "${line}")
+      string(FIND "${state}" "${line}" found)
+      if(found EQUAL -1)
+        message(FATAL_ERROR "staged run of ${CASE} printed\n${state}"
+          "without\n${line}")
+      endif()
+    endforeach()
+  elseif(NOT state STREQUAL expected)
+    message(FATAL_ERROR "${engine} run of ${CASE} stopped in\n${state}"
+      "instead of\n${expected}")
+  endif()
+endforeach()
@@ -0,0 +1,144 @@
+// Fleet::run() gives every instance what a machine of its own gives
+
+#include "testing.hpp"
+
+#include "../src/y64lib/y64fleet.hpp"
+
+using namespace y64;
+
+namespace {
+
+// Adds 3 to the quad at 0x2000 %rdi times, and 1000 more for an odd %rdi
+// by patching f, so that instances run on a reused machine differ in data
+// and in code
+const char *kProgram = R"(
+    irmovq stack, %rsp
+    irmovq $0x2000, %rbx
+    mrmovq (%rbx), %rax
+    rrmovq %rdi, %rcx
+    irmovq $1, %r8
+    andq %rcx, %rcx
+    je done
+loop:
+    call f
+    rmmovq %rax, 8(%rbx)
+    subq %r8, %rcx
+    jne loop
+done:
+    rrmovq %rdi, %rdx
+    andq %r8, %rdx
+    je even
+    irmovq f, %rsi
+    irmovq newinst, %r9
+    mrmovq (%r9), %r9
+    rmmovq %r9, (%rsi)
+    call f
+even:
+    halt
+f:
+    irmovq $3, %r9
+    addq %r9, %rax
+    ret
+    .align 8
+newinst:
+    irmovq $1000, %r9
+    .pos 0x2000
+    .quad 0
+    .pos 0x3000
+stack:
+)";
+
+const std::uint64_t kMemorySize = 0x4000;
+const std::size_t kNumSeeds = 24;
+
+std::vector<Fleet::Seed> makeSeeds() {
+  std::vector<Fleet::Seed> seeds(kNumSeeds);
+  for (std::size_t i = 0; i < kNumSeeds; ++i) {
+    seeds[i].regs.push_back({Register::rdi, static_cast<std::int64_t>(i)});
+    seeds[i].quads.push_back({0x2000, static_cast<std::int64_t>(i * 7)});
+  }
+  // Stores outside memory, and never runs
+  seeds[5].quads.push_back({kMemorySize, 1});
+  return seeds;
+}
+
+// The same seed run by a machine of its own
+Fleet::Result runAlone(const std::vector<std::uint8_t> &image,
+                       const Fleet::Seed &seed, Machine::Engine engine,
+                       std::uint64_t maxSteps) {
+  Machine m{kMemorySize};
+  m.load(image);
+  m.setEngine(engine);
+  for (const auto &reg : seed.regs) {
+    m.setReg(reg.first, reg.second);
+  }
+  for (const auto &quad : seed.quads) {
+    m.setMemQuad(quad.first, quad.second);
+  }
+  m.tryRun(maxSteps);
+
+  Fleet::Result res{};
+  res.stat = m.getStat();
+  res.pc = m.getPC();
+  res.steps = m.getSteps();
+  res.faultValue = m.getFaultValue();
+  for (std::size_t id = 0; id < Machine::kNumGeneralRegs; ++id) {
+    res.regs[id] = m.getReg(id);
+  }
+  return res;
+}
+
+void checkFleet(const std::vector<std::uint8_t> &image,
+                Machine::Engine engine, unsigned jobs,
+                Memory::Backing backing, std::uint64_t maxSteps) {
+  Machine loaded{kMemorySize};
+  loaded.load(image);
+  Fleet fleet{loaded.snapshot()};
+  std::vector<Fleet::Seed> seeds = makeSeeds();
+  std::vector<Fleet::Result> results =
+      fleet.run(seeds, {jobs, engine, maxSteps, backing});
+  Y64_CHECK_EQ(results.size(), seeds.size());
+
+  for (std::size_t i = 0; i < results.size() && i < seeds.size(); ++i) {
+    const Fleet::Result &res = results[i];
+    if (i == 5) {
+      Y64_CHECK_EQ(res.stat, Machine::Stat::ADR);
+      Y64_CHECK_EQ(res.faultValue, kMemorySize);
+      Y64_CHECK_EQ(res.steps, 0u);
+      continue;
+    }
+
+    Fleet::Result alone = runAlone(image, seeds[i], engine, maxSteps);
+    Y64_CHECK_EQ(res.stat, alone.stat);
+    Y64_CHECK_EQ(res.pc, alone.pc);
+    Y64_CHECK_EQ(res.steps, alone.steps);
+    Y64_CHECK_EQ(res.faultValue, alone.faultValue);
+    Y64_CHECK(res.regs == alone.regs);
+    if (maxSteps == Machine::kNoStepLimit) {
+      std::int64_t expected = i * 7 + i * 3 + (i % 2 == 1 ? 1000 : 0);
+      Y64_CHECK_EQ(res.stat, Machine::Stat::HLT);
+      Y64_CHECK_EQ(res.regs[Register::rax], expected);
+    } else {
+      Y64_CHECK(res.steps <= maxSteps);
+    }
+  }
+
+  // The image is not changed by the instances
+  Machine fresh{kMemorySize};
+  fresh.load(image);
+  Y64_CHECK(testing::sameState(loaded, fresh));
+}
+
+} // namespace
+
+int main() {
+  std::vector<std::uint8_t> image = testing::assemble(kProgram);
+  for (Machine::Engine engine :
+       {Machine::Engine::Staged, Machine::Engine::Threaded,
+        Machine::Engine::Jit, Machine::Engine::Block, Machine::Engine::Pipe}) {
+    checkFleet(image, engine, 1, Memory::Backing::Heap, Machine::kNoStepLimit);
+    checkFleet(image, engine, 3, Memory::Backing::Mmap, Machine::kNoStepLimit);
+    checkFleet(image, engine, 4, Memory::Backing::Heap, 40);
+  }
+  return testing::result();
+}
@@ -0,0 +1,251 @@
+// GdbStub packets, sent by a client on a Unix socket as gdb sends them
+
+#include "testing.hpp"
+
+#include "../src/y64lib/y64gdb.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <thread>
+
+using namespace y64;
+
+namespace {
+
+const char *kProgram = R"(
+    irmovq stack, %rsp
+    irmovq data, %rbx
+    irmovq $3, %rcx
+    irmovq $1, %r8
+loop:
+    mrmovq (%rbx), %rax
+    addq %rcx, %rax
+    rmmovq %rax, (%rbx)
+    subq %r8, %rcx
+    jne loop
+end:
+    halt
+spin:
+    jmp spin
+    .align 8
+data:
+    .quad 10
+    .pos 0x400
+stack:
+)";
+
+const char kHexDigits[] = "0123456789abcdef";
+
+// Big-endian digits without leading zeros, as in addresses
+std::string hexNumber(std::uint64_t value) {
+  std::string out;
+  do {
+    out.insert(out.begin(), kHexDigits[value & 0xF]);
+    value >>= 4;
+  } while (value != 0);
+  return out;
+}
+
+// 8 bytes in target order, as in register values
+std::string hexValue(std::uint64_t value) {
+  std::string out;
+  for (int i = 0; i < 8; ++i, value >>= 8) {
+    out += kHexDigits[(value >> 4) & 0xF];
+    out += kHexDigits[value & 0xF];
+  }
+  return out;
+}
+
+std::string checksum(const std::string &data) {
+  std::uint8_t sum = 0;
+  for (char c : data) {
+    sum = static_cast<std::uint8_t>(sum + static_cast<std::uint8_t>(c));
+  }
+  std::string out;
+  out += kHexDigits[sum >> 4];
+  out += kHexDigits[sum & 0xF];
+  return out;
+}
+
+class Client {
+public:
+  explicit Client(const std::string &path) : fd(-1), ack(true) {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    // A stub that stops answering fails the test instead of hanging it
+    timeval timeout{10, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) !=
+        0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  ~Client() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  Client(const Client &) = delete;
+  Client &operator=(const Client &) = delete;
+
+  bool isConnected() const { return fd >= 0; }
+  void setAck(bool on) { ack = on; }
+
+  void sendRaw(const std::string &bytes) {
+    if (send(fd, bytes.data(), bytes.size(), 0) !=
+        static_cast<ssize_t>(bytes.size())) {
+      Y64_CHECK(!"send failed");
+    }
+  }
+
+  // Next byte from the stub, '\0' when there is none
+  char readByte() {
+    char c = '\0';
+    return recv(fd, &c, 1, 0) == 1 ? c : '\0';
+  }
+
+  // Next packet from the stub, acknowledged in ack mode
+  std::string readPacket() {
+    char c;
+    while ((c = readByte()) != '$') {
+      if (c != '+') {
+        Y64_CHECK(!"no packet");
+        return "<none>";
+      }
+    }
+    std::string body;
+    while ((c = readByte()) != '#' && c != '\0') {
+      body += c;
+    }
+    std::string sum;
+    sum += readByte();
+    sum += readByte();
+    Y64_CHECK_EQ(sum, checksum(body));
+    if (ack) {
+      sendRaw("+");
+    }
+    return body;
+  }
+
+  std::string command(const std::string &packet) {
+    sendRaw("$" + packet + "#" + checksum(packet));
+    return readPacket();
+  }
+
+private:
+  int fd;
+  bool ack;
+};
+
+} // namespace
+
+int main() {
+  std::string source = kProgram;
+  AsmParser parser{source};
+  parser.parseStatements();
+  std::map<std::string, std::uint64_t> at;
+  for (const auto &symbol : parser.getSymbols()) {
+    at[symbol.second] = symbol.first;
+  }
+
+  Machine m;
+  m.load(parser.getOutputBuffer());
+  auto stub = std::make_unique<GdbStub>(m);
+  std::string path = (fs::temp_directory_path() /
+                      ("y64-test-gdb-" + std::to_string(getpid())))
+                         .string();
+  if (!Y64_CHECK(stub->listen(path))) {
+    return testing::result();
+  }
+  bool served = false;
+  std::thread server{[&]() { served = stub->serve(); }};
+
+  {
+    Client gdb{path};
+    Y64_CHECK(gdb.isConnected());
+
+    Y64_CHECK_EQ(gdb.command("qSupported:multiprocess+;swbreak+"),
+                 "PacketSize=4000;QStartNoAckMode+");
+    // A bad checksum is refused, and the stub waits for the packet again
+    gdb.sendRaw("$?#00");
+    Y64_CHECK_EQ(gdb.readByte(), '-');
+    Y64_CHECK_EQ(gdb.command("?"), "S05");
+    // The last reply again, on request
+    gdb.sendRaw("-");
+    Y64_CHECK_EQ(gdb.readPacket(), "S05");
+    Y64_CHECK_EQ(gdb.command("QStartNoAckMode"), "OK");
+    gdb.setAck(false);
+
+    Y64_CHECK_EQ(gdb.command("qAttached"), "1");
+    Y64_CHECK_EQ(gdb.command("Hg0"), "OK");
+    Y64_CHECK_EQ(gdb.command("qfThreadInfo"), "m1");
+    Y64_CHECK_EQ(gdb.command("vMustReplyEmpty"), "");
+
+    // 16 general registers, %rip, eflags and 6 segment registers
+    std::string regs = gdb.command("g");
+    Y64_CHECK_EQ(regs.size(), 2u * (17 * 8 + 7 * 4));
+    Y64_CHECK_EQ(gdb.command("p10"), hexValue(0));
+    Y64_CHECK_EQ(gdb.command("P3=2a00000000000000"), "OK");
+    Y64_CHECK_EQ(gdb.command("p3"), hexValue(42));
+    Y64_CHECK_EQ(gdb.command("p3f"), "E01");
+
+    std::string data = hexNumber(at["data"]);
+    Y64_CHECK_EQ(gdb.command("m" + data + ",8"), hexValue(10));
+    Y64_CHECK_EQ(gdb.command("M" + data + ",1:0b"), "OK");
+    Y64_CHECK_EQ(gdb.command("m" + data + ",8"), hexValue(11));
+    Y64_CHECK_EQ(gdb.command("m100000,8"), "E01");
+
+    // Breakpoint at the loop, a step, and a watchpoint on the sum
+    std::string loop = hexNumber(at["loop"]);
+    Y64_CHECK_EQ(gdb.command("Z0," + loop + ",1"), "OK");
+    Y64_CHECK_EQ(gdb.command("c"), "S05");
+    Y64_CHECK_EQ(gdb.command("p10"), hexValue(at["loop"]));
+    Y64_CHECK_EQ(gdb.command("c"), "S05");
+    Y64_CHECK_EQ(gdb.command("p0"), hexValue(14));
+    Y64_CHECK_EQ(gdb.command("s"), "S05");
+    Y64_CHECK_EQ(gdb.command("p10"), hexValue(at["loop"] + 10));
+    Y64_CHECK_EQ(gdb.command("z0," + loop + ",1"), "OK");
+    Y64_CHECK_EQ(gdb.command("Z2," + data + ",8"), "OK");
+    Y64_CHECK_EQ(gdb.command("c"), "T05watch:" + data + ";");
+    Y64_CHECK_EQ(gdb.command("z2," + data + ",8"), "OK");
+
+    // Ctrl-C stops a program that never halts
+    Y64_CHECK_EQ(gdb.command("P10=" + hexValue(at["spin"])), "OK");
+    gdb.sendRaw("$c#63");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    gdb.sendRaw("\x03");
+    Y64_CHECK_EQ(gdb.readPacket(), "S02");
+
+    // Continuing at `end` halts
+    Y64_CHECK_EQ(gdb.command("c" + hexNumber(at["end"])), "W00");
+    Y64_CHECK_EQ(gdb.command("D"), "OK");
+  }
+
+  server.join();
+  Y64_CHECK(served);
+  stub.reset();
+  Y64_CHECK(!fs::exists(path));
+  Y64_CHECK_EQ(m.getStat(), Machine::Stat::HLT);
+  Y64_CHECK_EQ(m.getReg(Register::rdx), 42);
+  // The store the watchpoint stopped never happened
+  Y64_CHECK_EQ(m.getMemory().readQuad(at["data"]), 14);
+  return testing::result();
+}
+
+#else
+
+int main() { return 0; }
+
+#endif
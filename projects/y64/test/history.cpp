@@ -0,0 +1,134 @@
+// History::back() and backToWrite() land on the state a fresh run to the
+// same step has
+
+#include "testing.hpp"
+
+#include "../src/y64lib/y64history.hpp"
+
+using namespace y64;
+
+namespace {
+
+// Every write to 0x1000, 0x1008 and the slot pushq writes changes its
+// lowest byte, so the last write to them is where that byte last changed
+const char *kProgram = R"(
+    irmovq stack, %rsp
+    irmovq $0x1000, %rbx
+    irmovq $1, %r8
+    irmovq $30, %rcx
+loop:
+    mrmovq (%rbx), %rax
+    addq %r8, %rax
+    rmmovq %rax, (%rbx)
+    pushq %rcx
+    call f
+    popq %rdx
+    subq %r8, %rcx
+    jne loop
+    halt
+f:
+    rmmovq %rcx, 8(%rbx)
+    ret
+    .pos 0x1000
+    .quad 0
+    .quad 0
+    .pos 0x1800
+stack:
+)";
+
+const std::uint64_t kMemorySize = 0x2000;
+const std::uint64_t kWritten[] = {0x1000, 0x1008, 0x17f8};
+
+// Whether m is as the image is after `steps` instructions
+bool sameAsRun(const Machine &m, const std::vector<std::uint8_t> &image,
+               std::uint64_t steps) {
+  Machine ref{kMemorySize};
+  ref.load(image);
+  ref.tryRun(steps);
+  return testing::sameState(m, ref);
+}
+
+// The step before the last instruction up to `steps` that changed the byte
+// at addr, `steps` if none did from `from` on
+std::uint64_t lastWrite(const std::vector<std::uint8_t> &image,
+                        std::uint64_t from, std::uint64_t steps,
+                        std::uint64_t addr) {
+  Machine m{kMemorySize};
+  m.load(image);
+  m.tryRun(from);
+  std::uint64_t last = steps;
+  while (m.getSteps() < steps) {
+    std::uint8_t before = m.getMemory().readByte(addr);
+    std::uint64_t step = m.getSteps();
+    m.tryStep();
+    if (m.getMemory().readByte(addr) != before) {
+      last = step;
+    }
+  }
+  return last;
+}
+
+void checkHistory(const std::vector<std::uint8_t> &image,
+                  Machine::Engine engine, std::uint64_t interval,
+                  std::uint64_t from) {
+  Machine m{kMemorySize};
+  m.load(image);
+  m.setEngine(engine);
+  m.tryRun(from);
+  History history{m, interval};
+  Y64_CHECK_EQ(history.getStart(), from);
+
+  // Forward and back, also past the start
+  Y64_CHECK_EQ(history.forward(200), 200u);
+  Y64_CHECK(sameAsRun(m, image, from + 200));
+  Y64_CHECK_EQ(history.back(1), 1u);
+  Y64_CHECK(sameAsRun(m, image, from + 199));
+  Y64_CHECK_EQ(history.back(150), 150u);
+  Y64_CHECK(sameAsRun(m, image, from + 49));
+  Y64_CHECK_EQ(history.forward(60), 60u);
+  Y64_CHECK(sameAsRun(m, image, from + 109));
+  Y64_CHECK_EQ(history.back(1000), 109u);
+  Y64_CHECK(sameAsRun(m, image, from));
+
+  // To the end, then back to the last write of each address in turn
+  history.forward(Machine::kNoStepLimit);
+  Y64_CHECK_EQ(m.getStat(), Machine::Stat::HLT);
+  std::uint64_t end = m.getSteps();
+  for (int round = 0; round < 3; ++round) {
+    for (std::uint64_t addr : kWritten) {
+      std::uint64_t now = m.getSteps();
+      std::uint64_t expected = lastWrite(image, from, now, addr);
+      Y64_CHECK_EQ(history.backToWrite(addr), expected != now);
+      Y64_CHECK_EQ(m.getSteps(), expected);
+      Y64_CHECK(sameAsRun(m, image, expected));
+    }
+  }
+
+  // Nothing wrote there, or not since the start
+  std::uint64_t now = m.getSteps();
+  Y64_CHECK(!history.backToWrite(0x1100));
+  Y64_CHECK_EQ(m.getSteps(), now);
+  history.back(Machine::kNoStepLimit);
+  Y64_CHECK(!history.backToWrite(0x1000));
+  Y64_CHECK_EQ(m.getSteps(), from);
+
+  // Forward again runs as the first time did
+  history.forward(Machine::kNoStepLimit);
+  Y64_CHECK_EQ(m.getSteps(), end);
+  Y64_CHECK(sameAsRun(m, image, end));
+}
+
+} // namespace
+
+int main() {
+  std::vector<std::uint8_t> image = testing::assemble(kProgram);
+  for (Machine::Engine engine :
+       {Machine::Engine::Staged, Machine::Engine::Threaded,
+        Machine::Engine::Jit, Machine::Engine::Block, Machine::Engine::Pipe}) {
+    for (std::uint64_t interval : {1, 7, 64, 4096}) {
+      checkHistory(image, engine, interval, 0);
+      checkHistory(image, engine, interval, 13);
+    }
+  }
+  return testing::result();
+}
@@ -0,0 +1,23 @@
+# Run CASE, a .ys program, with yis --batch --engine pipe and check its
+# timing: every
+#   # pipeline: TEXT
+# line of the case has to be part of the "pipeline:" line printed.
+
+file(READ ${CASE} source)
+string(REGEX MATCHALL "# pipeline: [^\n]*" expectedParts "${source}")
+
+execute_process(COMMAND ${YIS} --batch --engine pipe -ys ${CASE}
+  RESULT_VARIABLE result OUTPUT_VARIABLE out ERROR_VARIABLE err)
+if(NOT out MATCHES "\npipeline: ([^\n]*)")
+  message(FATAL_ERROR "pipe run of ${CASE} printed no timing\n${out}${err}")
+endif()
+set(timing "${CMAKE_MATCH_1}")
+
+foreach(part ${expectedParts})
+  string(REPLACE "# pipeline: " "" part "${part}")
+  string(FIND "${timing}" "${part}" found)
+  if(found EQUAL -1)
+    message(FATAL_ERROR "pipe run of ${CASE} timed\n${timing}\nwithout\n"
+      "${part}")
+  endif()
+endforeach()
@@ -0,0 +1,165 @@
+// Machine::snapshot() and restore() with every engine and page backing
+
+#include "testing.hpp"
+
+using namespace y64;
+
+namespace {
+
+// Writes three pages, and runs f before and after patching it
+const char *kProgram = R"(
+    irmovq stack, %rsp
+    irmovq $0x1000, %rbx
+    irmovq $0x3000, %rbp
+    irmovq $1, %r8
+    irmovq $40, %rcx
+loop:
+    mrmovq (%rbx), %rax
+    addq %rcx, %rax
+    rmmovq %rax, (%rbx)
+    pushq %rax
+    popq %rdx
+    rmmovq %rdx, 8(%rbp)
+    subq %r8, %rcx
+    jne loop
+    call f
+    irmovq f, %rsi
+    irmovq newinst, %rdi
+    mrmovq (%rdi), %rdi
+    rmmovq %rdi, (%rsi)
+    call f
+    halt
+f:
+    irmovq $1, %r9
+    addq %r9, %r10
+    ret
+    .align 8
+newinst:
+    irmovq $100, %r9
+    .pos 0x1000
+    .quad 5
+    .pos 0x5000
+stack:
+)";
+
+// Patches f before it ever runs, so that f is only translated patched
+const char *kPatchFirst = R"(
+    irmovq stack, %rsp
+    irmovq f, %rsi
+    irmovq newinst, %rdi
+    mrmovq (%rdi), %rdi
+    rmmovq %rdi, (%rsi)
+    call f
+    halt
+f:
+    irmovq $1, %r9
+    addq %r9, %r10
+    ret
+    .align 8
+newinst:
+    irmovq $100, %r9
+    .pos 0x800
+stack:
+)";
+
+const std::uint64_t kMemorySize = 0x10000;
+
+void checkEngine(const std::vector<std::uint8_t> &image,
+                 Machine::Engine engine, Memory::Backing backing) {
+  Machine ref{kMemorySize};
+  ref.load(image);
+  ref.setEngine(engine);
+  ref.tryRun();
+  Y64_CHECK_EQ(ref.getStat(), Machine::Stat::HLT);
+  Y64_CHECK_EQ(ref.getReg(Register::r10), 101);
+
+  Machine loaded{kMemorySize};
+  loaded.load(image);
+
+  Machine m{kMemorySize, backing};
+  m.load(image);
+  m.setEngine(engine);
+  Machine::Snapshot start = m.snapshot();
+  m.tryRun();
+  Y64_CHECK(testing::sameState(m, ref));
+  Y64_CHECK(!m.getMemory().dirtyPages().empty());
+
+  // The pages and the patched code go back, and run the same again
+  m.restore(start);
+  Y64_CHECK(testing::sameState(m, loaded));
+  Y64_CHECK(m.getMemory().dirtyPages().empty());
+  Y64_CHECK(m.getMemory().isBasedOn(*start.memory));
+  m.tryRun();
+  Y64_CHECK(testing::sameState(m, ref));
+
+  // From the middle of the loop, and back to the start from there
+  m.restore(start);
+  m.tryRun(137);
+  Y64_CHECK_EQ(m.getSteps(), 137u);
+  Machine::Snapshot middle = m.snapshot();
+  m.tryRun();
+  Y64_CHECK(testing::sameState(m, ref));
+  m.restore(middle);
+  Y64_CHECK_EQ(m.getSteps(), 137u);
+  m.tryRun();
+  Y64_CHECK(testing::sameState(m, ref));
+
+  // Writes after a snapshot do not reach it
+  Machine::Snapshot end = m.snapshot();
+  m.restore(start);
+  Y64_CHECK_EQ(m.getMemory().readQuad(0x1000), 5);
+  m.restore(end);
+  Y64_CHECK(testing::sameState(m, ref));
+
+  // A snapshot of one machine restored into another
+  Machine other{kMemorySize, backing};
+  other.setEngine(engine);
+  other.restore(start);
+  other.tryRun();
+  Y64_CHECK(testing::sameState(other, ref));
+  other.restore(start);
+  other.tryRun();
+  Y64_CHECK(testing::sameState(other, ref));
+}
+
+// Code translated from a page that a restore takes back is not run again
+void checkRestoredCode(Machine::Engine engine) {
+  std::string source = kPatchFirst;
+  AsmParser parser{source};
+  parser.parseStatements();
+  std::uint64_t f = 0;
+  for (const auto &symbol : parser.getSymbols()) {
+    if (symbol.second == "f") {
+      f = symbol.first;
+    }
+  }
+
+  Machine m{kMemorySize};
+  m.load(parser.getOutputBuffer());
+  m.setEngine(engine);
+  Machine::Snapshot start = m.snapshot();
+  m.tryRun();
+  Y64_CHECK_EQ(m.getReg(Register::r10), 100);
+
+  // f returns to 0, which patches f and calls it again
+  m.restore(start);
+  m.setPC(f);
+  m.setReg(Register::rsp, 0x800 - 8);
+  m.tryRun();
+  Y64_CHECK_EQ(m.getStat(), Machine::Stat::HLT);
+  Y64_CHECK_EQ(m.getReg(Register::r10), 101);
+}
+
+} // namespace
+
+int main() {
+  std::vector<std::uint8_t> image = testing::assemble(kProgram);
+  for (Machine::Engine engine :
+       {Machine::Engine::Staged, Machine::Engine::Threaded,
+        Machine::Engine::Jit, Machine::Engine::Block, Machine::Engine::Pipe}) {
+    checkEngine(image, engine, Memory::Backing::Heap);
+    checkEngine(image, engine, Memory::Backing::Mmap);
+    checkRestoredCode(engine);
+  }
+  return testing::result();
+}
@@ -0,0 +1,99 @@
+#ifndef Y64_TEST_TESTING_HPP
+#define Y64_TEST_TESTING_HPP
+
+// Helpers of the library tests. Every test is an executable that reports
+// each failed check and exits non-zero if there was one.
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "../src/y64lib/y64machine.hpp"
+#include "../src/y64lib/y64parser.hpp"
+
+namespace y64 {
+namespace testing {
+
+inline int &failures() {
+  static int count = 0;
+  return count;
+}
+
+// Enumerations are printed as numbers
+template <typename T>
+typename std::enable_if<std::is_enum<T>::value, long long>::type
+printable(T value) {
+  return static_cast<long long>(value);
+}
+template <typename T>
+typename std::enable_if<!std::is_enum<T>::value, const T &>::type
+printable(const T &value) {
+  return value;
+}
+
+inline bool check(bool ok, const char *what, const char *file, int line) {
+  if (!ok) {
+    std::cerr << file << ":" << line << ": check failed: " << what << "\n";
+    ++failures();
+  }
+  return ok;
+}
+
+template <typename A, typename B>
+bool checkEqual(const A &a, const B &b, const char *what, const char *file,
+                int line) {
+  if (a == b) {
+    return true;
+  }
+  std::cerr << file << ":" << line << ": check failed: " << what << " ("
+            << printable(a) << " != " << printable(b) << ")\n";
+  ++failures();
+  return false;
+}
+
+// Exit code of the test
+inline int result() { return failures() == 0 ? 0 : 1; }
+
+// Image of `source` as Machine::load() takes it
+inline std::vector<std::uint8_t> assemble(const std::string &source) {
+  AsmParser parser{source};
+  parser.parseStatements();
+  return parser.getOutputBuffer();
+}
+
+// Whether a and b have the same registers, flags, PC, Stat, step count,
+// fault value and memory
+inline bool sameState(const Machine &a, const Machine &b) {
+  for (std::size_t id = 0; id < Machine::kNumGeneralRegs; ++id) {
+    if (a.getReg(id) != b.getReg(id)) {
+      return false;
+    }
+  }
+  std::uint8_t zfA, sfA, ofA, zfB, sfB, ofB;
+  a.getFlags(zfA, sfA, ofA);
+  b.getFlags(zfB, sfB, ofB);
+  if (zfA != zfB || sfA != sfB || ofA != ofB || a.getPC() != b.getPC() ||
+      a.getStat() != b.getStat() || a.getSteps() != b.getSteps() ||
+      a.getFaultValue() != b.getFaultValue() ||
+      a.getMemory().size() != b.getMemory().size()) {
+    return false;
+  }
+  for (std::uint64_t addr = 0; addr < a.getMemory().size(); addr += 8) {
+    if (a.getMemory().readQuad(addr) != b.getMemory().readQuad(addr)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace testing
+} // namespace y64
+
+#define Y64_CHECK(COND)                                                        \
+  ::y64::testing::check((COND), #COND, __FILE__, __LINE__)
+#define Y64_CHECK_EQ(A, B)                                                     \
+  ::y64::testing::checkEqual((A), (B), #A " == " #B, __FILE__, __LINE__)
+
+#endif // !Y64_TEST_TESTING_HPP
@@ -0,0 +1,47 @@
+# Record CASE, a .ys program, with yis --batch --trace for every engine,
+# and check that yis --replay of the trace rebuilds the state the run
+# stopped in, and the state after a few of its first steps.
+
+file(MAKE_DIRECTORY ${WORK})
+
+# The register dump yis prints for a state
+function(state_of output var)
+  if(NOT output MATCHES "PC:[^\n]*\n(%[^\n]*\n)+")
+    message(FATAL_ERROR "no state in\n${output}")
+  endif()
+  set(${var} "${CMAKE_MATCH_0}" PARENT_SCOPE)
+endfunction()
+
+foreach(engine staged threaded jit block pipe)
+  set(trace ${WORK}/${engine}.trace)
+  execute_process(COMMAND ${YIS} --batch --engine ${engine} --trace ${trace}
+    -ys ${CASE} OUTPUT_VARIABLE out ERROR_VARIABLE err)
+  state_of("${out}" recorded)
+  if(NOT out MATCHES "\nsteps: ([0-9]+)")
+    message(FATAL_ERROR "${engine} run of ${CASE} printed\n${out}${err}")
+  endif()
+  set(steps ${CMAKE_MATCH_1})
+
+  execute_process(COMMAND ${YIS} --replay ${trace}
+    OUTPUT_VARIABLE out ERROR_VARIABLE err)
+  state_of("${out}${err}" replayed)
+  if(NOT replayed STREQUAL recorded)
+    message(FATAL_ERROR "replay of the ${engine} trace of ${CASE} ended in\n"
+      "${replayed}instead of\n${recorded}")
+  endif()
+
+  math(EXPR half "${steps} / 2")
+  math(EXPR last "${steps} - 1")
+  foreach(limit 1 2 ${half} ${last})
+    execute_process(COMMAND ${YIS} --batch --max-steps ${limit} -ys ${CASE}
+      OUTPUT_VARIABLE out ERROR_VARIABLE err)
+    state_of("${out}" expected)
+    execute_process(COMMAND ${YIS} --replay ${trace} --max-steps ${limit}
+      OUTPUT_VARIABLE out ERROR_VARIABLE err)
+    state_of("${out}${err}" replayed)
+    if(NOT replayed STREQUAL expected)
+      message(FATAL_ERROR "replay of ${limit} steps of the ${engine} trace "
+        "of ${CASE} ended in\n${replayed}instead of\n${expected}")
+    endif()
+  endforeach()
+endforeach()
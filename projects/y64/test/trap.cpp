@@ -0,0 +1,193 @@
+// Breakpoints and watchpoints stop every engine where they stop the staged
+// one, and leave no trace on the code once cleared
+
+#include "testing.hpp"
+
+using namespace y64;
+
+namespace {
+
+const char *kProgram = R"(
+    irmovq stack, %rsp
+    irmovq data, %rbx
+    irmovq $1, %r8
+    irmovq $40, %rcx
+loop:
+    mrmovq (%rbx), %rax
+body:
+    addq %rcx, %rax
+    rmmovq %rax, (%rbx)
+    pushq %rax
+    popq %rdx
+    mrmovq 8(%rbx), %rsi
+    subq %r8, %rcx
+    jne loop
+    halt
+    .align 8
+data:
+    .quad 0
+    .quad 7
+    .pos 0x800
+stack:
+)";
+
+const std::uint64_t kMemorySize = 0x1000;
+
+struct Stop {
+  Machine::Stat stat;
+  std::uint64_t pc;
+  std::uint64_t steps;
+  std::uint64_t faultValue;
+  std::int64_t rax;
+};
+
+bool operator==(const Stop &a, const Stop &b) {
+  return a.stat == b.stat && a.pc == b.pc && a.steps == b.steps &&
+         a.faultValue == b.faultValue && a.rax == b.rax;
+}
+
+// Run m to the end, stepping over every trap, and list where it stopped
+std::vector<Stop> runStops(Machine &m) {
+  std::vector<Stop> stops;
+  while (true) {
+    m.tryRun();
+    stops.push_back({m.getStat(), m.getPC(), m.getSteps(), m.getFaultValue(),
+                     m.getReg(Register::rax)});
+    if (m.getStat() != Machine::Stat::TRP || stops.size() > 100) {
+      return stops;
+    }
+    m.tryStepOver();
+  }
+}
+
+using Setup = void (*)(Machine &m, std::uint64_t body, std::uint64_t data);
+
+void checkStops(const std::vector<std::uint8_t> &image, std::uint64_t body,
+                std::uint64_t data, Setup setup, std::size_t count) {
+  Machine plain{kMemorySize};
+  plain.load(image);
+  plain.tryRun();
+
+  std::vector<Stop> expected;
+  for (Machine::Engine engine :
+       {Machine::Engine::Staged, Machine::Engine::Threaded,
+        Machine::Engine::Jit, Machine::Engine::Block, Machine::Engine::Pipe}) {
+    Machine m{kMemorySize};
+    m.load(image);
+    m.setEngine(engine);
+    setup(m, body, data);
+    std::vector<Stop> stops = runStops(m);
+    Y64_CHECK_EQ(stops.size(), count);
+    if (engine == Machine::Engine::Staged) {
+      expected = stops;
+    } else {
+      Y64_CHECK(stops == expected);
+    }
+    // Traps do not change how the program runs
+    Y64_CHECK(testing::sameState(m, plain));
+  }
+}
+
+// After the breakpoint is cleared, the loop runs translated again
+void checkRetranslated(const std::vector<std::uint8_t> &image,
+                       std::uint64_t body) {
+  Machine m{kMemorySize};
+  m.load(image);
+  m.setEngine(Machine::Engine::Jit);
+  m.tryRun(30);
+  m.setBreakpoint(body);
+  m.tryRun();
+  Y64_CHECK_EQ(m.getStat(), Machine::Stat::TRP);
+  Y64_CHECK_EQ(m.getPC(), body);
+  Y64_CHECK(m.clearBreakpoint(body));
+  std::uint64_t interpreted = m.getJitStats().interpreted;
+  m.tryStepOver();
+  m.tryRun();
+  Y64_CHECK_EQ(m.getStat(), Machine::Stat::HLT);
+  Y64_CHECK(m.getJitStats().interpreted - interpreted < 4);
+
+  // Nor does turning trapping off and on drop the loop for good
+  Machine n{kMemorySize};
+  n.load(image);
+  n.setEngine(Machine::Engine::Jit);
+  n.setBreakpoint(body);
+  n.setTrapping(false);
+  n.tryRun(30);
+  n.setTrapping(true);
+  n.tryRun();
+  Y64_CHECK_EQ(n.getStat(), Machine::Stat::TRP);
+  n.clearBreakpoint(body);
+  interpreted = n.getJitStats().interpreted;
+  n.tryStepOver();
+  n.tryRun();
+  Y64_CHECK_EQ(n.getStat(), Machine::Stat::HLT);
+  Y64_CHECK(n.getJitStats().interpreted - interpreted < 4);
+}
+
+} // namespace
+
+int main() {
+  std::string source = kProgram;
+  AsmParser parser{source};
+  parser.parseStatements();
+  std::uint64_t body = 0;
+  std::uint64_t data = 0;
+  for (const auto &symbol : parser.getSymbols()) {
+    if (symbol.second == "body") {
+      body = symbol.first;
+    } else if (symbol.second == "data") {
+      data = symbol.first;
+    }
+  }
+  std::vector<std::uint8_t> image = parser.getOutputBuffer();
+
+  // Once per iteration, and the halt
+  checkStops(
+      image, body, data,
+      [](Machine &m, std::uint64_t body, std::uint64_t) {
+        m.setBreakpoint(body);
+      },
+      41);
+  // Set in the middle of the run, cleared right away
+  checkStops(
+      image, body, data,
+      [](Machine &m, std::uint64_t body, std::uint64_t) {
+        m.tryRun(50);
+        m.setBreakpoint(body);
+        m.tryRun();
+        m.clearBreakpoint(body);
+        m.tryStepOver();
+      },
+      1);
+  // Stores to the sum, loads of it, and both
+  checkStops(
+      image, body, data,
+      [](Machine &m, std::uint64_t, std::uint64_t data) {
+        m.setWatchpoint(data, 8, Machine::Watch::Write);
+      },
+      41);
+  checkStops(
+      image, body, data,
+      [](Machine &m, std::uint64_t, std::uint64_t data) {
+        m.setWatchpoint(data + 8, 1, Machine::Watch::Read);
+      },
+      41);
+  checkStops(
+      image, body, data,
+      [](Machine &m, std::uint64_t, std::uint64_t data) {
+        m.setWatchpoint(data, 8, Machine::Watch::Access);
+      },
+      81);
+  // Trapping off ignores both
+  checkStops(
+      image, body, data,
+      [](Machine &m, std::uint64_t body, std::uint64_t data) {
+        m.setBreakpoint(body);
+        m.setWatchpoint(data, 16, Machine::Watch::Access);
+        m.setTrapping(false);
+      },
+      1);
+
+  checkRetranslated(image, body);
+  return testing::result();
+}
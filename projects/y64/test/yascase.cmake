@@ -0,0 +1,56 @@
+# Check one yas case, CASE, in the directory WORK:
+#   # flags: ARGS    yas options to check, such as -O
+#   # yas: TEXT      yas has to print TEXT with those options
+#   # steps: N       the program built with them has to stop after N steps
+# Both builds have to stop in the same state, apart from the step count.
+
+file(READ ${CASE} source)
+string(REGEX MATCH "# flags:([^\n]*)" unused "${source}")
+separate_arguments(flags UNIX_COMMAND "${CMAKE_MATCH_1}")
+string(REGEX MATCHALL "# yas: [^\n]*" expectedLines "${source}")
+string(REGEX MATCH "# steps: ([0-9]+)" expectedSteps "${source}")
+set(expectedSteps ${CMAKE_MATCH_1})
+
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+configure_file(${CASE} ${WORK}/plain.ys COPYONLY)
+configure_file(${CASE} ${WORK}/flags.ys COPYONLY)
+
+execute_process(COMMAND ${YAS} ${WORK}/plain.ys
+  RESULT_VARIABLE result OUTPUT_QUIET)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "yas failed on ${CASE}")
+endif()
+execute_process(COMMAND ${YAS} ${flags} ${WORK}/flags.ys
+  RESULT_VARIABLE result OUTPUT_VARIABLE yasOut ERROR_VARIABLE yasOut)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "yas ${flags} failed on ${CASE}:\n${yasOut}")
+endif()
+foreach(line ${expectedLines})
+  string(REPLACE "# yas: " "" line "${line}")
+  string(FIND "${yasOut}" "${line}" found)
+  if(found EQUAL -1)
+    message(FATAL_ERROR "yas ${flags} printed\n${yasOut}without\n${line}")
+  endif()
+endforeach()
+
+foreach(build plain flags)
+  execute_process(COMMAND ${YIS} --batch --max-steps 10000 -yo
+    ${WORK}/${build}.yo
+    RESULT_VARIABLE result OUTPUT_VARIABLE state ERROR_VARIABLE state)
+  string(REGEX MATCH "steps: ([0-9]+)" unused "${state}")
+  set(${build}Steps ${CMAKE_MATCH_1})
+  string(REGEX REPLACE "(steps|fused|self-modifying)[^\n]*\n" "" state
+    "${state}")
+  set(${build}State "${result}\n${state}")
+endforeach()
+
+if(NOT plainState STREQUAL flagsState)
+  message(FATAL_ERROR "yas ${flags} changed how ${CASE} stops, from\n"
+    "${plainState}\nto\n${flagsState}")
+endif()
+if(expectedSteps AND NOT flagsSteps EQUAL expectedSteps)
+  message(FATAL_ERROR "yas ${flags} build of ${CASE} took ${flagsSteps} "
+    "steps, not ${expectedSteps}")
+endif()
+message(STATUS "${CASE}: ${plainSteps} steps, ${flagsSteps} with ${flags}")